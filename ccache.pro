@@ -8,13 +8,21 @@ HEADERS += \
     src/ccache_config.h \
     src/cache/mcache.h \
     src/cache/cache.h \
+    src/cache/evict.h \
     src/http/request_handler.h \
     src/http/request.h \
+    src/http/scan.h \
     src/http/reply.h \
     src/lib/util.h \
     src/lib/sds.h \
-    src/lib/safe_queue.h \
+    src/lib/ring.h \
+    src/lib/pool.h \
+    src/lib/notifier.h \
+    src/lib/rcu.h \
+    src/lib/rhash.h \
+    src/lib/oadict.h \
     src/lib/objSds.h \
+    src/lib/slab.h \
     src/lib/dicttype.h \
     src/lib/dict.h \
     src/lib/adlist.h \
@@ -31,13 +39,24 @@ SOURCES += \
     src/main.c \    
     src/cache/mcache.c \
     src/cache/cache.c \
+    src/cache/evict.c \
+    src/cache/evict_gdsf.c \
+    src/cache/evict_s3fifo.c \
+    src/cache/evict_tinylfu.c \
     src/http/request_handler.c \
     src/http/request.c \
+    src/http/scan.c \
     src/http/reply.c \
     src/lib/util.c \
     src/lib/sds.c \
-    src/lib/safe_queue.c \
+    src/lib/ring.c \
+    src/lib/pool.c \
+    src/lib/notifier.c \
+    src/lib/rcu.c \
+    src/lib/rhash.c \
+    src/lib/oadict.c \
     src/lib/objSds.c \
+    src/lib/slab.c \
     src/lib/dicttype.c \
     src/lib/dict.c \
     src/lib/adlist.c \
@@ -1,4 +1,4 @@
-/* cache.c - A LRU slave cache implementation.
+/* cache.c - slave cache implementation.
  * For info about master cache, see mcache.c.
  *
  * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
@@ -32,9 +32,10 @@
 #include "malloc.h"
 #include "string.h" /* for memcpy */
 #include "lib/dicttype.h"
-#include "lib/dict.h"
+#include "lib/oadict.h"
 #include "lib/adlist.h"
 #include "ccache_config.h"
+#include "mcache.h"
 
 /*
 * long page_size = sysconf (_SC_PAGESIZE);
@@ -49,10 +50,11 @@ ccache *cacheAddSlave(void *el) {
     return c;
 }
 
+/* Entries go back to the pool of their slave cache, the private data of
+ * its table */
 void dictCacheEntryDestructor(void *privdata, void *val)
 {
-    DICT_NOTUSED(privdata);    
-    free(val);
+    poolFree(&((ccache*)privdata)->entries,val);
 }
 
 
@@ -67,107 +69,166 @@ dictType ccacheType = {
 };
 
 ccache *cacheCreate() {
+    int i;
     ccache *c = malloc(sizeof(*c));
-    c->accesslist = listCreate();
-    c->data = dictCreate(&ccacheType,NULL);
-    dictExpand(c->data,PRESERVED_CACHE_ENTRIES);
-    c->outboxOld = safeQueueCreate();
-    c->outboxNew = safeQueueCreate();
-    c->inboxNew = safeQueueCreate();
+    /* Only in-flight misses are kept, the dict grows on demand */
+    c->data = oadictCreate(&ccacheType,c);
+    c->numshards = cacheMasterNumShards();
+    c->outboxNew = malloc(sizeof(ring*)*c->numshards);
+    for(i = 0; i < c->numshards; i++)
+        c->outboxNew[i] = ringCreate(CACHE_QUEUE_SIZE,RING_SPSC);
+    /* Every shard replies into the same inbox */
+    c->inboxNew = ringCreate(CACHE_QUEUE_SIZE,
+                             c->numshards > 1 ? RING_MPSC : RING_SPSC);
+    c->inflight = 0;
+    c->hits = 0;
+    poolInit(&c->entries,sizeof(cacheEntry),CACHE_POOL_SIZE);
+    poolInit(&c->nodes,sizeof(listNode),CACHE_POOL_SIZE);
+    c->clients.hits = c->clients.misses = 0;
+    c->replies.hits = c->replies.misses = 0;
+    c->entries_mem = 0;
+    c->conns_mem = 0;
+    c->mem = oadictMemory(c->data);
+    c->wakeup = notifierCreate();
     return c;
 }
 
+/* Publish the memory used by the slave cache, as allocated, what its
+ * pools keep included */
+static void _cacheAccount(ccache *c) {
+    __atomic_store_n(&c->mem,c->entries_mem+c->conns_mem+oadictMemory(c->data)+
+                     poolMemory(&c->entries)+poolMemory(&c->nodes),__ATOMIC_RELAXED);
+}
+
 
-cacheEntry *cacheAdd(ccache *c, sds key, void *value) {
+static cacheEntry *cacheAdd(ccache *c, sds key) {
     cacheEntry *ce;
-    if ((ce = malloc(sizeof(*ce))) == NULL)
-        return NULL;
-    ce->ln = listAddNodeTailGetNode(c->accesslist,key);
-    if(!ce->ln) {
-        free(ce);
+    if ((ce = poolAlloc(&c->entries)) == NULL)
         return NULL;
-    }
-    ce->de = dictAddGetDictEntry(c->data,key,ce);
-    if(!ce->de) {
-        listDelNode(c->accesslist,ce->ln);
-        free(ce);
+    if(oadictAdd(c->data,key,ce) != OADICT_OK) {
+        poolFree(&c->entries,ce);
         return NULL;
     }
-    ce->waiting_clients = listCreate();
-    ce->de->val = ce;
-    ce->val = value;
+    ce->key = key;
+    listInit(&ce->waiting_clients);
+    ce->val = NULL;
     ce->mycache = c;
+    c->entries_mem += malloc_usable_size(ce)+sdsAllocSize(key);
+    _cacheAccount(c);
     return ce;
 }
 
-void *cacheFetch(ccache *c, sds key) {
-    cacheEntry *ce = (cacheEntry *)dictFetchValue(c->data,key);
-    if(ce) {
-        listMoveNodeToTail(c->accesslist,ce->ln);
-        return ce->val;
-    }
-    return NULL;
-}
-
+/* Return the entry of a key the worker is waiting for, asking the master
+ * for it on first use. Return NULL when the entry can not be requested:
+ * the slave has already CACHE_QUEUE_SIZE requests in flight. As the master
+ * answers each request exactly once, this also guarantees that the inbox
+ * never overflows. The key is taken: kept by a new entry, freed otherwise
+ * (the request only copies its URI on a miss). */
 cacheEntry *cacheFind(ccache *c, sds key) {
-    cacheEntry *ce = dictFetchValue(c->data,key);
+    cacheEntry *ce = oadictFetchValue(c->data,key);
     if(ce == NULL) {
-        ce = cacheAdd(c,sdsdup(key),NULL);
-        cacheSendMessage(c,ce,CACHE_REQUEST_NEW);
+        if(c->inflight >= CACHE_QUEUE_SIZE || (ce = cacheAdd(c,key)) == NULL) {
+            sdsfree(key);
+            return NULL;
+        }
+        if(cacheSendMessage(c,ce,CACHE_REQUEST_NEW) != CACHE_OK) {
+            cacheRemove(c,ce);
+            return NULL;
+        }
+        c->inflight++;
     }
+    else sdsfree(key);
     return ce;
 }
 
-void cacheDelete(ccache* c, sds key) {
-    cacheEntry *ce = (cacheEntry *)dictFetchValue(c->data,key);
-    /* Master reply by setting val to an object.
-     * We do not delete cache entry until the master reply
-     */
-    if(ce&&ce->val)
-    {
-        cacheSendMessage(c,sdsdup(key),CACHE_REQUEST_OLD);
-        listDelNode(c->accesslist,ce->ln);
-        dictDelete(c->data,key);
+/* Forget an entry once the master has answered and the waiting clients
+ * have been served */
+void cacheRemove(ccache *c, cacheEntry *ce) {
+    listNode *ln;
+    while((ln = listFirst(&ce->waiting_clients)) != NULL) {
+        listUnlinkNode(&ce->waiting_clients,ln);
+        c->entries_mem -= malloc_usable_size(ln);
+        poolFree(&c->nodes,ln);
     }
+    c->entries_mem -= malloc_usable_size(ce)+sdsAllocSize(ce->key);
+    oadictDelete(c->data,ce->key);
+    _cacheAccount(c);
 }
 
-int cacheDeleteStaleEntries(ccache *c, unsigned int n) {    
-    unsigned int remain = n;
-    listIter li;
-    listNode *ln;
+void cacheAddWaitingClient(ccache *c, cacheEntry *ce, void *client) {
+    listNode *ln = poolAlloc(&c->nodes);
+    if (ln == NULL) return;
+    ln->value = client;
+    listLinkNodeTail(&ce->waiting_clients,ln);
+    c->entries_mem += malloc_usable_size(ln);
+    _cacheAccount(c);
+}
 
-    listRewind(c->accesslist,&li);
-    while (remain-- && (ln = listNext(&li)) != NULL) {
-        sds key = listNodeValue(ln);
-        cacheDelete(c,key);
-    }
-    /* Return the number of successfully deleted entries */
-    return n - remain;
+void cacheDelWaitingClient(ccache *c, list *waiting_clients, listNode *ln) {
+    listUnlinkNode(waiting_clients,ln);
+    c->entries_mem -= malloc_usable_size(ln);
+    poolFree(&c->nodes,ln);
+    _cacheAccount(c);
+}
+
+/* Hits and misses of the pools of the worker, for the status */
+/* The pages of the connection table of a worker are only backed once its
+ * slots are used: they are counted as they are handed out */
+void cacheAddConnectionMemory(ccache *c, size_t bytes) {
+    c->conns_mem += bytes;
+    _cacheAccount(c);
 }
 
+sds cacheCatPoolStatus(ccache *c, sds status) {
+    return sdscatprintf(status,"POOLS CLIENTS: %llu/%llu REPLIES: %llu/%llu "
+                        "ENTRIES: %llu/%llu NODES: %llu/%llu",
+                        poolStatsHits(&c->clients),poolStatsMisses(&c->clients),
+                        poolStatsHits(&c->replies),poolStatsMisses(&c->replies),
+                        poolStatsHits(&c->entries.stats),poolStatsMisses(&c->entries.stats),
+                        poolStatsHits(&c->nodes.stats),poolStatsMisses(&c->nodes.stats));
+}
+
+/* Requests are routed to the master shard owning the key.
+ * Every message wakes up its receiver: requests wake up the master shard,
+ * replies wake up the event loop owning the slave cache. */
 int cacheSendMessage(ccache *c, void *msg, int forWhom){
+    int shard;
     switch(forWhom) {
         case CACHE_REQUEST_NEW:
-            return (safeQueuePush(c->outboxNew,msg) == SAFE_QUEUE_OK)? CACHE_OK:CACHE_ERR;
-        case CACHE_REQUEST_OLD:
-            return (safeQueuePush(c->outboxOld,msg) == SAFE_QUEUE_OK)? CACHE_OK:CACHE_ERR;
+            shard = cacheMasterShardOf(((cacheEntry*)msg)->key);
+            if(ringPush(c->outboxNew[shard],msg) != RING_OK) return CACHE_ERR;
+            cacheMasterWakeup(shard);
+            return CACHE_OK;
         case CACHE_REPLY_NEW:
-            return (safeQueuePush(c->inboxNew,msg) == SAFE_QUEUE_OK)? CACHE_OK:CACHE_ERR;
+            if(ringPush(c->inboxNew,msg) != RING_OK) return CACHE_ERR;
+            notifierSignal(c->wakeup);
+            return CACHE_OK;
         default:
             return CACHE_ERR;
     }
 }
 
-void *cacheGetMessage(ccache *c, int forWhom){
+static ring *_cacheMailbox(ccache *c, int forWhom, int shard) {
     switch(forWhom) {
         case CACHE_REQUEST_NEW:
-            return safeQueuePop(c->outboxNew);
-        case CACHE_REQUEST_OLD:
-            return safeQueuePop(c->outboxOld);
+            return c->outboxNew[shard];
         case CACHE_REPLY_NEW:
-            return safeQueuePop(c->inboxNew);
+            return c->inboxNew;
         default:
             return NULL;
     }
 }
 
+/* Used by the slave, which only reads its inbox */
+void *cacheGetMessage(ccache *c, int forWhom){
+    ring *q = _cacheMailbox(c,forWhom,0);
+    return q ? ringPop(q) : NULL;
+}
+
+/* Used by a master shard. Pop up to n messages at once,
+ * return the number of popped messages */
+unsigned int cacheGetMessages(ccache *c, int forWhom, int shard, void **msgs, unsigned int n){
+    ring *q = _cacheMailbox(c,forWhom,shard);
+    return q ? ringPopBatch(q,msgs,n) : 0;
+}
+
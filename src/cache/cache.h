@@ -1,4 +1,4 @@
-/* cache.h - A LRU cache implementation
+/* cache.h - slave cache: the misses a worker is waiting for
  *
  * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
  * All rights reserved.
@@ -28,51 +28,74 @@
 #ifndef CCACHE_H
 #define CCACHE_H
 
-#include "lib/dict.h"
+#include "lib/oadict.h"
 #include "lib/adlist.h"
-#include "lib/safe_queue.h"
+#include "lib/ring.h"
+#include "lib/notifier.h"
 #include "lib/sds.h"
+#include "lib/pool.h"
 
 #define CACHE_OK DICT_OK
 #define CACHE_ERR DICT_ERR
 
 #define CACHE_REQUEST_NEW 1
-#define CACHE_REQUEST_OLD 2
 #define CACHE_REPLY_NEW 4
 
 list *slave_caches;
 
 
+/* A slave cache only tracks the keys its worker is waiting for.
+ * Ready objects are looked up directly in the shared index of the
+ * master shards (cacheMasterLookup), so no key is duplicated per worker. */
 typedef struct {
-    dict *data;
-    safeQueue *outboxOld;
-    safeQueue *outboxNew;
-    safeQueue *inboxNew;
-    list *accesslist;    
+    oadict *data;     /* key -> cacheEntry, misses sent to the master */
+    int numshards;
+    ring **outboxNew; /* one per master shard */
+    ring *inboxNew;   /* shared by all master shards */
+    unsigned int inflight; /* CACHE_REQUEST_NEW not yet answered */
+    unsigned long long hits; /* requests served from the shared index */
+    size_t entries_mem; /* bytes of the entries, keys and waiting lists */
+    size_t conns_mem; /* bytes of the connection slots handed out, with
+                       * their request and replies */
+    size_t mem;       /* all of the above plus the table, read by the status */
+    notifier *wakeup; /* signaled by the master on CACHE_REPLY_NEW */
     void *el;
+    /* Pools of the worker: entries and nodes of their waiting lists are
+     * kept once released. Connection slots and their replies are kept by
+     * the client table, which counts here how often they are reused. */
+    pool entries;
+    pool nodes;
+    poolStats clients;
+    poolStats replies;
 } ccache;
 
 
+/* val is NULL until the master replies with the object, holding one
+ * reference on behalf of the entry. The entry is owned by the table, key
+ * being the table key: slots of the table move, the entry does not. */
 typedef struct cacheEntry {
-    dictEntry *de;
-    listNode *ln;
+    sds key;
     void *val;
-    list *waiting_clients;
+    list waiting_clients;
     ccache *mycache;
 } cacheEntry;
 
-#define cacheGetList(c) (c->accesslist)
 ccache *cacheCreate();
-int cacheDeleteStaleEntries(ccache *c, unsigned int n);
-void cacheDelete(ccache* c, sds key);
-cacheEntry *cacheAdd(ccache *c, sds key, void *value);
 cacheEntry *cacheFind(ccache *c, sds key);
-void *cacheFetch(ccache *c, sds key);
-#define cacheNumberOfEntry(c) (c->used)
+void cacheRemove(ccache *c, cacheEntry *ce);
+void cacheAddWaitingClient(ccache *c, cacheEntry *ce, void *client);
+void cacheDelWaitingClient(ccache *c, list *waiting_clients, listNode *ln);
+void cacheAddConnectionMemory(ccache *c, size_t bytes);
+sds cacheCatPoolStatus(ccache *c, sds status);
+#define cacheNumberOfEntry(c) (oadictSize((c)->data))
+/* Written by the worker owning the cache only, read by the status */
+#define cacheCountHit(c) __atomic_store_n(&(c)->hits,(c)->hits+1,__ATOMIC_RELAXED)
+#define cacheGetHits(c) __atomic_load_n(&(c)->hits,__ATOMIC_RELAXED)
+#define cacheGetMemory(c) __atomic_load_n(&(c)->mem,__ATOMIC_RELAXED)
 
-int cacheRequest(ccache *c, sds key);
 int cacheSendMessage(ccache *c, void *ce, int forWhom);
 void *cacheGetMessage(ccache *c, int forWhom);
+unsigned int cacheGetMessages(ccache *c, int forWhom, int shard, void **msgs, unsigned int n);
 
 ccache *cacheAddSlave(void *el);
 
@@ -0,0 +1,151 @@
+/* evict.c - eviction policy registry and the plain FIFO policy
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "evict.h"
+
+static const evictPolicy *policies[] = {
+    &evictGdsf,
+    &evictS3Fifo,
+    &evictTinyLfu,
+    &evictFifo,
+    NULL
+};
+
+const evictPolicy *evictPolicyGet(const char *name) {
+    int i;
+    for(i = 0; policies[i]; i++)
+        if(!strcmp(policies[i]->name,name)) return policies[i];
+    return NULL;
+}
+
+sds evictPolicyNames() {
+    sds names = sdsempty();
+    int i;
+    for(i = 0; policies[i]; i++)
+        names = sdscatprintf(names,"%s%s",i ? "|" : "",policies[i]->name);
+    return names;
+}
+
+/* ------------------------------ nodes & queues ---------------------------- */
+
+evictNode *evictNodeCreate(sds key, objSds *val, unsigned int hash) {
+    evictNode *n = malloc(sizeof(*n));
+    n->next = NULL;
+    n->key = key;
+    n->val = val;
+    n->size = objSdsMemLen(val);
+    n->hash = hash;
+    n->queue = 0;
+    n->freq = 0;
+    return n;
+}
+
+void evictNodeRelease(evictNode *n) {
+    free(n);
+}
+
+void evictQueueInit(evictQueue *q) {
+    q->head = q->tail = NULL;
+    q->len = 0;
+    q->bytes = 0;
+    q->mem = 0;
+}
+
+void evictQueuePush(evictQueue *q, evictNode *n) {
+    n->next = NULL;
+    if(q->tail) q->tail->next = n;
+    else q->head = n;
+    q->tail = n;
+    q->len++;
+    q->bytes += n->size;
+    q->mem += malloc_usable_size(n);
+}
+
+evictNode *evictQueuePop(evictQueue *q) {
+    evictNode *n = q->head;
+    if(n == NULL) return NULL;
+    q->head = n->next;
+    if(q->head == NULL) q->tail = NULL;
+    q->len--;
+    q->bytes -= n->size;
+    q->mem -= malloc_usable_size(n);
+    n->next = NULL;
+    return n;
+}
+
+void evictQueueRelease(evictQueue *q) {
+    evictNode *n;
+    while((n = evictQueuePop(q)) != NULL) evictNodeRelease(n);
+}
+
+/* ---------------------------------- FIFO ---------------------------------- */
+
+/* Oldest loaded first, whatever the hits */
+static void *_fifoCreate(size_t capacity) {
+    evictQueue *q = malloc(sizeof(*q));
+    (void)capacity;
+    evictQueueInit(q);
+    return q;
+}
+
+static void _fifoRelease(void *p) {
+    evictQueueRelease(p);
+    free(p);
+}
+
+static void _fifoInsert(void *p, sds key, objSds *val, unsigned int hash,
+                        unsigned long cost) {
+    (void)cost;
+    evictQueuePush(p,evictNodeCreate(key,val,hash));
+}
+
+static sds _fifoEvict(void *p) {
+    evictNode *n = evictQueuePop(p);
+    sds key;
+    if(n == NULL) return NULL;
+    key = n->key;
+    evictNodeRelease(n);
+    return key;
+}
+
+static size_t _fifoMemory(void *p) {
+    evictQueue *q = p;
+    return malloc_usable_size(q)+q->mem;
+}
+
+const evictPolicy evictFifo = {
+    "fifo",
+    _fifoCreate,
+    _fifoRelease,
+    NULL,
+    _fifoInsert,
+    _fifoEvict,
+    _fifoMemory
+};
@@ -0,0 +1,90 @@
+/* evict.h - eviction policies of the master shards
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EVICT_H
+#define EVICT_H
+
+#include <stddef.h>
+#include "lib/sds.h"
+#include "lib/objSds.h"
+
+/* An evictable object, as tracked by a policy. key and val are owned by
+ * the shard table, the node by the policy. */
+typedef struct evictNode {
+    struct evictNode *next;
+    sds key;
+    objSds *val;
+    size_t size;
+    unsigned int hash;
+    unsigned char queue;  /* queue of the policy holding the node */
+    unsigned char freq;   /* hits folded from the object so far */
+} evictNode;
+
+/* FIFO of nodes, oldest at head */
+typedef struct evictQueue {
+    evictNode *head, *tail;
+    unsigned long len;
+    size_t bytes;  /* sizes of the objects */
+    size_t mem;    /* bytes allocated for the nodes */
+} evictQueue;
+
+/* All the calls are made by the thread of the shard owning the policy.
+ * Workers only count hits on the objects themselves (objSdsTouch), a
+ * policy collects them (objSdsTakeHits) when it looks at a node: a hit
+ * never moves anything. */
+typedef struct evictPolicy {
+    const char *name;
+    void *(*create)(size_t capacity);
+    void (*release)(void *p);
+    /* A key missed and is being loaded. May be NULL. */
+    void (*miss)(void *p, unsigned int hash);
+    /* A loaded object becomes evictable. cost is the time its load took,
+     * in microseconds. */
+    void (*insert)(void *p, sds key, objSds *val, unsigned int hash,
+                   unsigned long cost);
+    /* Forget the next victim and return its key, NULL if there is none */
+    sds (*evict)(void *p);
+    /* Bytes allocated by the policy */
+    size_t (*memory)(void *p);
+} evictPolicy;
+
+extern const evictPolicy evictGdsf;
+extern const evictPolicy evictFifo;
+extern const evictPolicy evictS3Fifo;
+extern const evictPolicy evictTinyLfu;
+
+const evictPolicy *evictPolicyGet(const char *name);
+sds evictPolicyNames();
+
+evictNode *evictNodeCreate(sds key, objSds *val, unsigned int hash);
+void evictNodeRelease(evictNode *n);
+void evictQueueInit(evictQueue *q);
+void evictQueuePush(evictQueue *q, evictNode *n);
+evictNode *evictQueuePop(evictQueue *q);
+void evictQueueRelease(evictQueue *q);
+
+#endif // EVICT_H
@@ -0,0 +1,167 @@
+/* evict_gdsf.c - GreedyDual-Size-Frequency eviction policy
+ *
+ * Each object has a priority L + frequency * cost / size, where cost is the
+ * time its load took and L the priority of the last victim: small objects
+ * which are expensive to rebuild and often hit stay, big cheap ones go
+ * first, and L ages the objects not hit for long. The victim is the object
+ * of lowest priority, kept at the top of a binary heap.
+ *
+ * Hits never touch the heap. When the top object was hit since the last
+ * look, its priority is computed again with the current L and it sinks
+ * back into the heap.
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <malloc.h>
+#include "evict.h"
+
+#define GDSF_INITIAL_HEAP 1024
+
+typedef struct gdsfNode {
+    sds key;
+    objSds *val;
+    size_t size;
+    unsigned long cost;
+    unsigned long freq;
+    double priority;
+} gdsfNode;
+
+typedef struct gdsf {
+    gdsfNode **heap;
+    unsigned long len, size;
+    double clock; /* L: priority of the last victim */
+    size_t mem;   /* bytes allocated for the nodes */
+} gdsf;
+
+static void _gdsfPrioritize(gdsf *g, gdsfNode *n) {
+    n->priority = g->clock+(double)n->freq*n->cost/(n->size ? n->size : 1);
+}
+
+static void _gdsfHeapUp(gdsf *g, unsigned long i) {
+    gdsfNode *n = g->heap[i];
+    while(i > 0) {
+        unsigned long parent = (i-1)/2;
+        if(g->heap[parent]->priority <= n->priority) break;
+        g->heap[i] = g->heap[parent];
+        i = parent;
+    }
+    g->heap[i] = n;
+}
+
+static void _gdsfHeapDown(gdsf *g, unsigned long i) {
+    gdsfNode *n = g->heap[i];
+    while(1) {
+        unsigned long child = 2*i+1;
+        if(child >= g->len) break;
+        if(child+1 < g->len && g->heap[child+1]->priority < g->heap[child]->priority)
+            child++;
+        if(n->priority <= g->heap[child]->priority) break;
+        g->heap[i] = g->heap[child];
+        i = child;
+    }
+    g->heap[i] = n;
+}
+
+static void *_gdsfCreate(size_t capacity) {
+    gdsf *g = malloc(sizeof(*g));
+    (void)capacity;
+    g->size = GDSF_INITIAL_HEAP;
+    g->heap = malloc(sizeof(gdsfNode*)*g->size);
+    g->len = 0;
+    g->clock = 0;
+    g->mem = 0;
+    return g;
+}
+
+static void _gdsfRelease(void *p) {
+    gdsf *g = p;
+    unsigned long i;
+    for(i = 0; i < g->len; i++) free(g->heap[i]);
+    free(g->heap);
+    free(g);
+}
+
+static void _gdsfInsert(void *p, sds key, objSds *val, unsigned int hash,
+                        unsigned long cost) {
+    gdsf *g = p;
+    gdsfNode *n = malloc(sizeof(*n));
+    (void)hash;
+    n->key = key;
+    n->val = val;
+    n->size = objSdsMemLen(val);
+    n->cost = cost ? cost : 1;
+    n->freq = 1;
+    g->mem += malloc_usable_size(n);
+    _gdsfPrioritize(g,n);
+    if(g->len == g->size) {
+        g->size *= 2;
+        g->heap = realloc(g->heap,sizeof(gdsfNode*)*g->size);
+    }
+    g->heap[g->len++] = n;
+    _gdsfHeapUp(g,g->len-1);
+}
+
+static sds _gdsfEvict(void *p) {
+    gdsf *g = p;
+    unsigned long chances = g->len;
+    unsigned int hits;
+    gdsfNode *n;
+    sds key;
+    while(g->len) {
+        n = g->heap[0];
+        /* Chances bound the laps while workers keep hitting */
+        if(chances && (hits = objSdsTakeHits(n->val)) > 0) {
+            chances--;
+            n->freq += hits;
+            _gdsfPrioritize(g,n);
+            _gdsfHeapDown(g,0);
+            continue;
+        }
+        g->heap[0] = g->heap[--g->len];
+        if(g->len) _gdsfHeapDown(g,0);
+        g->clock = n->priority;
+        key = n->key;
+        g->mem -= malloc_usable_size(n);
+        free(n);
+        return key;
+    }
+    return NULL;
+}
+
+static size_t _gdsfMemory(void *p) {
+    gdsf *g = p;
+    return malloc_usable_size(g)+malloc_usable_size(g->heap)+g->mem;
+}
+
+const evictPolicy evictGdsf = {
+    "gdsf",
+    _gdsfCreate,
+    _gdsfRelease,
+    NULL,
+    _gdsfInsert,
+    _gdsfEvict,
+    _gdsfMemory
+};
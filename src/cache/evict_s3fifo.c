@@ -0,0 +1,190 @@
+/* evict_s3fifo.c - S3-FIFO eviction policy
+ *
+ * Three FIFO queues: new objects enter a small queue (10% of the bytes),
+ * those hit again before reaching its head move to the main queue, the
+ * others are evicted and their hash is remembered in a ghost queue. An
+ * object loaded again while still in the ghost queue goes straight to the
+ * main queue, which evicts with a CLOCK-like second chance bounded by a
+ * frequency of 3. One-hit wonders thus never push out the main queue.
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <malloc.h>
+#include "evict.h"
+#include "lib/oadict.h"
+
+#define S3FIFO_SMALL_RATIO 10 /* percent of the capacity */
+#define S3FIFO_MAX_FREQ 3
+/* The ghost queue remembers as many hashes as there are resident objects */
+#define S3FIFO_MIN_GHOSTS 64
+
+#define S3FIFO_SMALL 0
+#define S3FIFO_MAIN 1
+
+typedef struct s3fifo {
+    size_t capacity;
+    evictQueue small, main;
+    oadict *ghost;             /* hash -> 1 + sequence number in ghosts */
+    unsigned int *ghosts;      /* ring of ghost hashes, oldest at ghost_head */
+    unsigned long ghost_size;  /* power of 2 */
+    unsigned long ghost_head, ghost_tail;
+} s3fifo;
+
+static unsigned int _ghostHash(const void *key) {
+    return (unsigned int)(unsigned long)key;
+}
+
+/* Keys are the hashes themselves */
+static dictType ghostDictType = {
+    _ghostHash, /* hash function */
+    NULL,       /* key dup */
+    NULL,       /* val dup */
+    NULL,       /* key compare */
+    NULL,       /* key destructor */
+    NULL        /* val destructor */
+};
+
+#define _ghostKey(hash) ((void*)(unsigned long)(hash))
+
+static void _ghostExpire(s3fifo *s) {
+    unsigned long seq = s->ghost_head++;
+    unsigned int hash = s->ghosts[seq & (s->ghost_size-1)];
+    /* The hash may have been remembered again since */
+    if(oadictFetchValue(s->ghost,_ghostKey(hash)) == (void*)(seq+1))
+        oadictDelete(s->ghost,_ghostKey(hash));
+}
+
+static void _ghostGrow(s3fifo *s) {
+    unsigned long size = s->ghost_size*2, seq;
+    unsigned int *ghosts = malloc(sizeof(unsigned int)*size);
+    for(seq = s->ghost_head; seq != s->ghost_tail; seq++)
+        ghosts[seq & (size-1)] = s->ghosts[seq & (s->ghost_size-1)];
+    free(s->ghosts);
+    s->ghosts = ghosts;
+    s->ghost_size = size;
+}
+
+static void _ghostAdd(s3fifo *s, unsigned int hash) {
+    unsigned long limit = s->small.len+s->main.len;
+    unsigned long seq;
+    if(limit < S3FIFO_MIN_GHOSTS) limit = S3FIFO_MIN_GHOSTS;
+    while(s->ghost_tail-s->ghost_head >= limit) _ghostExpire(s);
+    if(s->ghost_tail-s->ghost_head == s->ghost_size) _ghostGrow(s);
+    seq = s->ghost_tail++;
+    s->ghosts[seq & (s->ghost_size-1)] = hash;
+    oadictReplace(s->ghost,_ghostKey(hash),(void*)(seq+1));
+}
+
+/* Fold the hits counted by the workers since the last look */
+static void _s3fifoCollect(evictNode *n) {
+    unsigned int freq = n->freq+objSdsTakeHits(n->val);
+    n->freq = freq > S3FIFO_MAX_FREQ ? S3FIFO_MAX_FREQ : freq;
+}
+
+static void *_s3fifoCreate(size_t capacity) {
+    s3fifo *s = malloc(sizeof(*s));
+    s->capacity = capacity;
+    evictQueueInit(&s->small);
+    evictQueueInit(&s->main);
+    s->ghost = oadictCreate(&ghostDictType,NULL);
+    s->ghost_size = S3FIFO_MIN_GHOSTS;
+    s->ghosts = malloc(sizeof(unsigned int)*s->ghost_size);
+    s->ghost_head = s->ghost_tail = 0;
+    return s;
+}
+
+static void _s3fifoRelease(void *p) {
+    s3fifo *s = p;
+    evictQueueRelease(&s->small);
+    evictQueueRelease(&s->main);
+    oadictRelease(s->ghost);
+    free(s->ghosts);
+    free(s);
+}
+
+static void _s3fifoInsert(void *p, sds key, objSds *val, unsigned int hash,
+                          unsigned long cost) {
+    s3fifo *s = p;
+    evictNode *n = evictNodeCreate(key,val,hash);
+    (void)cost;
+    if(oadictDelete(s->ghost,_ghostKey(hash)) == OADICT_OK) {
+        n->queue = S3FIFO_MAIN;
+        evictQueuePush(&s->main,n);
+    } else {
+        n->queue = S3FIFO_SMALL;
+        evictQueuePush(&s->small,n);
+    }
+}
+
+static sds _s3fifoEvict(void *p) {
+    s3fifo *s = p;
+    evictNode *n;
+    sds key;
+    while(1) {
+        if(s->small.len && (s->main.len == 0 ||
+                            s->small.bytes >= s->capacity/100*S3FIFO_SMALL_RATIO)) {
+            n = evictQueuePop(&s->small);
+            _s3fifoCollect(n);
+            if(n->freq > 0) {
+                /* Hit again while in the small queue */
+                n->freq = 0;
+                n->queue = S3FIFO_MAIN;
+                evictQueuePush(&s->main,n);
+                continue;
+            }
+            _ghostAdd(s,n->hash);
+        }
+        else if(s->main.len) {
+            n = evictQueuePop(&s->main);
+            _s3fifoCollect(n);
+            if(n->freq > 0) {
+                n->freq--;
+                evictQueuePush(&s->main,n);
+                continue;
+            }
+        }
+        else return NULL;
+        key = n->key;
+        evictNodeRelease(n);
+        return key;
+    }
+}
+
+static size_t _s3fifoMemory(void *p) {
+    s3fifo *s = p;
+    return malloc_usable_size(s)+s->small.mem+s->main.mem+
+           oadictMemory(s->ghost)+malloc_usable_size(s->ghosts);
+}
+
+const evictPolicy evictS3Fifo = {
+    "s3fifo",
+    _s3fifoCreate,
+    _s3fifoRelease,
+    NULL,
+    _s3fifoInsert,
+    _s3fifoEvict,
+    _s3fifoMemory
+};
@@ -0,0 +1,242 @@
+/* evict_tinylfu.c - W-TinyLFU eviction policy
+ *
+ * New objects enter a small window (1% of the bytes). Leaving the window,
+ * an object is admitted into the main space only if a count-min sketch of
+ * the recent accesses says it is more popular than the victim of the main
+ * space. The main space is a segmented LRU: probation then protected
+ * (80% of the main space). As hits never move a node, LRU order is
+ * approximated with a second chance given to nodes hit since the last look.
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "evict.h"
+
+#define TINYLFU_WINDOW_RATIO 1     /* percent of the capacity */
+#define TINYLFU_PROTECTED_RATIO 80 /* percent of the main space */
+#define TINYLFU_SKETCH_DEPTH 4
+#define TINYLFU_SKETCH_WIDTH (1<<16) /* counters per row, power of 2 */
+#define TINYLFU_MAX_COUNT 15
+/* Counters are halved every TINYLFU_SAMPLE_FACTOR*TINYLFU_SKETCH_WIDTH
+ * increments, so the sketch forgets the old popularity */
+#define TINYLFU_SAMPLE_FACTOR 10
+
+#define TINYLFU_WINDOW 0
+#define TINYLFU_PROBATION 1
+#define TINYLFU_PROTECTED 2
+
+typedef struct tinyLfu {
+    size_t window_max, protected_max, main_max;
+    evictQueue window, probation, protected;
+    unsigned char sketch[TINYLFU_SKETCH_DEPTH][TINYLFU_SKETCH_WIDTH];
+    unsigned long additions;
+} tinyLfu;
+
+/* --------------------------- count-min sketch ----------------------------- */
+
+static unsigned int _sketchIndex(unsigned int hash, int row) {
+    unsigned int h = hash+row*0x9e3779b9;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h & (TINYLFU_SKETCH_WIDTH-1);
+}
+
+static void _sketchIncrement(tinyLfu *t, unsigned int hash) {
+    int row, i;
+    for(row = 0; row < TINYLFU_SKETCH_DEPTH; row++) {
+        unsigned char *c = &t->sketch[row][_sketchIndex(hash,row)];
+        if(*c < TINYLFU_MAX_COUNT) (*c)++;
+    }
+    if(++t->additions >= (unsigned long)TINYLFU_SAMPLE_FACTOR*TINYLFU_SKETCH_WIDTH) {
+        for(row = 0; row < TINYLFU_SKETCH_DEPTH; row++)
+            for(i = 0; i < TINYLFU_SKETCH_WIDTH; i++)
+                t->sketch[row][i] >>= 1;
+        t->additions /= 2;
+    }
+}
+
+static unsigned int _sketchEstimate(tinyLfu *t, unsigned int hash) {
+    unsigned int min = TINYLFU_MAX_COUNT, c;
+    int row;
+    for(row = 0; row < TINYLFU_SKETCH_DEPTH; row++) {
+        c = t->sketch[row][_sketchIndex(hash,row)];
+        if(c < min) min = c;
+    }
+    return min;
+}
+
+/* Fold the hits counted by the workers since the last look into the
+ * sketch. Return the number of hits. */
+static unsigned int _tinyLfuCollect(tinyLfu *t, evictNode *n) {
+    unsigned int hits = objSdsTakeHits(n->val), i;
+    for(i = 0; i < hits; i++) _sketchIncrement(t,n->hash);
+    return hits;
+}
+
+/* A node hit since the last look gets another lap, as long as the caller
+ * has chances left: each lap consumes the hits, chances bound the laps
+ * while workers keep hitting. */
+static int _tinyLfuSecondChance(tinyLfu *t, evictNode *n, unsigned long *chances) {
+    if(*chances == 0) return 0;
+    (*chances)--;
+    return _tinyLfuCollect(t,n) > 0;
+}
+
+/* ------------------------------ main space -------------------------------- */
+
+static void _tinyLfuPush(evictQueue *q, evictNode *n, int queue) {
+    n->queue = queue;
+    evictQueuePush(q,n);
+}
+
+/* Make room in the protected segment: the least recently hit nodes go
+ * back to probation */
+static void _tinyLfuShrinkProtected(tinyLfu *t) {
+    unsigned long chances = t->protected.len;
+    evictNode *n;
+    while(t->protected.bytes > t->protected_max &&
+          (n = evictQueuePop(&t->protected)) != NULL) {
+        if(_tinyLfuSecondChance(t,n,&chances))
+            _tinyLfuPush(&t->protected,n,TINYLFU_PROTECTED);
+        else
+            _tinyLfuPush(&t->probation,n,TINYLFU_PROBATION);
+    }
+}
+
+/* Return the victim of the main space, left at the head of probation.
+ * Probation nodes hit since the last look are promoted on the way. */
+static evictNode *_tinyLfuMainVictim(tinyLfu *t) {
+    unsigned long chances = t->probation.len+t->protected.len;
+    evictNode *n;
+    while(1) {
+        if(t->probation.len == 0) {
+            if((n = evictQueuePop(&t->protected)) == NULL) return NULL;
+            _tinyLfuCollect(t,n);
+            _tinyLfuPush(&t->probation,n,TINYLFU_PROBATION);
+            continue;
+        }
+        n = t->probation.head;
+        if(_tinyLfuSecondChance(t,n,&chances)) {
+            evictQueuePop(&t->probation);
+            _tinyLfuPush(&t->protected,n,TINYLFU_PROTECTED);
+            _tinyLfuShrinkProtected(t);
+            continue;
+        }
+        return n;
+    }
+}
+
+/* -------------------------------- policy ---------------------------------- */
+
+static void *_tinyLfuCreate(size_t capacity) {
+    tinyLfu *t = malloc(sizeof(*t));
+    t->window_max = capacity/100*TINYLFU_WINDOW_RATIO;
+    t->main_max = capacity-t->window_max;
+    t->protected_max = t->main_max/100*TINYLFU_PROTECTED_RATIO;
+    evictQueueInit(&t->window);
+    evictQueueInit(&t->probation);
+    evictQueueInit(&t->protected);
+    memset(t->sketch,0,sizeof(t->sketch));
+    t->additions = 0;
+    return t;
+}
+
+static void _tinyLfuRelease(void *p) {
+    tinyLfu *t = p;
+    evictQueueRelease(&t->window);
+    evictQueueRelease(&t->probation);
+    evictQueueRelease(&t->protected);
+    free(t);
+}
+
+static void _tinyLfuMiss(void *p, unsigned int hash) {
+    _sketchIncrement(p,hash);
+}
+
+static void _tinyLfuInsert(void *p, sds key, objSds *val, unsigned int hash,
+                           unsigned long cost) {
+    tinyLfu *t = p;
+    (void)cost;
+    _tinyLfuPush(&t->window,evictNodeCreate(key,val,hash),TINYLFU_WINDOW);
+}
+
+static sds _tinyLfuForget(evictNode *n) {
+    sds key = n->key;
+    evictNodeRelease(n);
+    return key;
+}
+
+static sds _tinyLfuEvict(void *p) {
+    tinyLfu *t = p;
+    unsigned long chances = t->window.len;
+    evictNode *c, *v;
+
+    /* Objects leaving the window are candidates for the main space */
+    while(t->window.bytes > t->window_max) {
+        c = evictQueuePop(&t->window);
+        if(_tinyLfuSecondChance(t,c,&chances)) {
+            _tinyLfuPush(&t->window,c,TINYLFU_WINDOW);
+            continue;
+        }
+        if(t->probation.bytes+t->protected.bytes+c->size <= t->main_max) {
+            _tinyLfuPush(&t->probation,c,TINYLFU_PROBATION);
+            continue;
+        }
+        v = _tinyLfuMainVictim(t);
+        if(v && _sketchEstimate(t,c->hash) > _sketchEstimate(t,v->hash)) {
+            evictQueuePop(&t->probation);
+            _tinyLfuPush(&t->probation,c,TINYLFU_PROBATION);
+            return _tinyLfuForget(v);
+        }
+        return _tinyLfuForget(c);
+    }
+    if((v = _tinyLfuMainVictim(t)) != NULL) {
+        evictQueuePop(&t->probation);
+        return _tinyLfuForget(v);
+    }
+    if((c = evictQueuePop(&t->window)) != NULL)
+        return _tinyLfuForget(c);
+    return NULL;
+}
+
+static size_t _tinyLfuMemory(void *p) {
+    tinyLfu *t = p;
+    return malloc_usable_size(t)+t->window.mem+t->probation.mem+t->protected.mem;
+}
+
+const evictPolicy evictTinyLfu = {
+    "tinylfu",
+    _tinyLfuCreate,
+    _tinyLfuRelease,
+    _tinyLfuMiss,
+    _tinyLfuInsert,
+    _tinyLfuEvict,
+    _tinyLfuMemory
+};
@@ -26,143 +26,375 @@
  */
 
 #include <pthread.h>
+#include <stdlib.h>
+#include <malloc.h>
 #include "mcache.h"
 #include "lib/sds.h"
 #include "lib/dict.h"
+#include "lib/oadict.h"
 #include "lib/dicttype.h"
 #include "lib/adlist.h"
 #include "lib/objSds.h"
 #include "organizer/bio.h"
-#include "lib/safe_queue.h"
+#include "lib/ring.h"
+#include "lib/notifier.h"
+#include "lib/rhash.h"
+#include "lib/rcu.h"
 #include "cache.h"
+#include "evict.h"
 #include "lib/ufile.h"
+#include "lib/util.h"
+#include "lib/slab.h"
+#include "http/reply.h"
 #include <unistd.h>
 
-static pthread_t master_thread;
-static dict *master_cache = NULL;
-static int master_numjob = 0;
-static double master_total_mem = 0;
+/* Number of messages popped from a ring at once */
+#define MASTER_BATCH_SIZE 64
+/* How often a sleeping shard releases the objects whose grace period is over */
+#define MASTER_RECLAIM_PERIOD 100 /* ms */
+/* While the shard table is rehashing, the shard spends up to 1ms rehashing
+ * before each sleep, and sleeps at most MASTER_REHASH_PERIOD */
+#define MASTER_REHASH_PERIOD 10 /* ms */
+/* How often the status shard compares the accounting with the RSS */
+#define MASTER_RECONCILE_PERIOD 1000 /* ms */
+/* malloc_trim() walks every arena: while it gives back less than
+ * MASTER_TRIM_MIN_GAIN, it is tried twice less often, down to once per
+ * MASTER_TRIM_MAX_PERIOD */
+#define MASTER_TRIM_MIN_GAIN (1L<<20)
+#define MASTER_TRIM_MAX_PERIOD 64000 /* ms */
+
+/* Counters of a shard are written by the shard thread only and may be read
+ * from any thread (status). */
+#define shardStatSet(var,val) __atomic_store_n(&(var),(val),__ATOMIC_RELAXED)
+#define shardStatGet(var) __atomic_load_n(&(var),__ATOMIC_RELAXED)
+
+/* A master shard owns the keys whose hash falls into its range:
+ * its own table, its own bio result rings and its own memory accounting.
+ * Ready objects are also published in the shard index, which workers read
+ * without any message to the master. */
+typedef struct masterShard {
+    int id;
+    pthread_t thread;
+    oadict *cache;
+    rhash *index;            /* key -> objSds in state OBJSDS_OK */
+    void *evict;             /* state of the eviction policy */
+    notifier *wakeup;
+    size_t used_mem;         /* bytes allocated for the shard: */
+    size_t body_mem;         /*   replies */
+    size_t entry_mem;        /*   keys, objects and waiting lists */
+    size_t table_mem;        /*   table, index and eviction policy */
+    unsigned long entries;   /* keys in the shard cache */
+    unsigned long long numjob; /* messages and results processed so far */
+    unsigned long long misses; /* objects loaded by the bio threads */
+    unsigned long long evictions;
+    unsigned long slots;     /* slots of the shard table */
+    unsigned long rehash_done;  /* buckets already moved by the rehashing */
+    unsigned long rehash_total; /* 0 when the table is not rehashing */
+} masterShard;
+
+static masterShard *shards = NULL;
+static int master_num_shards = CCACHE_NUM_MASTER_SHARDS;
+static const evictPolicy *master_policy = NULL;
 static void *_masterWatch(void *t);
 
 static objSds *HTTP_NOT_FOUND = NULL;
+static objSds *favicon_value = NULL; /* pinned, never evicted */
 static sds faviconQuery;
 static sds statusQuery;
+static int status_shard = 0; /* the shard owning the '/status' entry */
 static unsigned long next_master_refresh_time = 0;
+/* RSS of the process, measured by the status shard */
+static size_t master_rss_baseline = 0; /* once the server is set up */
+static size_t master_rss = 0;
+static size_t master_rss_excess = 0;   /* growth over MASTER_MAX_AVAIL_MEM */
+static long long next_master_reconcile_time = 0;
+static long long next_master_trim_time = 0;
+static long long master_trim_period = MASTER_RECONCILE_PERIOD;
+
+static void _masterProcessCacheNew(masterShard *ms, ccache *c);
+static void _masterEvict(masterShard *ms);
+static void _masterRehash(masterShard *ms);
+static void _masterProcessFinishedIO(masterShard *ms);
+static void _masterProcessStatus(masterShard *ms);
+static void _masterReconcile(void);
+static objSds *_masterGetStatus(masterShard *ms);
+
+/* Must be called before cacheMasterInit() */
+void cacheMasterSetShards(int n) {
+    if(n < 1) n = 1;
+    if(n > CCACHE_MAX_MASTER_SHARDS) n = CCACHE_MAX_MASTER_SHARDS;
+    master_num_shards = n;
+}
+
+/* Must be called before cacheMasterInit() */
+int cacheMasterSetPolicy(const char *name) {
+    const evictPolicy *policy = evictPolicyGet(name);
+    if(policy == NULL) return CACHE_ERR;
+    master_policy = policy;
+    return CACHE_OK;
+}
+
+int cacheMasterNumShards() {
+    return master_num_shards;
+}
 
-static void _masterProcessCacheNew(ccache *c);
-static void _masterProcessCacheOld(ccache *c);
-static void _masterProcessFinishedIO();
-static void _masterProcessStatus();
-static sds _masterGetStatus();
+/* Map a hash to the shard owning it. The low bits of the hash index the
+ * buckets of the shard tables, so the shard is taken from the high bits of
+ * the mixed hash. */
+static int _masterShardOfHash(unsigned int h) {
+    if(master_num_shards == 1) return 0;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return (int)(((unsigned long long)h * master_num_shards) >> 32);
+}
+
+int cacheMasterShardOf(sds key) {
+    return _masterShardOfHash(dictGenHashFunction((unsigned char*)key,sdslen(key)));
+}
+
+/* Called by workers (registered rcu readers): return the ready object of
+ * the key with one reference taken for the caller, or NULL on miss. */
+objSds *cacheMasterLookup(const char *key, size_t len) {
+    unsigned int h = dictGenHashFunction((unsigned char*)key,len);
+    objSds *value = rhashFind(shards[_masterShardOfHash(h)].index,key,len,h);
+    if(value && objSdsGetState(value) == OBJSDS_OK && objSdsTryAddRef(value)) {
+        objSdsTouch(value);
+        return value;
+    }
+    return NULL;
+}
+
+/* Make a ready object visible to the workers */
+static void _masterPublish(masterShard *ms, sds key, objSds *value) {
+    rhashAdd(ms->index,key,dictGenHashFunction((unsigned char*)key,sdslen(key)),value);
+}
+
+/* Memory is accounted as allocated (malloc_usable_size), headers and
+ * rounding of the allocator included */
+static size_t _masterObjectMemory(objSds *value) {
+    return malloc_usable_size(value)+malloc_usable_size(value->waiting_entries);
+}
+
+/* Refresh the footprint of the structures, then the total of the shard */
+static void _masterAccount(masterShard *ms) {
+    size_t table = oadictMemory(ms->cache)+rhashMemory(ms->index)+
+                   master_policy->memory(ms->evict);
+    shardStatSet(ms->table_mem,table);
+    shardStatSet(ms->used_mem,ms->body_mem+ms->entry_mem+table);
+}
+
+/* Body in the slabs (none if served from its file) and precomputed header */
+static size_t _masterBodyMemory(objSds *value) {
+    return (value->ptr ? slabSdsAllocSize(value->ptr) : 0)+sdsAllocSize(value->header);
+}
+
+/* The object is accounted apart: several keys may share it (favicon) */
+static void _masterShardAdd(masterShard *ms, sds key, objSds *value) {
+    oadictAdd(ms->cache,key,value);
+    shardStatSet(ms->entry_mem,ms->entry_mem+sdsAllocSize(key));
+    shardStatSet(ms->entries,ms->entries+1);
+}
+
+static void _masterShardAddObject(masterShard *ms, objSds *value) {
+    shardStatSet(ms->entry_mem,ms->entry_mem+_masterObjectMemory(value));
+    if(value->header)
+        shardStatSet(ms->body_mem,ms->body_mem+_masterBodyMemory(value));
+}
+
+static void _masterShardAddWaiting(masterShard *ms, objSds *value, cacheEntry *ce) {
+    objSdsAddWaitingEntry(value,ce);
+    shardStatSet(ms->entry_mem,ms->entry_mem+
+                 malloc_usable_size(listLast(value->waiting_entries)));
+}
+
+/* The RSS the budget is measured from. Taken again by the server once
+ * its connection tables and rings are allocated, before the workers run:
+ * what they use from then on is accounted by the slave caches. */
+void cacheMasterSetBaseline(void) {
+    size_t rss = utilRss();
+    shardStatSet(master_rss_baseline,rss);
+    shardStatSet(master_rss,rss);
+}
 
 void cacheMasterInit() {
     pthread_attr_t attr;
-    master_cache = dictCreate(&objSdsDictType,NULL);
-    dictExpand(master_cache,PRESERVED_CACHE_ENTRIES);
+    masterShard *ms;
+    int i;
     slave_caches = listCreate();
-    master_total_mem = 0;
+    cacheMasterSetBaseline();
+    if(master_policy == NULL) master_policy = evictPolicyGet(CCACHE_EVICT_POLICY);
+    shards = calloc(master_num_shards,sizeof(masterShard));
+    for(i = 0; i < master_num_shards; i++) {
+        ms = shards+i;
+        ms->id = i;
+        /* The table starts small and grows with incremental rehashing */
+        ms->cache = oadictCreate(&objSdsDictType,NULL);
+        ms->index = rhashCreate();
+        ms->evict = master_policy->create(MASTER_MAX_AVAIL_MEM/master_num_shards);
+        ms->wakeup = notifierCreate();
+        if(ms->wakeup == NULL) {
+            ulog(CCACHE_WARNING,"Fatal: Can't create master wakeup notifier.");
+            exit(1);
+        }
+    }
     /* Default Http  Not Found */
-    HTTP_NOT_FOUND = objSdsFromSds(sdsnew("HTTP/1.1 404 OK\r\nContent-Length: 9\r\n\r\nNot Found"));
+    static const char not_found[] = "Not Found";
+    HTTP_NOT_FOUND = objSdsFromSds(replyObjectHeader(reply_not_found,sizeof(not_found)-1,0),
+                                   slabSdsNewLen(not_found,sizeof(not_found)-1));
+    HTTP_NOT_FOUND->status = reply_not_found;
     objSdsAddRef(HTTP_NOT_FOUND);
     HTTP_NOT_FOUND->state = OBJSDS_OK;
     /* status */
     statusQuery = sdsnew("/status");
-    objSds *status_value = objSdsCreate();
-    status_value->ref = 2; /* ensure that '/status' entry will not be freed */
+    status_shard = cacheMasterShardOf(statusQuery);
+    /* '/status' is never evicted: it is not given to the policy */
     next_master_refresh_time += time(NULL) + MASTER_STATUS_REFRESH_PERIOD;
-    dictAdd(master_cache,statusQuery,status_value);
-    status_value->ptr = _masterGetStatus();
+    objSds *status_value = _masterGetStatus(shards+status_shard);
     status_value->state = OBJSDS_OK;
+    _masterShardAdd(shards+status_shard,statusQuery,status_value);
+    _masterShardAddObject(shards+status_shard,status_value);
+    _masterPublish(shards+status_shard,statusQuery,status_value);
+
+    /* Background jobs need to know the number of shards */
+    bioInit();
+
+    /* favicon.ico: both keys live in the shard owning '/favicon.ico',
+     * the result of the job is delivered back to that shard.
+     * The entries are never evicted: they are not given to the policy.
+     * Until the object is ready, workers find it WAITING and ask the
+     * master, which queues them as for any other key. */
+    ms = shards+cacheMasterShardOf(faviconQuery = sdsnew("/favicon.ico"));
+    favicon_value = objSdsCreate();
+    _masterShardAdd(ms,faviconQuery,favicon_value);
+    _masterShardAddObject(ms,favicon_value);
+    _masterPublish(ms,faviconQuery,favicon_value);
+    sds staticFaviconQuery = sdsnew("/static/favicon.ico"); /* static file query */
+    objSdsAddRef(favicon_value); /* one reference per table entry */
+    _masterShardAdd(ms,staticFaviconQuery,favicon_value);
+    bioPushGeneralJob(ms->id,staticFaviconQuery);
+    for(i = 0; i < master_num_shards; i++) _masterAccount(shards+i);
 
     /* Initialize mutex and condition variable objects */
     /* For portability, explicitly create threads in a joinable state */
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    pthread_create(&master_thread, &attr, _masterWatch, NULL);
-    bioInit();
-
-    /* favicon.ico */
-    faviconQuery = sdsnew("/favicon.ico");
-    objSds *favicon_value = objSdsCreate();
-    favicon_value->ref = 2; /* ensure that the entry will not be freed */
-    favicon_value->state = OBJSDS_WAITING;
-    dictAdd(master_cache,faviconQuery,favicon_value);
-    sds staticFaviconQuery = sdsnew("/static/favicon.ico"); /* static file query */
-    dictAdd(master_cache,staticFaviconQuery,favicon_value);
-    bioPushGeneralJob(staticFaviconQuery);
+    for(i = 0; i < master_num_shards; i++) {
+        if(pthread_create(&shards[i].thread, &attr, _masterWatch, shards+i) != 0) {
+            ulog(CCACHE_WARNING,"Fatal: Can't initialize master shard %d.",i);
+            exit(1);
+        }
+    }
 }
 
 
 /*
-  The master works as a Complete-Fair Queuing (CFQ) I/O Scheduler.
-  The master visits each queue, servicing each request until
+  Each master shard works as a Complete-Fair Queuing (CFQ) I/O Scheduler.
+  The shard visits its queue of each slave, servicing each request until
    the queue's timeslice is exhausted, or until no more requests remain.
   NOTE: current implemenetation does not check for a queue's timeslice
+
+  A shard sleeps until a slave cache or a bio thread signals its wakeup,
+  or until the '/status' entry has to be refreshed or the RSS measured
+  (status shard only),
+  or until released objects may be freed.
 */
 
 void *_masterWatch(void *t)
 {
-    (void)t;
+    masterShard *ms = t;
     ccache *c;
     listIter li;
     listNode *ln;
-    int msecSleep = 1000;
+    long timeout;
     while (1) {
-        master_numjob = 0;
+        /* Clear before draining, so nothing pushed from now on is missed */
+        notifierClear(ms->wakeup);
         listRewind(slave_caches,&li);
         while ((ln = listNext(&li)) != NULL) {
             c = listNodeValue(ln);
-            _masterProcessCacheNew(c);
-            _masterProcessFinishedIO();
-            _masterProcessCacheOld(c);
-            _masterProcessStatus();
+            _masterProcessCacheNew(ms,c);
+            _masterProcessFinishedIO(ms);
         }
-        if(master_numjob < 1) msecSleep = 10000;
-        else {
-            printf("num job %d\n",master_numjob);
-            msecSleep = 10;
+        _masterRehash(ms);
+        /* The budget may have shrunk since the last load */
+        _masterEvict(ms);
+        if(ms->id == status_shard) {
+            _masterReconcile();
+            _masterProcessStatus(ms);
+            timeout = (long)(next_master_refresh_time - time(NULL))*1000;
+            if(timeout < 0) timeout = 0;
+            if(timeout > MASTER_RECONCILE_PERIOD) timeout = MASTER_RECONCILE_PERIOD;
+        }
+        else timeout = -1;
+        if(rcuReclaim(),rcuPending()) {
+            if(timeout < 0 || timeout > MASTER_RECLAIM_PERIOD)
+                timeout = MASTER_RECLAIM_PERIOD;
+        }
+        if(oadictIsRehashing(ms->cache)) {
+            if(timeout < 0 || timeout > MASTER_REHASH_PERIOD)
+                timeout = MASTER_REHASH_PERIOD;
         }
-        /* TODO: flexible sleep time */
-        usleep(msecSleep);
+        notifierWait(ms->wakeup,timeout);
     }
     pthread_exit(NULL);
 }
 
+void cacheMasterWakeup(int shard) {
+    notifierSignal(shards[shard].wakeup);
+}
+
 
-void _masterProcessCacheNew(ccache *c){
+static void _masterReplySlave(ccache *c, cacheEntry *ce) {
+    /* Can not fail: a slave never has more requests in flight than
+     * the capacity of its inbox */
+    if(cacheSendMessage(c,ce,CACHE_REPLY_NEW) != CACHE_OK)
+        ulog(CCACHE_WARNING,"slave inbox full, reply [%s] lost",(char*)ce->key);
+}
+
+void _masterProcessCacheNew(masterShard *ms, ccache *c){
+    void *msgs[MASTER_BATCH_SIZE];
+    unsigned int n, i;
     cacheEntry *ce;
-    while((ce=cacheGetMessage(c,CACHE_REQUEST_NEW)) != NULL)
+    while((n = cacheGetMessages(c,CACHE_REQUEST_NEW,ms->id,msgs,MASTER_BATCH_SIZE)) > 0)
+    for(i = 0; i < n; i++)
     {
-        master_numjob++;
-        sds key = ce->de->key;
-        objSds *value = dictFetchValue(master_cache,key);
+        ce = msgs[i];
+        shardStatSet(ms->numjob,ms->numjob+1);
+        sds key = ce->key;
+        objSds *value = oadictFetchValue(ms->cache,key);
         if(!value) {
             REPORT_MASTER_ADD_KEY(key);
+            /* The reference of the object is owned by the table entry */
             value = objSdsCreate();
+            _masterShardAddObject(ms,value);
             /* Add cache entry to waiting list */
-            objSdsAddWaitingEntry(value,ce);
+            _masterShardAddWaiting(ms,value,ce);
             /* Add entry to master cache */
             sds mkey = sdsdup(key); /* master must have its own key for its own cache */
-            /* Every when accept new ce, the obj ref is increased */
-            objSdsAddRef(value);
-            dictAdd(master_cache,mkey,value);
+            _masterShardAdd(ms,mkey,value);
+            shardStatSet(ms->misses,ms->misses+1);
+            if(master_policy->miss)
+                master_policy->miss(ms->evict,
+                                    dictGenHashFunction((unsigned char*)mkey,sdslen(mkey)));
             /* New IO Job */
-            bioPushGeneralJob(mkey);
+            bioPushGeneralJob(ms->id,mkey);
             OBJ_REPORT_REF(value);
         }
         else {
             switch(value->state) {
             case OBJSDS_WAITING:
-                /* Every when accept new ce, the obj ref is increased */
-                objSdsAddRef(value);
-                objSdsAddWaitingEntry(value,ce);
+                _masterShardAddWaiting(ms,value,ce);
                 break;
             case OBJSDS_OK:
-                ce->val = value->ptr;
-                /* Every when accept new ce, the obj ref is increased */
+                /* Ready since the worker looked up the index */
+                ce->val = value;
+                /* The entry holds one reference until its clients got it */
                 objSdsAddRef(value);
                 /* Reply slave cache about the available data */
-                cacheSendMessage(c,ce,CACHE_REPLY_NEW);
+                _masterReplySlave(c,ce);
                 break;
             default:
                 /* Error Unknown Object State */
@@ -171,27 +403,49 @@ void _masterProcessCacheNew(ccache *c){
             OBJ_REPORT_REF(value);
         }
     }
+    _masterAccount(ms);
 }
 
-void _masterProcessFinishedIO() {
+void _masterProcessFinishedIO(masterShard *ms) {
+    struct bio_job *job;
     sds key = NULL;
-    sds content = NULL;
+    unsigned long cost;
     /* For each IO worker */
     int tid = 0;
     /* Polling all io thread */
     for(tid=0;tid<CCACHE_NUM_BIO_THREADS;tid++) {
-        while(bioGetResult(tid,&key,&content))
+        while((job = bioGetResult(ms->id,tid)) != NULL)
         {
-            master_numjob++;
-            objSds *value = dictFetchValue(master_cache,key);
-            if(content == NULL) {
-                value->ptr = HTTP_NOT_FOUND->ptr;
+            key = job->name;
+            cost = job->cost;
+            shardStatSet(ms->numjob,ms->numjob+1);
+            objSds *value = oadictFetchValue(ms->cache,key);
+            /* Each entry owns its reply, as it is freed with the entry */
+            if(job->result == NULL && job->fd == -1) {
+                value->ptr = slabSdsNewLen(HTTP_NOT_FOUND->ptr,sdslen(HTTP_NOT_FOUND->ptr));
+                value->header = sdsdup(HTTP_NOT_FOUND->header);
+                value->status = HTTP_NOT_FOUND->status;
             }
             else {
-                value->ptr = content;
-                master_total_mem += sdslen(content);
-            }            
-            value->state = OBJSDS_OK;
+                if(job->result == NULL) {
+                    value->fd = job->fd;
+                    value->fsize = job->fsize;
+                }
+                else value->ptr = job->result;
+                value->mtime = job->mtime;
+                value->header = replyObjectHeader(reply_ok,objSdsBodyLen(value),value->mtime);
+            }
+            free(job);
+            shardStatSet(ms->body_mem,ms->body_mem+_masterBodyMemory(value));
+            objSdsSetState(value,OBJSDS_OK);
+            /* From now on, workers find the object without asking.
+             * Already published if the key is an alias (favicon). */
+            _masterPublish(ms,key,value);
+            /* Evictable once loaded, as its size is known */
+            if(value != favicon_value)
+                master_policy->insert(ms->evict,key,value,
+                                      dictGenHashFunction((unsigned char*)key,sdslen(key)),
+                                      cost);
             listIter li;
             listNode *ln;
             cacheEntry *ce;
@@ -201,56 +455,124 @@ void _masterProcessFinishedIO() {
             while ((ln = listNext(&li)) != NULL){
                 /* unwatch client */
                 ce = listNodeValue(ln);
-                ce->val = value->ptr;
+                shardStatSet(ms->entry_mem,ms->entry_mem-malloc_usable_size(ln));
+                ce->val = value;
+                objSdsAddRef(value);
                 /* notify all clients waiting for this entry */
-                cacheSendMessage(ce->mycache,ce,CACHE_REPLY_NEW);
-                printf("Cache in Worker %.2lf \n", (double)(clock()));
+                _masterReplySlave(ce->mycache,ce);
             }
+            /* Nobody is waiting anymore */
+            listRelease(value->waiting_entries);
+            value->waiting_entries = listCreate();
+            /* Only now that the waiting entries hold their reference, as the
+             * object itself may be the victim. Checking after each object
+             * keeps a burst of results from overshooting the budget. */
+            _masterAccount(ms);
+            _masterEvict(ms);
           }
         }
 }
 
-void _masterProcessCacheOld(ccache *c){
-    sds old_key;
-    while((old_key=cacheGetMessage(c,CACHE_REQUEST_OLD)) != NULL)
-    {
-        master_numjob++;
-        objSds *value = dictFetchValue(master_cache,old_key);
-        if(value) {
-            objSdsSubRef(value);
-            OBJ_REPORT_REF(value);
-            /* No ae thread use this entry anymore */
-            if(value->ref == 1) {
-                printf("mem freed\n");
-                master_total_mem -= sdslen(value->ptr);
-                /* TODO: send free mem task to background job threads */
-                dictDelete(master_cache,old_key);
-            }
-        }
-        sdsfree(old_key);
+/* Once the shard uses more than its part of the budget (high watermark),
+ * evict the victims of the policy down to the low watermark, so eviction
+ * runs by bursts rather than for every new object. Workers still serving
+ * an evicted object keep it alive through their reference, the memory is
+ * released with the last one.
+ * Memory the accounting does not see (fragmentation, workers, buffers)
+ * is charged to the shards by the reconciliation with the RSS: their part
+ * of the budget shrinks by their part of the excess, at most by half. */
+void _masterEvict(masterShard *ms) {
+    size_t share = MASTER_MAX_AVAIL_MEM/master_num_shards;
+    size_t excess = shardStatGet(master_rss_excess)/master_num_shards;
+    size_t high = share - (excess < share/2 ? excess : share/2);
+    size_t low = high/100*MASTER_EVICT_LOW_WATERMARK;
+    sds key;
+    objSds *value;
+    if(ms->used_mem <= high) return;
+    while(ms->used_mem > low && (key = master_policy->evict(ms->evict)) != NULL) {
+        value = oadictFetchValue(ms->cache,key);
+        rhashDelete(ms->index,key,dictGenHashFunction((unsigned char*)key,sdslen(key)));
+        shardStatSet(ms->body_mem,ms->body_mem-_masterBodyMemory(value));
+        shardStatSet(ms->entry_mem,ms->entry_mem-sdsAllocSize(key)-_masterObjectMemory(value));
+        shardStatSet(ms->evictions,ms->evictions+1);
+        /* TODO: send free mem task to background job threads */
+        oadictDelete(ms->cache,key);
+        shardStatSet(ms->entries,ms->entries-1);
+        _masterAccount(ms);
     }
 }
 
-void _masterProcessStatus() {
+/* Every add/find/delete on the shard table moves a group while it is
+ * rehashing. Spend some idle time on it as well, so growing a big table
+ * does not depend on the traffic. */
+void _masterRehash(masterShard *ms) {
+    if(oadictIsRehashing(ms->cache))
+        oadictRehashMilliseconds(ms->cache,1);
+    shardStatSet(ms->slots,oadictSlots(ms->cache));
+    shardStatSet(ms->rehash_done,oadictRehashDone(ms->cache));
+    shardStatSet(ms->rehash_total,oadictRehashTotal(ms->cache));
+}
+
+/* Workers may be sending the current status: a new object replaces it
+ * and the old one is released with its last reference. */
+void _masterProcessStatus(masterShard *ms) {
     /* Check if status is expired */
     unsigned long now = time(NULL);
     if(next_master_refresh_time < now) {
-        objSds *value = dictFetchValue(master_cache,statusQuery);
-        if(value) {
-            sds oldptr = value->ptr;
-            /* Re-asign the value */
-            value->ptr = _masterGetStatus();
-            sdsfree(oldptr);
-            next_master_refresh_time = now + MASTER_STATUS_REFRESH_PERIOD;
-        }
-        else {
-            ulog(CCACHE_WARNING,"master cache %s not found",statusQuery);
-            next_master_refresh_time = now + MASTER_STATUS_REFRESH_PERIOD*1000;
+        objSds *old = oadictFetchValue(ms->cache,statusQuery);
+        shardStatSet(ms->body_mem,ms->body_mem-_masterBodyMemory(old));
+        shardStatSet(ms->entry_mem,ms->entry_mem-_masterObjectMemory(old));
+        objSds *value = _masterGetStatus(ms);
+        value->state = OBJSDS_OK;
+        _masterShardAddObject(ms,value);
+        rhashReplace(ms->index,statusQuery,
+                     dictGenHashFunction((unsigned char*)statusQuery,sdslen(statusQuery)),
+                     value);
+        /* Drop the reference of the old object owned by the table */
+        oadictReplace(ms->cache,statusQuery,value);
+        _masterAccount(ms);
+        next_master_refresh_time = now + MASTER_STATUS_REFRESH_PERIOD;
+    }
+}
+
+/* Compare the RSS with the baseline (see cacheMasterSetBaseline) plus the
+ * budget. Growth beyond the budget is first given back to the system if it
+ * is only free memory kept by the allocator, the rest is charged to the
+ * shards (see _masterEvict) until the next measure. */
+static void _masterReconcile(void) {
+    long long now = ustime()/1000;
+    size_t rss, baseline, grown, excess = 0;
+    int i;
+    if(now < next_master_reconcile_time) return;
+    next_master_reconcile_time = now + MASTER_RECONCILE_PERIOD;
+    baseline = shardStatGet(master_rss_baseline);
+    rss = utilRss();
+    grown = rss > baseline ? rss-baseline : 0;
+    if(grown > (size_t)MASTER_MAX_AVAIL_MEM && now >= next_master_trim_time) {
+        size_t before = rss;
+        malloc_trim(0);
+        rss = utilRss();
+        grown = rss > baseline ? rss-baseline : 0;
+        if(before < rss+MASTER_TRIM_MIN_GAIN) {
+            master_trim_period *= 2;
+            if(master_trim_period > MASTER_TRIM_MAX_PERIOD)
+                master_trim_period = MASTER_TRIM_MAX_PERIOD;
         }
+        else master_trim_period = MASTER_RECONCILE_PERIOD;
+        next_master_trim_time = now + master_trim_period;
+    }
+    if(grown > (size_t)MASTER_MAX_AVAIL_MEM) excess = grown-MASTER_MAX_AVAIL_MEM;
+    shardStatSet(master_rss,rss);
+    if(excess != shardStatGet(master_rss_excess)) {
+        shardStatSet(master_rss_excess,excess);
+        for(i = 0; i < master_num_shards; i++)
+            notifierSignal(shards[i].wakeup);
     }
 }
 
-sds _masterGetStatus() {
+/* Called by the status shard. Counters of the other shards are read
+ * without locking, the figures may thus be slightly out of date. */
+objSds *_masterGetStatus(masterShard *ms) {
     /*TODO: calculate cache increase speed,
      * then adopt a suitable stale-cache freeing strategy
      * Three involved params:
@@ -258,42 +580,113 @@ sds _masterGetStatus() {
      * (2) ae loop wait,
      * and (3) number of stale entries in one ae loop
      */
-
-    sds status = sdsempty();//sdsfromlonglong(master_total_mem);
+    int i;
+    unsigned long long hits = 0, misses = 0;
+    size_t rss, baseline, accounted, workers = 0;
+    listIter li;
+    listNode *ln;
+    sds status = sdsempty();
     status = sdscatprintf(status,"TOL RAM: %-6.2lfMB\tUSED RAM: %-6.2lf\n",
                           BYTES_TO_MEGABYTES(MASTER_MAX_AVAIL_MEM),
-                          BYTES_TO_MEGABYTES(master_total_mem));
+                          BYTES_TO_MEGABYTES(cacheMasterUsedMemory()));
+    /* What the allocator handed out to the shards and the workers, against
+     * what the process grew by since the server was set up */
+    listRewind(slave_caches,&li);
+    while((ln = listNext(&li)) != NULL)
+        workers += cacheGetMemory((ccache*)listNodeValue(ln));
+    rss = shardStatGet(master_rss);
+    baseline = shardStatGet(master_rss_baseline);
+    accounted = cacheMasterUsedMemory()+workers;
+    status = sdscatprintf(status,"RSS: %-6.2lf BASELINE: %-6.2lf ACCOUNTED: %-6.2lf UNACCOUNTED: %-6.2lf EXCESS: %-6.2lf\n",
+                          BYTES_TO_MEGABYTES(rss),
+                          BYTES_TO_MEGABYTES(baseline),
+                          BYTES_TO_MEGABYTES(accounted),
+                          rss > baseline+accounted ?
+                              BYTES_TO_MEGABYTES((rss-baseline-accounted)) : 0.0,
+                          BYTES_TO_MEGABYTES(shardStatGet(master_rss_excess)));
+    /* Requests coalesced on a loading object are neither hits nor misses */
+    listRewind(slave_caches,&li);
+    while((ln = listNext(&li)) != NULL)
+        hits += cacheGetHits((ccache*)listNodeValue(ln));
+    for(i = 0; i < master_num_shards; i++)
+        misses += shardStatGet(shards[i].misses);
+    status = sdscatprintf(status,"POLICY: %s\tHITS: %llu MISSES: %llu HIT RATIO: %.2lf%%\n",
+                          master_policy->name,hits,misses,
+                          hits+misses ? 100.0*hits/(hits+misses) : 0.0);
+    for(i = 0; i < master_num_shards; i++) {
+        unsigned long total = shardStatGet(shards[i].rehash_total);
+        status = sdscatprintf(status,"SHARD %-2d KEYS: %-8lu USED RAM: %-6.2lf (BODIES: %-6.2lf ENTRIES: %-6.2lf TABLES: %-6.2lf) JOBS: %-10llu EVICTED: %-10llu SLOTS: %-8lu",
+                              i,
+                              shardStatGet(shards[i].entries),
+                              BYTES_TO_MEGABYTES(shardStatGet(shards[i].used_mem)),
+                              BYTES_TO_MEGABYTES(shardStatGet(shards[i].body_mem)),
+                              BYTES_TO_MEGABYTES(shardStatGet(shards[i].entry_mem)),
+                              BYTES_TO_MEGABYTES(shardStatGet(shards[i].table_mem)),
+                              shardStatGet(shards[i].numjob),
+                              shardStatGet(shards[i].evictions),
+                              shardStatGet(shards[i].slots));
+        if(total)
+            status = sdscatprintf(status," REHASHING: %lu/%lu\n",
+                                  shardStatGet(shards[i].rehash_done),total);
+        else
+            status = sdscat(status,"\n");
+    }
+    i = 0;
+    listRewind(slave_caches,&li);
+    while((ln = listNext(&li)) != NULL) {
+        ccache *c = listNodeValue(ln);
+        status = sdscatprintf(status,"WORKER %-2d USED RAM: %-6.2lf ",i++,
+                              BYTES_TO_MEGABYTES(cacheGetMemory(c)));
+        status = sdscat(cacheCatPoolStatus(c,status),"\n");
+    }
+    status = slabCatStatus(status);
 #if (CCACHE_LOG_LEVEL == CCACHE_DEBUG)
-    status = sdscatprintf(status,"Detail:\n");
+    /* Only the entries of the status shard can be walked safely */
+    status = sdscatprintf(status,"Detail of shard %d:\n",ms->id);
     status = sdscatprintf(status,"%-3s %-32s: %-6s\n"," ","KEY","MEM");
-    dictIterator *di = dictGetIterator(master_cache);
-    dictEntry *de;
+    oadictIterator *di = oadictGetIterator(ms->cache);
+    oadictSlot *de;
     int idx = 1;
-    while((de = dictNext(di)) != NULL) {
-        objSds *value = (objSds*)dictGetEntryVal(de);
+    while((de = oadictNext(di)) != NULL) {
+        objSds *value = (objSds*)oadictSlotVal(de);
         if(value) {
-            if(value->ptr) {
+            if(value->header) {
                 status = sdscatprintf(status,"%-3d %-32s: %-6ld\n",
                                         idx++,
-                                        (char*)dictGetEntryKey(de),
-                                        sdslen(value->ptr));
+                                        (char*)oadictSlotKey(de),
+                                        objSdsBodyLen(value));
             }
             else {
                 status = sdscatprintf(status,"%-3d %-32s: %-6s\n",
                                         idx++,
-                                        (char*)dictGetEntryKey(de),
+                                        (char*)oadictSlotKey(de),
                                         "WAITING");
             }
         }
     }
-    dictReleaseIterator(di);
+    oadictReleaseIterator(di);
+#else
+    CCACHE_NOTUSED(ms);
 #endif
-    sds status_reply = sdsnew("HTTP/1.1 200 OK\r\n");
-    status_reply = sdscatprintf(status_reply,"Content-Length: %ld\r\n\r\n%s",sdslen(status),status);
+    /* Cached like any other reply */
+    objSds *value = objSdsFromSds(replyObjectHeader(reply_ok,sdslen(status),0),
+                                  slabSdsNewLen(status,sdslen(status)));
     sdsfree(status);
-    return status_reply;
+    return value;
 }
 
-int shouldIFreeSomeData(){
-    return master_total_mem > MASTER_MAX_AVAIL_MEM;
+/* The process uses more than its budget (see _masterReconcile) */
+int cacheMasterMemoryScarce(void) {
+    return shardStatGet(master_rss_excess) > 0;
 }
+
+/* Sum of the memory accounted by all shards */
+size_t cacheMasterUsedMemory() {
+    size_t used = 0;
+    int i;
+    for(i = 0; i < master_num_shards; i++)
+        used += shardStatGet(shards[i].used_mem);
+    return used;
+}
+
+
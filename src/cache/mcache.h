@@ -28,8 +28,19 @@
 #ifndef MCACHE_H
 #define MCACHE_H
 
+#include <stddef.h>
+#include "lib/sds.h"
+#include "lib/objSds.h"
 
+void cacheMasterSetShards(int n);
+int cacheMasterSetPolicy(const char *name);
+int cacheMasterNumShards();
+int cacheMasterShardOf(sds key);
 void cacheMasterInit();
-int shouldIFreeSomeData();
+void cacheMasterSetBaseline(void);
+void cacheMasterWakeup(int shard);
+objSds *cacheMasterLookup(const char *key, size_t len);
+size_t cacheMasterUsedMemory();
+int cacheMasterMemoryScarce(void);
 
 #endif // MCACHE_H
@@ -40,24 +40,15 @@
 #define CCACHE_NOTUSED(V) ((void) V)
 
 /* Caching Options */
-/* When the number of entries exceeds the preserved entries,
- * the cache will be re-index, causing huge-performance penalty.
- * Another important factor is the efficiency of hash.
- * As we take only n-least significant bits,
- * n should be big enough to avoid as much as hash collision.
- *
- * Therefore, it is advisable to provide an appropriate preserved entries,
- * which is 16 times of the typical used number of cache entries.
- *
- * An image caching server use 4GB RAM for cache, each entries consume 16KB.
- * The number of used cache entries is (2^32)/(2^14) = (2^18)
- * The number of preverved entries should be 2^22
- */
-
-#define PRESERVED_CACHE_ENTRIES (2<<22)
+/* Cache dicts start small and grow on demand with incremental rehashing */
 
 #define MASTER_STATUS_REFRESH_PERIOD 5 /* 10 seconds */
 #define MASTER_MAX_AVAIL_MEM (50L<<20) /* 100MB */
+/* A master shard evicts once above its share of MASTER_MAX_AVAIL_MEM,
+ * down to this percentage of it */
+#define MASTER_EVICT_LOW_WATERMARK 90
+/* Eviction policy of the master shards: gdsf, s3fifo, tinylfu or fifo */
+#define CCACHE_EVICT_POLICY "gdsf"
 #define ZOOM_MAX_ON_DISK (10L<<30) /* 10GB */
 
 
@@ -65,17 +56,60 @@
 #define ONE_MEGABYTE (1<<20)
 #define BYTES_TO_MEGABYTES(d) ((double)d/ONE_MEGABYTE)
 
+/* Slots of each ring between a slave cache and the master. It also bounds
+ * the number of keys a worker may be waiting for at the same time. */
+#define CACHE_QUEUE_SIZE 4096
+/* Entries, and nodes of their waiting lists, a worker keeps once released
+ * for its next misses */
+#define CACHE_POOL_SIZE CACHE_QUEUE_SIZE
+/* Slots of each ring carrying finished jobs from a bio thread to the master */
+#define BIO_RESULT_QUEUE_SIZE 1024
+
+/* Master threads, each one owning the cached keys of its hash range.
+ * The default can be changed at startup with --masters. */
+#define CCACHE_NUM_MASTER_SHARDS 2
+#define CCACHE_MAX_MASTER_SHARDS 64
+
 /* Threads serving clients ordered by the accepting thread */
 #define CCACHE_NUM_WORKER_THREADS    4
 /* Threads doing background jobs ordered by the master cache */
 #define CCACHE_NUM_BIO_THREADS 4
+/* Files of at least this size are not read in memory: the object keeps
+ * the file open and workers send it with sendfile. Every file is while
+ * the process uses more than its budget. Changed with --sendfile */
+#define CCACHE_SENDFILE_MIN_SIZE (1024*256)
+/* Files kept open at once by the cached objects, files are read in memory
+ * beyond */
+#define CCACHE_MAX_OPEN_FILES 1024
 
 
 /* Asynchronous I/O Options */
-#define AE_MAX_CLIENT_PER_WORKER 16000 /* Number of client pending at acceptor */
+/* Size of the connection table of a worker: the connections it serves at
+ * once, whatever their fd */
+#define AE_MAX_CLIENT_PER_WORKER 16000
 #define AE_MAX_EPOLL_EVENTS 1024
-#define AE_FD_SET_SIZE (CCACHE_NUM_BIO_THREADS*AE_MAX_CLIENT_PER_WORKER)    /* Max number of fd supported */
+/* Client sockets are registered once, edge-triggered, for reads and writes.
+ * Comment out for level-triggered sockets switched between reads and writes
+ * with epoll_ctl for every request */
+#define AE_EDGE_TRIGGERED
 #define AE_MAX_CLIENT_IDLE_TIME 5 /* seconds */
+/* A persistent connection is closed after this number of requests
+ * (Connection: close in the last reply) */
+#define AE_MAX_CLIENT_REQUESTS 1000
+/* Pipelined requests of a connection whose replies are not sent yet. No
+ * more is read from the connection until its replies are sent */
+#define AE_MAX_CLIENT_PIPELINE 16
+/* Once the first byte of a request is read, its header must be complete
+ * within AE_MAX_HEADER_TIME, whatever the pace of the client */
+#define AE_MAX_HEADER_TIME 5 /* seconds */
+/* A request waiting for its object is answered BUSY after this time */
+#define AE_MAX_BLOCKED_TIME 30 /* seconds */
+/* A worker sleeps until an event, or its next timer, or, when it released
+ * objects, at most AE_RECLAIM_PERIOD to free them */
+#define AE_RECLAIM_PERIOD 100 /* ms */
+/* How workers accept connections: "reuseport" (a listening socket each)
+ * or "exclusive" (a shared socket, EPOLLEXCLUSIVE) */
+#define CCACHE_ACCEPT_MODE "reuseport"
 
 
 #define SERVICE_STATIC_FILE "/static"
@@ -86,6 +120,11 @@
 #define IMG_CROP_AVAILABLE 1
 #define IMG_MAX_WIDTH 1000
 #define IMG_MAX_HEIGHT 1000
+/* Sizes a zoom may ask for (--zoom-sizes), at most ZOOM_MAX_SIZES, and
+ * how the others are answered: serve, redirect or refuse (--zoom-snap) */
+#define ZOOM_MAX_SIZES 64
+#define ZOOM_MAX_QUALITIES 16
+#define ZOOM_SNAP_MODE "serve"
 
 void ulog(int level, const char *fmt, ...);
 
@@ -25,6 +25,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
 #include "reply.h"
 #include "malloc.h"
 #include "lib/dicttype.h"
@@ -37,27 +38,125 @@ reply* replyCreate() {
     r->headers = dictCreate(&sdsDictType,NULL);
     r->obuf = NULL;
     r->content = sdsempty();
-    r->isCached = 0;
+    r->cobj = NULL;
+    r->connection = NULL;
+    r->offset = 0;
+    r->length = 0;
+    r->range = 0;
+    r->if_range = NULL;
+    r->hbuf = sdsempty();
     return r;
 }
 
+/* Release the output buffer, or the reference on the object owning it */
+static void _replyReleaseBuffer(reply *r) {
+    if(r->cobj) objSdsSubRef(r->cobj);
+    else sdsfree(r->obuf);
+    r->obuf = NULL;
+    r->cobj = NULL;
+}
+
 void replyFree(reply* r) {
     dictRelease(r->headers);
     sdsfree(r->content);
-    if(r->obuf&&r->isCached == 0) sdsfree(r->obuf);
+    _replyReleaseBuffer(r);
+    sdsfree(r->if_range);
+    sdsfree(r->hbuf);
     free(r);
 }
 
 void replyReset(reply *r) {
-    dictRelease(r->headers);
-    r->headers = dictCreate(&sdsDictType,NULL);
+    r->status = reply_ok;
+    dictEmpty(r->headers);
     sdsclear(r->content);
-    if(r->isCached) r->obuf = NULL;
-    else sdsfree(r->obuf);
+    _replyReleaseBuffer(r);
+    r->connection = NULL;
+    r->offset = 0;
+    r->length = 0;
+    r->range = 0;
+    sdsfree(r->if_range);
+    r->if_range = NULL;
 }
 
+/* Date of t as sent in Last-Modified, and compared with If-Range */
+static void _replyHttpDate(char *buf, size_t len, time_t t) {
+    struct tm tm;
+    gmtime_r(&t,&tm);
+    strftime(buf,len,"%a, %d %b %Y %H:%M:%S GMT",&tm);
+}
+
+static sds _replyCatLastModified(sds header, time_t mtime) {
+    char date[32];
+    if (mtime == 0) return header;
+    _replyHttpDate(date,sizeof(date),mtime);
+    return sdscatprintf(header,"Last-Modified: %s\r\n",date);
+}
+
+/* A range is only taken from a complete object. With If-Range, the date
+ * must be the Last-Modified of the object, an entity tag never matches:
+ * objects have none. */
+static int _replyRangeApplies(reply *r, objSds *obj) {
+    char date[32];
+    if (!r->range || obj->status != reply_ok) return 0;
+    if (r->if_range == NULL) return 1;
+    if (obj->mtime == 0) return 0;
+    _replyHttpDate(date,sizeof(date),obj->mtime);
+    return !strcmp(r->if_range,date);
+}
+
+/* Send the part of the body asked for, or 416 if none of it exists. The
+ * header is written in the buffer of the reply, the body is sent from
+ * the object as for a complete reply. */
+static void _replySetRange(reply *r, objSds *obj) {
+    long long size = objSdsBodyLen(obj), first, last;
+    if (r->range_first == -1) {
+        first = r->range_last < size ? size-r->range_last : 0;
+        last = r->range_last ? size-1 : -1;
+    } else {
+        first = r->range_first;
+        last = (r->range_last == -1 || r->range_last >= size) ? size-1 : r->range_last;
+    }
+    sdsclear(r->hbuf);
+    if (first >= size || last < first) {
+        r->hbuf = sdscatprintf(r->hbuf,"%sContent-Range: bytes */%lld\r\n"
+                               "Content-Length: 0\r\n",
+                               replyStatusToString(reply_range_not_satisfiable),size);
+        r->length = 0;
+    } else {
+        r->hbuf = sdscatprintf(r->hbuf,"%sContent-Range: bytes %lld-%lld/%lld\r\n"
+                               "Content-Length: %lld\r\nAccept-Ranges: bytes\r\n",
+                               replyStatusToString(reply_partial_content),
+                               first,last,size,last-first+1);
+        r->hbuf = _replyCatLastModified(r->hbuf,obj->mtime);
+        r->offset = first;
+        r->length = last-first+1;
+    }
+    r->obuf = r->hbuf;
+}
 
-sds replyToBuffer(reply* r) {
+/* Send a cached object. The reference of the caller is handed to the reply */
+void replySetCachedObject(reply *r, objSds *obj) {
+    _replyReleaseBuffer(r);
+    r->cobj = obj;
+    r->obuf = obj->header;
+    r->offset = 0;
+    r->length = objSdsBodyLen(obj);
+    if (_replyRangeApplies(r,obj)) _replySetRange(r,obj);
+}
+
+/* Only a single range is supported (see request.h), the object is not
+ * known yet: the range is applied by replySetCachedObject(). */
+void replySetRange(reply *r, long long first, long long last,
+                   const char *if_range, size_t if_range_len) {
+    r->range = 1;
+    r->range_first = first;
+    r->range_last = last;
+    if (if_range) r->if_range = sdsnewlen(if_range,if_range_len);
+}
+
+
+/* The header of a reply not cached, built once */
+sds replyHeader(reply* r) {
     if(r->obuf == NULL) {
         sds obuf = sdsempty();
         obuf = sdscat(obuf,replyStatusToString(r->status));
@@ -70,16 +169,59 @@ sds replyToBuffer(reply* r) {
             obuf = sdscat(obuf,"\r\n");
         }
         dictReleaseIterator(di);
-        if(sdslen(r->content) > 0) {
-            obuf = sdscatprintf(obuf,"Content-Length: %ld",sdslen(r->content));
-            obuf = sdscat(obuf,"\r\n\r\n");
-            obuf = sdscatsds(obuf,r->content);
-        }
+        obuf = sdscatprintf(obuf,"Content-Length: %zu\r\n",sdslen(r->content));
         r->obuf = obuf;
     }
     return r->obuf;
 }
 
+/* The header precomputed with a cached body of len bytes, from a file
+ * modified at mtime (0 if unknown) */
+sds replyObjectHeader(reply_status_type status, size_t len, time_t mtime) {
+    sds header = sdscatprintf(sdsempty(),"%sContent-Length: %zu\r\n",
+                              replyStatusToString(status),len);
+    if (status == reply_ok) header = sdscat(header,"Accept-Ranges: bytes\r\n");
+    return _replyCatLastModified(header,mtime);
+}
+
+/* The header and the body of a cached object are shared by every request
+ * for it, the headers of the response itself (Connection) are sent
+ * between them, from static strings: nothing is copied. Returns the
+ * number of parts set in iov, at most REPLY_MAX_IOVEC. A body served from
+ * its file is not part of them, see replyFileLen(). */
+int replyToIovec(reply *r, struct iovec *iov) {
+    sds header = replyHeader(r);
+    char *body = r->cobj ? r->cobj->ptr : r->content;
+    size_t len = r->cobj ? r->length : sdslen(r->content);
+    int n = 0;
+    iov[n].iov_base = header;
+    iov[n++].iov_len = sdslen(header);
+    if (r->connection) {
+        iov[n].iov_base = (char*)r->connection;
+        iov[n++].iov_len = strlen(r->connection);
+    }
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+    if (body && len) {
+        iov[n].iov_base = r->cobj ? body+r->offset : body;
+        iov[n++].iov_len = len;
+    }
+    return n;
+}
+
+/* Bytes of the body to send from the file of the object (its fd, from
+ * r->offset) after the parts of replyToIovec(), 0 if it is in memory */
+size_t replyFileLen(reply *r) {
+    return (r->cobj && r->cobj->ptr == NULL) ? r->length : 0;
+}
+
+/* Only what differs from the default of the protocol of the request is
+ * said: persistent connections for HTTP/1.1, closed ones for HTTP/1.0. */
+void replySetKeepAlive(reply *r, int http11, int keepalive) {
+    if (keepalive) r->connection = http11 ? NULL : "Connection: keep-alive\r\n";
+    else r->connection = http11 ? "Connection: close\r\n" : NULL;
+}
+
 int replyAddHeader(reply *r, const char *name, const char *value) {
     return dictAdd(r->headers,sdsnew(name),sdsnew(value));
 }
@@ -95,10 +237,7 @@ void replySetStatus(reply *r , reply_status_type status){
 
 reply *replyStock(reply_status_type status) {
     reply* r = replyCreate();
-    sds obuf = r->obuf;
-    obuf = sdscatsds(obuf,replyStatusToString(status));
-    obuf = sdscat(obuf,"Content-Length: 0");
-    r->obuf = obuf;
+    r->obuf = replyObjectHeader(status,0,0);
     return r;
 }
 
@@ -110,6 +249,7 @@ char* replyStatusToString(reply_status_type status)
     case reply_created: return "HTTP/1.1 201 Created\r\n"; break;
     case reply_accepted: return "HTTP/1.1 202 Accepted\r\n"; break;
     case reply_no_content: return "HTTP/1.1 204 No Content\r\n"; break;
+    case reply_partial_content: return "HTTP/1.1 206 Partial Content\r\n"; break;
     case reply_multiple_choices: return "HTTP/1.1 300 Multiple Choices\r\n"; break;
     case reply_moved_permanently: return "HTTP/1.1 301 Moved Permanently\r\n"; break;
     case reply_moved_temporarily: return "HTTP/1.1 302 Moved Temporarily\r\n"; break;
@@ -118,6 +258,7 @@ char* replyStatusToString(reply_status_type status)
     case reply_unauthorized: return "HTTP/1.1 401 Unauthorized\r\n"; break;
     case reply_forbidden: return "HTTP/1.1 403 Forbidden\r\n"; break;
     case reply_not_found: return "HTTP/1.1 404 Not Found\r\n"; break;
+    case reply_range_not_satisfiable: return "HTTP/1.1 416 Range Not Satisfiable\r\n"; break;
     case reply_internal_server_error: return "HTTP/1.1 500 Internal Server Error\r\n"; break;
     case reply_not_implemented: return "HTTP/1.1 501 Not Implemented\r\n"; break;
     case reply_bad_gateway: return "HTTP/1.1 502 Bad Gateway\r\n"; break;
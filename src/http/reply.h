@@ -30,6 +30,9 @@
 #include "lib/adlist.h"
 #include "lib/sds.h"
 #include "lib/dict.h"
+#include "lib/objSds.h"
+#include <sys/uio.h>
+#include <time.h>
 
 #define REPLY_OK DICT_OK
 #define REPLY_ERR DICT_ERR
@@ -44,6 +47,7 @@ typedef enum
     reply_created = 201,
     reply_accepted = 202,
     reply_no_content = 204,
+    reply_partial_content = 206,
     reply_multiple_choices = 300,
     reply_moved_permanently = 301,
     reply_moved_temporarily = 302,
@@ -52,6 +56,7 @@ typedef enum
     reply_unauthorized = 401,
     reply_forbidden = 403,
     reply_not_found = 404,
+    reply_range_not_satisfiable = 416,
     reply_internal_server_error = 500,
     reply_not_implemented = 501,
     reply_bad_gateway = 502,
@@ -67,17 +72,46 @@ typedef struct reply_t
     dict *headers;
     /// The content to be sent in the reply.
     sds content;
-    /// The output buffer could be used in cause we want to cache the reply
+    /// Status line and headers, without the blank line ending them
     sds obuf;
-    int isCached;
+    /// The cached object owning obuf and the body, the reply holds one
+    /// reference on it
+    objSds *cobj;
+    /// Connection header sent with obuf for this request, NULL if none
+    const char *connection;
+    /// Part of the body of cobj sent
+    size_t offset;
+    size_t length;
+    /// Byte range asked by the request, see replySetRange()
+    int range;
+    long long range_first;
+    long long range_last;
+    /// If-Range of the request, NULL if none
+    sds if_range;
+    /// Header of a partial reply of cobj, kept for the next ones
+    sds hbuf;
 } reply;
 
-#define replyToBeCached(r) do{r->isCached = 1;}while(0);
+/// Parts of the buffer of a reply, see replyToIovec()
+#define REPLY_MAX_IOVEC 4
+
+void replySetCachedObject(reply *r, objSds *obj);
+
+void replySetRange(reply *r, long long first, long long last,
+                   const char *if_range, size_t if_range_len);
 
 reply* replyCreate();
 void replyFree(reply *r);
 
-sds replyToBuffer(reply* r);
+sds replyHeader(reply* r);
+
+sds replyObjectHeader(reply_status_type status, size_t len, time_t mtime);
+
+int replyToIovec(reply *r, struct iovec *iov);
+
+size_t replyFileLen(reply *r);
+
+void replySetKeepAlive(reply *r, int http11, int keepalive);
 
 int replyAddHeader(reply* r, const char* name, const char* value);
 
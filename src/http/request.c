@@ -26,8 +26,9 @@
  */
 
 #include <malloc.h>
+#include <strings.h>
 #include "request.h"
-#include "lib/dicttype.h"
+#include "scan.h"
 #include "ctype.h"
 
 /*
@@ -47,61 +48,174 @@
  */
 
 
+static void _requestAddHeader(request *r);
+
 /// Check if a byte is an HTTP character.
 static int is_char(char c);
 /// Check if a byte is defined as an HTTP tspecial character.
 static int is_tspecial(char c);
 
+/* Kept by the client for all its requests: parsing allocates nothing */
 request *requestCreate() {
     request* r;
     if((r = malloc(sizeof(*r))) == NULL) return NULL;
-    r->method = sdsempty();
-    r->uri = sdsempty(); /* Accelerate append string time */
-    r->headers = dictCreate(&sdsDictType,NULL);
-    r->current_header_key = sdsempty();
-    r->current_header_value = sdsempty();
-    r->state = http_method_start;
-    r->first_header = 1;
+    requestReset(r);
     return r;
 }
 
 void requestFree(request *r) {
-    sdsfree(r->method);
-    sdsfree(r->uri);
-    dictRelease(r->headers);
-    sdsfree(r->current_header_key);
-    sdsfree(r->current_header_value);
     free(r);
 }
 
-sds requestGetHeaderValue(request *r, const sds key){
-    return dictFetchValue(r->headers,key);
+/* The value of the first header called name (case-insensitive), its
+ * length in len. Returns NULL if none. */
+const char *requestGetHeaderValue(request *r, const char *name, size_t *len) {
+    size_t nlen = strlen(name);
+    int i;
+    for (i = 0; i < r->numheaders; i++) {
+        requestHeader *h = r->headers+i;
+        if (h->name.len == nlen && !strncasecmp(requestSlicePtr(r,h->name),name,nlen)) {
+            *len = h->value.len;
+            return requestSlicePtr(r,h->value);
+        }
+    }
+    return NULL;
 }
 
 void requestReset(request *r){
-    sdsclear(r->method);
-    sdsclear(r->uri);    
-    dictRelease(r->headers);
-    r->headers = dictCreate(&sdsDictType,NULL);
-    sdsclear(r->current_header_key);
-    sdsclear(r->current_header_value);
-    r->first_header = 1;
+    r->buf = NULL;
+    r->method.off = r->method.len = 0;
+    r->uri.off = r->uri.len = 0;
+    r->numheaders = 0;
+    r->connection = 0;
+    r->range = 0;
+    r->if_range.off = r->if_range.len = 0;
+    r->size = 0;
     r->state = http_method_start;
 }
 
-request_parse_state requestParse(request* r, char* begin, char* end)
+#define _requestIsSpace(c) ((c) == ' ' || (c) == '\t')
+
+/* Connection header tokens are case-insensitive, comma separated:
+ * "Connection: Keep-Alive, Upgrade" */
+static int _requestConnectionTokens(const char *v, const char *end) {
+    int flags = 0;
+    while (v < end) {
+        const char *tok;
+        size_t len;
+        while (v < end && (_requestIsSpace(*v) || *v == ',')) v++;
+        tok = v;
+        while (v < end && *v != ',' && !_requestIsSpace(*v)) v++;
+        len = v-tok;
+        if (len == 5 && !strncasecmp(tok,"close",5))
+            flags |= REQUEST_CONN_CLOSE;
+        else if (len == 10 && !strncasecmp(tok,"keep-alive",10))
+            flags |= REQUEST_CONN_KEEPALIVE;
+    }
+    return flags;
+}
+
+/* Read the digits at *v, at most 18 of them. Returns their number */
+static int _requestDigits(const char **v, const char *end, long long *n) {
+    int len = 0;
+    *n = 0;
+    while (*v < end && isdigit((unsigned char)**v) && len < 18) {
+        *n = *n*10+(**v-'0');
+        (*v)++;
+        len++;
+    }
+    return (*v < end && isdigit((unsigned char)**v)) ? 0 : len;
+}
+
+/* A single byte range: "bytes=first-last", "bytes=first-" (last is -1)
+ * or the last bytes "bytes=-suffix" (first is -1). Several ranges, or
+ * anything else, are ignored and the whole object is sent. Returns 1 if
+ * a range was found. */
+static int _requestRange(const char *v, const char *end, long long *first, long long *last) {
+    while (v < end && _requestIsSpace(*v)) v++;
+    if (end-v < 5 || strncasecmp(v,"bytes",5)) return 0;
+    v += 5;
+    while (v < end && _requestIsSpace(*v)) v++;
+    if (v == end || *v++ != '=') return 0;
+    while (v < end && _requestIsSpace(*v)) v++;
+    if (v < end && *v == '-') {
+        v++;
+        *first = -1;
+        if (!_requestDigits(&v,end,last)) return 0;
+    } else {
+        if (!_requestDigits(&v,end,first) || v == end || *v++ != '-') return 0;
+        if (!_requestDigits(&v,end,last)) *last = -1;
+        else if (*last < *first) return 0;
+    }
+    while (v < end && _requestIsSpace(*v)) v++;
+    return v == end;
+}
+
+#define _requestNameIs(name,len,s) ((len) == sizeof(s)-1 && !strncasecmp(name,s,sizeof(s)-1))
+
+/* The header just parsed: the ones the server acts upon are read at once,
+ * the others are only looked at if asked for */
+static void _requestAddHeader(request *r) {
+    const char *name = requestSlicePtr(r,r->current.name);
+    const char *value = requestSlicePtr(r,r->current.value);
+    size_t len = r->current.name.len;
+    if (_requestNameIs(name,len,"Connection"))
+        r->connection |= _requestConnectionTokens(value,value+r->current.value.len);
+    else if (_requestNameIs(name,len,"Range"))
+        r->range = _requestRange(value,value+r->current.value.len,
+                                 &r->range_first,&r->range_last);
+    else if (_requestNameIs(name,len,"If-Range") && r->if_range.off == 0)
+        r->if_range = r->current.value;
+    if (r->numheaders < REQUEST_MAX_HEADERS) r->headers[r->numheaders++] = r->current;
+}
+
+/* Whether the connection persists after the reply of a parsed request:
+ * by default from HTTP/1.1 on, unless the client asked to close; with
+ * HTTP/1.0 only when it asked to keep it alive. */
+int requestKeepAlive(request *r) {
+    if (r->connection & REQUEST_CONN_CLOSE) return 0;
+    if (r->connection & REQUEST_CONN_KEEPALIVE) return 1;
+    return requestHttp11(r);
+}
+
+/* Parse the request beginning buf, of which len bytes were received so
+ * far: the call resumes after the r->size bytes parsed by the former ones,
+ * so a request received in several reads must begin buf each time. Once
+ * it is complete, r->size is its length, the next requests may follow
+ * (pipelining). A request is at most MAX_REQUEST_SIZE bytes.
+ * Nothing is copied: the method, the URI, the names and values of the
+ * headers are recorded as slices of buf. Their bytes are skipped by runs
+ * found by the scanners (see scan.h): the states below only look at the
+ * byte ending a run. */
+request_parse_state requestParse(request* r, const char *buf, size_t len)
 {
     request_parse_state result = parse_not_completed;
-
-    if(end - begin > MAX_REQUEST_SIZE) return parse_error;
+    const char *begin = buf+r->size, *end = buf+len, *limit = end;
+    unsigned short pos;
     char current;
-    char *buf = r->buf;
-    char *ptr = r->ptr;
-    sds header_key = r->current_header_key;
-    sds header_value = r->current_header_value;
     http_state state = r->state;
-    while (begin < end)
+
+    r->buf = buf;
+    if (len > MAX_REQUEST_SIZE) limit = buf+MAX_REQUEST_SIZE;
+    while (begin < limit)
     {
+        switch (state)
+        {
+        case http_method:
+        case http_header_name:
+            begin = scanToken(begin,limit);
+            break;
+        case http_uri:
+            begin = scanUri(begin,limit);
+            break;
+        case http_header_value:
+            begin = scanValue(begin,limit);
+            break;
+        default:
+            break;
+        }
+        if (begin == limit) break;
+        pos = begin-buf;
         current = *begin++;
         switch (state)
         {
@@ -113,16 +227,15 @@ request_parse_state requestParse(request* r, char* begin, char* end)
             else
             {
                 state = http_method;
-                ptr = buf;
-                *ptr++ = current;
+                r->method.off = pos;
                 result =  parse_not_completed;
             }
             break;
         case http_method:
             if (current == ' ')
             {
-                r->method = sdscatlen(r->method,buf,ptr-buf);
-                ptr=buf;
+                r->method.len = pos-r->method.off;
+                r->uri.off = pos+1;
                 state = http_uri;
                 result =  parse_not_completed;
             }
@@ -130,17 +243,11 @@ request_parse_state requestParse(request* r, char* begin, char* end)
             {
                 result =  parse_error;
             }
-            else
-            {
-                *ptr++ = current;
-                result =  parse_not_completed;
-            }
             break;
         case http_uri:
             if (current == ' ')
             {
-                r->uri = sdscatlen(r->uri,buf,ptr-buf);
-                ptr=buf;
+                r->uri.len = pos-r->uri.off;
                 state = http_version_h;
                 result =  parse_not_completed;
             }
@@ -148,11 +255,6 @@ request_parse_state requestParse(request* r, char* begin, char* end)
             {
                 result =  parse_error;
             }
-            else
-            {
-                *ptr++=current;
-                result =  parse_not_completed;
-            }
             break;
 
         case http_version_h:
@@ -290,76 +392,28 @@ request_parse_state requestParse(request* r, char* begin, char* end)
         case http_header_line_start:
             if (current == '\r')
             {
-                /* new line after new line, meaning all headeres are parsed
-                 * header_key and header_value are assigned to sdsempty
-                 * to simplify the treatment of current_header fields in the request
-                 * In particular, assigning the values to sdsempty(),
-                 * there is no need to check NULL in requestReset and requestFree
-                */
-                if(r->first_header == 0){
-                    header_key = sdsempty();
-                    header_value = sdsempty();
-                }
-                r->first_header = 1;
+                /* new line after new line, meaning all headers are parsed */
                 state = http_expecting_newline_3;
                 result =  parse_not_completed;
             }
-            else if (r->headers->used>0 && (current == ' ' || current == '\t'))
-            {
-                header_key = sdscatlen(header_key,buf,ptr-buf);
-                ptr=buf;
-                state = http_header_lws;
-                result =  parse_not_completed;
-            }
             else if (!is_char(current) || iscntrl(current) || is_tspecial(current))
             {
+                /* Folded header lines (obsolete) are refused as well */
                 result =  parse_error;
             }
             else
             {
                 /* new header in the current line */
-                if(r->first_header != 1){
-                    header_key = sdsempty();
-                    header_value = sdsempty();
-                }
-                r->first_header = 0;
-                *ptr++=current;
+                r->current.name.off = pos;
                 state = http_header_name;
                 result =  parse_not_completed;
             }
             break;
 
-        case http_header_lws:
-            if (current == '\r')
-            {
-                header_value = sdscatlen(header_value,buf,ptr-buf);
-                dictAdd(r->headers,header_key,header_value);
-                ptr=buf;
-                state = http_expecting_newline_2;
-                result =  parse_not_completed;
-            }
-            else if (current == ' ' || current == '\t')
-            {
-                result =  parse_not_completed;
-            }
-            else if (iscntrl(current))
-            {
-                result =  parse_error;
-            }
-            else
-            {
-                state = http_header_value;
-                *ptr++=current;
-                //req.headers.back().value.push_back(current);
-                result =  parse_not_completed;
-            }
-            break;
-
         case http_header_name:
             if (current == ':') // end of header_name
             {
-                header_key = sdscatlen(header_key,buf,ptr-buf);
-                ptr=buf;
+                r->current.name.len = pos-r->current.name.off;
                 state = http_space_before_header_value;
                 result =  parse_not_completed;
             }
@@ -367,17 +421,12 @@ request_parse_state requestParse(request* r, char* begin, char* end)
             {
                 result =  parse_error;
             }
-            else
-            {
-                *ptr++=current;
-                //req.headers.back().name.push_back(current);
-                result =  parse_not_completed;
-            }
             break;
 
         case http_space_before_header_value:
             if (current == ' ')
             {
+                r->current.value.off = pos+1;
                 state = http_header_value;
                 result =  parse_not_completed;
             }
@@ -390,9 +439,8 @@ request_parse_state requestParse(request* r, char* begin, char* end)
         case http_header_value:
             if (current == '\r')
             {
-                header_value= sdscatlen(header_value,buf,ptr-buf);
-                dictAdd(r->headers,header_key,header_value);
-                ptr=buf;
+                r->current.value.len = pos-r->current.value.off;
+                _requestAddHeader(r);
                 state = http_expecting_newline_2;
                 result =  parse_not_completed;
             }
@@ -400,12 +448,6 @@ request_parse_state requestParse(request* r, char* begin, char* end)
             {
                 result =  parse_error;
             }
-            else
-            {
-                *ptr++=current;
-                //req.headers.back().value.push_back(current);
-                result =  parse_not_completed;
-            }
             break;
 
         case http_expecting_newline_2:
@@ -431,9 +473,9 @@ request_parse_state requestParse(request* r, char* begin, char* end)
         }
         if (result==parse_error|| result==parse_completed) break;
     }
-    r->ptr = ptr;
-    r->current_header_key = header_key;
-    r->current_header_value = header_value;
+    /* Too large */
+    if (result == parse_not_completed && begin < end) result = parse_error;
+    r->size = begin-buf;
     r->state = state;
     return  result;
 }
@@ -462,15 +504,177 @@ int is_tspecial(char c)
 }
 
 void requestPrint(request *r){
-    printf("%s %s\n",r->method,r->uri);
-    dictIterator *di = dictGetIterator(r->headers);
-    dictEntry *de;
-    while((de = dictNext(di)) != NULL) {
-        printf("%s: %s\n",(sds)dictGetEntryKey(de),(sds)dictGetEntryVal(de));
+    int i;
+    printf("%.*s %.*s\n",r->method.len,requestSlicePtr(r,r->method),
+           r->uri.len,requestUri(r));
+    for (i = 0; i < r->numheaders; i++) {
+        requestHeader *h = r->headers+i;
+        printf("%.*s: %.*s\n",h->name.len,requestSlicePtr(r,h->name),
+               h->value.len,requestSlicePtr(r,h->value));
     }
-    dictReleaseIterator(di);
-    printf("Current Key: %s\n",r->current_header_key);
-    printf("Current Value: %s\n",r->current_header_value);
     printf("STATE: %d\n",r->state);
 }
 
+
+#ifdef REQUEST_BENCHMARK_MAIN
+/* gcc -O2 -DREQUEST_BENCHMARK_MAIN -Isrc src/http/request.c src/http/scan.c -o request-bench
+ *
+ * Parse requests as sent by browsers and CDNs with each level of scanners
+ * the CPU supports. Each request is first parsed whole and in small
+ * reads, which must give the same request. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ccache_config.h"
+
+#define BENCH_ITERATIONS 1000000UL
+
+static const char *bench_requests[] = {
+    /* browser */
+    "GET /zoom/w_320,h_240,c_1/photos/2013/06/12/IMG_4521.jpg HTTP/1.1\r\n"
+    "Host: img.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-site\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: https://www.example.com/gallery/summer-2013?page=3\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,vi;q=0.8\r\n"
+    "Cookie: _ga=GA1.2.1493745720.1697011234; _gid=GA1.2.208416203.1697611234; "
+    "session=9f8e7d6c5b4a39281706f5e4d3c2b1a0\r\n"
+    "\r\n",
+    /* CDN edge to origin */
+    "GET /static/video/posters/big_buck_bunny_1080p.jpg HTTP/1.1\r\n"
+    "Host: origin.example.com\r\n"
+    "Via: 1.1 varnish, 1.1 a8f2c3d4e5f6.cloudfront.net (CloudFront)\r\n"
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "X-Amz-Cf-Id: 2kN1o0dOYqXyJ6Pq_r3D1q9bS0eVxR4pTzWw5F8aXnD0mQ7uLcKJhA==\r\n"
+    "CDN-Loop: cloudflare; loops=1\r\n"
+    "CF-Connecting-IP: 203.0.113.195\r\n"
+    "X-Request-Id: 3f1c2b7e-9a4d-4e8b-b6c1-0d2e5f7a9c31\r\n"
+    "User-Agent: Amazon CloudFront\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "Range: bytes=0-1048575\r\n"
+    "If-Range: Tue, 11 Jun 2013 08:12:31 GMT\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+    /* tool */
+    "GET /static/favicon.ico HTTP/1.1\r\n"
+    "Host: localhost:8899\r\n"
+    "User-Agent: curl/8.4.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+static const char *bench_names[] = {"browser","cdn","curl"};
+
+static double benchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Parse the request received by reads of step bytes */
+static request_parse_state benchParse(request *r, const char *req, size_t len, size_t step) {
+    request_parse_state state = parse_not_completed;
+    size_t received = 0;
+    while (received < len && state == parse_not_completed) {
+        received = len-received < step ? len : received+step;
+        state = requestParse(r,req,received);
+    }
+    return r->size == len ? state : parse_error;
+}
+
+/* Method, URI and headers, as text to compare */
+static void benchDump(request *r, char *buf, size_t size) {
+    size_t len = 0;
+    const char *ua = requestGetHeaderValue(r,"user-agent",&len);
+    snprintf(buf,size,"%.*s %.*s %d.%d %d %d %d\n%.*s\n",
+             r->method.len,requestSlicePtr(r,r->method),(int)requestUriLen(r),requestUri(r),
+             r->version_major,r->version_minor,r->numheaders,r->connection,r->range,
+             (int)len,ua ? ua : "");
+}
+
+static int benchCheck(request *r, const char *req) {
+    size_t len = strlen(req), steps[] = {1,3,7,16,31,4096};
+    char ref[1024], got[1024];
+    unsigned int i;
+    requestReset(r);
+    if (benchParse(r,req,len,len) != parse_completed) return 0;
+    benchDump(r,ref,sizeof(ref));
+    for (i = 0; i < sizeof(steps)/sizeof(*steps); i++) {
+        requestReset(r);
+        if (benchParse(r,req,len,steps[i]) != parse_completed) return 0;
+        benchDump(r,got,sizeof(got));
+        if (strcmp(got,ref)) return 0;
+    }
+    return 1;
+}
+
+/* Walk the request by header values, as the scanners alone see it */
+static size_t benchScan(const char *req, size_t len) {
+    const char *p = req, *end = req+len;
+    size_t stops = 0;
+    while (p < end) {
+        p = scanValue(p,end)+1;
+        stops++;
+    }
+    return stops;
+}
+
+int main(int argc, char **argv) {
+    static const char *levels[] = {"scalar","sse4.2","avx2"};
+    unsigned long iterations = argc > 1 ? strtoul(argv[1],NULL,10) : BENCH_ITERATIONS;
+    request *r = requestCreate();
+    unsigned int i;
+    int level;
+    char ref[3][1024], got[1024];
+    for (i = 0; i < 3; i++) {
+        requestReset(r);
+        benchParse(r,bench_requests[i],strlen(bench_requests[i]),4096);
+        benchDump(r,ref[i],sizeof(ref[i]));
+    }
+    for (level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+        if (scanSelect(level) != CCACHE_OK) {
+            printf("%-7s not supported\n",levels[level]);
+            continue;
+        }
+        for (i = 0; i < 3; i++) {
+            const char *req = bench_requests[i];
+            size_t len = strlen(req), stops = 0;
+            unsigned long k;
+            double t, ts;
+            if (!benchCheck(r,req)) {
+                printf("%-7s %-8s PARSE MISMATCH\n",scan_ops.name,bench_names[i]);
+                return 1;
+            }
+            benchDump(r,got,sizeof(got));
+            if (strcmp(got,ref[i])) {
+                printf("%-7s %-8s differs from scalar\n",scan_ops.name,bench_names[i]);
+                return 1;
+            }
+            t = benchNow();
+            for (k = 0; k < iterations; k++) {
+                requestReset(r);
+                requestParse(r,req,len);
+            }
+            t = benchNow()-t;
+            ts = benchNow();
+            for (k = 0; k < iterations; k++) stops += benchScan(req,len);
+            ts = benchNow()-ts;
+            printf("%-7s %-8s %4zu bytes  parse %7.1f ns  scan %6.1f ns %7.1f MB/s (%zu)\n",
+                   scan_ops.name,bench_names[i],len,t/iterations*1e9,ts/iterations*1e9,
+                   len*iterations/ts/1e6,stops/iterations);
+        }
+    }
+    requestFree(r);
+    return 0;
+}
+#endif
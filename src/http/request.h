@@ -28,8 +28,7 @@
 #ifndef _REQUEST_H
 #define _REQUEST_H
 
-#include "lib/sds.h"
-#include "lib/dict.h"
+#include <string.h>
 
 #define MAX_REQUEST_SIZE 8096
 
@@ -56,7 +55,6 @@ typedef enum
   http_version_minor,
   http_expecting_newline_1,
   http_header_line_start,
-  http_header_lws,
   http_header_name,
   http_space_before_header_value,
   http_header_value,
@@ -64,28 +62,74 @@ typedef enum
   http_expecting_newline_3
 }  http_state;
 
-/// A request received from a client.
+/// Tokens of the Connection header of a request
+#define REQUEST_CONN_CLOSE (1<<0)
+#define REQUEST_CONN_KEEPALIVE (1<<1)
+
+/// Bytes of a request, from its first byte: a request is at most
+/// MAX_REQUEST_SIZE bytes
 typedef struct
 {
-    sds method;
-    sds uri;
+    unsigned short off;
+    unsigned short len;
+} requestSlice;
+
+typedef struct
+{
+    requestSlice name;
+    requestSlice value;
+} requestHeader;
+
+/// Headers kept for requestGetHeaderValue(), the next ones are parsed
+/// (Connection, Range and If-Range still apply) but not kept
+#define REQUEST_MAX_HEADERS 32
+
+/// A request received from a client. Nothing is copied: the method, the
+/// URI and the headers are slices of the buffer holding the request,
+/// valid until the request is reset.
+typedef struct
+{
+    /// First byte of the request, see requestParse()
+    const char *buf;
+    requestSlice method;
+    requestSlice uri;
     int version_major;
     int version_minor;
-    dict *headers;
+    requestHeader headers[REQUEST_MAX_HEADERS];
+    int numheaders;
+    /// REQUEST_CONN_* found in the Connection header
+    int connection;
+    /// Set if the Range header holds a single byte range: first-last,
+    /// first- (last is -1) or the last bytes -last (first is -1)
+    int range;
+    long long range_first;
+    long long range_last;
+    /// Value of the If-Range header, off is 0 if none (the method is there)
+    requestSlice if_range;
     /// The current state of the parser.
     http_state state;
-    char *ptr;
-    char buf[MAX_REQUEST_SIZE];
-    sds current_header_key;
-    sds current_header_value;
-    int first_header;
+    /// Header being parsed
+    requestHeader current;
+    /// Bytes of the request parsed so far
+    size_t size;
 } request;
 
+/// Address of a slice of the request
+#define requestSlicePtr(r,s) ((r)->buf+(s).off)
+#define requestUri(r) requestSlicePtr(r,(r)->uri)
+#define requestUriLen(r) ((size_t)(r)->uri.len)
+/// Whether the method is m, a string literal
+#define requestMethodIs(r,m) ((r)->method.len == sizeof(m)-1 && \
+                              !memcmp(requestSlicePtr(r,(r)->method),m,sizeof(m)-1))
+
 request *requestCreate();
 void requestFree(request *r);
-sds requestGetHeaderValue(request *r, const sds key);
+const char *requestGetHeaderValue(request *r, const char *name, size_t *len);
 void requestReset(request *r);
-request_parse_state requestParse(request* r, char* begin, char* end);
+request_parse_state requestParse(request* r, const char *buf, size_t len);
 void requestPrint(request *r);
+int requestKeepAlive(request *r);
+#define requestHttp11(r) ((r)->version_major > 1 || \
+                          ((r)->version_major == 1 && (r)->version_minor >= 1))
 
 #endif
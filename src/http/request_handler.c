@@ -30,6 +30,8 @@
 #include "request_handler.h"
 #include "lib/util.h"
 #include "net/client.h"
+#include "cache/mcache.h"
+#include "service/zoom.h"
 
 static ccache *global_cache;
 static pthread_mutex_t mutex_global_cache;
@@ -39,27 +41,50 @@ void requestHandleInitializeGlobalCache() {
     global_cache = cacheCreate();
 }
 
-static void requestHandleAddWaitingClient(cacheEntry *ce, httpClient *client) {
-    listAddNodeTail(ce->waiting_clients,client);
-    client->ceList = ce->waiting_clients;
+static void requestHandleAddWaitingClient(ccache *c, cacheEntry *ce, httpClient *client) {
+    cacheAddWaitingClient(c,ce,client);
+    client->ceList = &ce->waiting_clients;
 }
 
 int requestHandle(request *req, reply *rep, ccache *c, void *client) {
+    if(req->range && requestMethodIs(req,"GET"))
+        replySetRange(rep,req->range_first,req->range_last,
+                      req->if_range.off ? requestSlicePtr(req,req->if_range) : NULL,
+                      req->if_range.len);
     if(c) {
-        /* whether found in cache or newly added to cache,
-         * the obuf of reply will be managed by the cache */
-        replyToBeCached(rep);
-        cacheEntry *ce = cacheFind(c,req->uri);
-        if(ce) {
-            if (ce->val) {
-                rep->obuf = ce->val;
-                return HANDLER_OK;
-            }
-            /* NULL object */
-            requestHandleAddWaitingClient(ce,client);
-            /* block client */
-            return HANDLER_BLOCK;
+        char canonical[CCACHE_MAX_URI_LEN];
+        const char *key = requestUri(req);
+        size_t keylen = requestUriLen(req), n;
+        /* Variants of a zoom URI share the key of the image they ask for,
+         * sizes not allowed never reach the master */
+        switch(zoomCanonicalUri(key,keylen,canonical,sizeof(canonical),&n)) {
+        case ZOOM_KEY_CANONICAL:
+            key = canonical;
+            keylen = n;
+            break;
+        case ZOOM_KEY_REDIRECT:
+            replySetStatus(rep,reply_moved_temporarily);
+            replyAddHeader(rep,"Location",canonical);
+            return HANDLER_OK;
+        case ZOOM_KEY_REFUSED:
+            replySetStatus(rep,reply_not_found);
+            replySetContent(rep,"Not Found");
+            return HANDLER_OK;
         }
+        /* Hit: the object is taken from the shared index, no message */
+        objSds *obj = cacheMasterLookup(key,keylen);
+        if(obj) {
+            cacheCountHit(c);
+            replySetCachedObject(rep,obj);
+            return HANDLER_OK;
+        }
+        /* Miss: wait for the master, with the other clients asking for it.
+         * The key is copied out of the request only now. */
+        cacheEntry *ce = cacheFind(c,sdsnewlen(key,keylen));
+        if(ce == NULL) return HANDLER_BUSY;
+        requestHandleAddWaitingClient(c,ce,client);
+        /* block client */
+        return HANDLER_BLOCK;
     }
     return HANDLER_ERR;
 }
@@ -69,3 +94,9 @@ void requestHandleError(request *req, reply *rep) {
     replySetStatus(rep,reply_ok);
     replySetContent(rep,"ERROR");
 }
+
+void requestHandleBusy(request *req, reply *rep) {
+    (void)req;
+    replySetStatus(rep,reply_service_unavailable);
+    replySetContent(rep,"BUSY");
+}
@@ -35,6 +35,7 @@
 #define HANDLER_OK 0
 #define HANDLER_ERR 1
 #define HANDLER_BLOCK 2
+#define HANDLER_BUSY 3 /* too many requests waiting for the master */
 
 
 void requestHandleInitializeGlobalCache();
@@ -43,4 +44,6 @@ int requestHandle(request *req, reply *rep, ccache *c, void *client);
 
 void requestHandleError(request *req, reply *rep);
 
+void requestHandleBusy(request *req, reply *rep);
+
 #endif // REQUEST_HANDLER_H
@@ -0,0 +1,202 @@
+/* scan.c - search of the delimiters of a request, 16 or 32 bytes at a time
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "scan.h"
+#include "ccache_config.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Bytes ending a run, for the scalar scanners and the tails of the
+ * vectorized ones */
+static unsigned char scan_stop_token[256];
+static unsigned char scan_stop_uri[256];
+static unsigned char scan_stop_value[256];
+
+static int _scanIsControl(int c) {
+    return c < 0x20 || c == 0x7f;
+}
+
+/* Separators of RFC 2616, as the parser checks them */
+static int _scanIsSeparator(int c) {
+    switch (c) {
+    case '(': case ')': case '<': case '>': case '@':
+    case ',': case ';': case ':': case '\\': case '"':
+    case '/': case '[': case ']': case '?': case '=':
+    case '{': case '}': case ' ': case '\t':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static const char *_scanTable(const char *p, const char *end, const unsigned char *stop) {
+    while (p < end && !stop[(unsigned char)*p]) p++;
+    return p;
+}
+
+static const char *_scanTokenScalar(const char *p, const char *end) {
+    return _scanTable(p,end,scan_stop_token);
+}
+
+static const char *_scanUriScalar(const char *p, const char *end) {
+    return _scanTable(p,end,scan_stop_uri);
+}
+
+static const char *_scanValueScalar(const char *p, const char *end) {
+    return _scanTable(p,end,scan_stop_value);
+}
+
+#ifdef SCAN_X86
+/* pcmpestri compares 16 bytes with up to 8 ranges of bytes at once. The
+ * ranges of a token also stop on '|' and '~', which are fine. */
+static const char scan_ranges_token[16] __attribute__((aligned(16))) =
+    "\x00 \"\"(),,//:@[]{\xff";
+static const char scan_ranges_uri[16] __attribute__((aligned(16))) =
+    "\x00 \x7f\x7f";
+static const char scan_ranges_value[16] __attribute__((aligned(16))) =
+    "\x00\x1f\x7f\x7f";
+
+#define SCAN_SSE42_LOOP(p,end,ranges,nranges,stop) do { \
+    __m128i r = _mm_load_si128((const __m128i*)(ranges)); \
+    while ((end)-(p) >= 16) { \
+        __m128i b = _mm_loadu_si128((const __m128i*)(p)); \
+        int i = _mm_cmpestri(r,(nranges),b,16, \
+                             _SIDD_UBYTE_OPS|_SIDD_CMP_RANGES|_SIDD_LEAST_SIGNIFICANT); \
+        if (i != 16) return (p)+i; \
+        (p) += 16; \
+    } \
+    return _scanTable((p),(end),(stop)); \
+} while(0)
+
+__attribute__((target("sse4.2")))
+static const char *_scanTokenSse42(const char *p, const char *end) {
+    SCAN_SSE42_LOOP(p,end,scan_ranges_token,16,scan_stop_token);
+}
+
+__attribute__((target("sse4.2")))
+static const char *_scanUriSse42(const char *p, const char *end) {
+    SCAN_SSE42_LOOP(p,end,scan_ranges_uri,4,scan_stop_uri);
+}
+
+__attribute__((target("sse4.2")))
+static const char *_scanValueSse42(const char *p, const char *end) {
+    SCAN_SSE42_LOOP(p,end,scan_ranges_value,4,scan_stop_value);
+}
+
+/* AVX2 has no pcmpestri: 32 bytes are compared with the bounds of the
+ * ranges. Bytes are signed, those from 0x80 are negative and thus below
+ * every bound. A token stops on anything but letters, digits and '-',
+ * which covers the names of the usual headers. */
+#define SCAN_AVX2_LOOP(p,end,mask,stop) do { \
+    while ((end)-(p) >= 32) { \
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p)); \
+        unsigned int m = (unsigned int)_mm256_movemask_epi8(mask); \
+        if (m) return (p)+__builtin_ctz(m); \
+        (p) += 32; \
+    } \
+    return _scanTable((p),(end),(stop)); \
+} while(0)
+
+#define scanAvx2Set(c) _mm256_set1_epi8((char)(c))
+#define scanAvx2In(b,lo,hi) _mm256_and_si256(_mm256_cmpgt_epi8((b),scanAvx2Set((lo)-1)), \
+                                             _mm256_cmpgt_epi8(scanAvx2Set((hi)+1),(b)))
+
+__attribute__((target("avx2")))
+static const char *_scanTokenAvx2(const char *p, const char *end) {
+#define SCAN_AVX2_TOKEN \
+    _mm256_xor_si256(_mm256_or_si256(_mm256_or_si256( \
+        scanAvx2In(_mm256_or_si256(b,scanAvx2Set(0x20)),'a','z'), \
+        scanAvx2In(b,'0','9')), \
+        _mm256_cmpeq_epi8(b,scanAvx2Set('-'))), \
+        scanAvx2Set(0xff))
+    SCAN_AVX2_LOOP(p,end,SCAN_AVX2_TOKEN,scan_stop_token);
+#undef SCAN_AVX2_TOKEN
+}
+
+__attribute__((target("avx2")))
+static const char *_scanUriAvx2(const char *p, const char *end) {
+#define SCAN_AVX2_URI \
+    _mm256_or_si256(scanAvx2In(b,0x00,0x20),_mm256_cmpeq_epi8(b,scanAvx2Set(0x7f)))
+    SCAN_AVX2_LOOP(p,end,SCAN_AVX2_URI,scan_stop_uri);
+#undef SCAN_AVX2_URI
+}
+
+__attribute__((target("avx2")))
+static const char *_scanValueAvx2(const char *p, const char *end) {
+#define SCAN_AVX2_VALUE \
+    _mm256_or_si256(scanAvx2In(b,0x00,0x1f),_mm256_cmpeq_epi8(b,scanAvx2Set(0x7f)))
+    SCAN_AVX2_LOOP(p,end,SCAN_AVX2_VALUE,scan_stop_value);
+#undef SCAN_AVX2_VALUE
+}
+#endif
+
+static const scanOps scan_impls[] = {
+    {"scalar",_scanTokenScalar,_scanUriScalar,_scanValueScalar},
+#ifdef SCAN_X86
+    {"sse4.2",_scanTokenSse42,_scanUriSse42,_scanValueSse42},
+    {"avx2",_scanTokenAvx2,_scanUriAvx2,_scanValueAvx2},
+#endif
+};
+
+scanOps scan_ops = {"scalar",_scanTokenScalar,_scanUriScalar,_scanValueScalar};
+
+static int _scanSupported(int level) {
+    switch (level) {
+    case SCAN_SCALAR: return 1;
+#ifdef SCAN_X86
+    case SCAN_SSE42: return __builtin_cpu_supports("sse4.2");
+    case SCAN_AVX2: return __builtin_cpu_supports("avx2");
+#endif
+    default: return 0;
+    }
+}
+
+/* Use the scanners of a level (SCAN_*), if the CPU supports them */
+int scanSelect(int level) {
+    if (!_scanSupported(level)) return CCACHE_ERR;
+    scan_ops = scan_impls[level];
+    return CCACHE_OK;
+}
+
+/* Before main, as the parser may run on any worker */
+__attribute__((constructor))
+static void _scanInit(void) {
+    int c, level;
+    for (c = 0; c < 256; c++) {
+        scan_stop_token[c] = c >= 0x80 || _scanIsControl(c) || _scanIsSeparator(c);
+        scan_stop_uri[c] = _scanIsControl(c) || c == ' ';
+        scan_stop_value[c] = _scanIsControl(c);
+    }
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    for (level = SCAN_AVX2; level > SCAN_SCALAR; level--)
+        if (scanSelect(level) == CCACHE_OK) break;
+}
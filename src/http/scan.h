@@ -0,0 +1,58 @@
+/* scan.h - search of the delimiters of a request, 16 or 32 bytes at a time
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+/* Scanners return the first byte of [p,end) which may end a run of the
+ * parser, end if there is none. They may stop early on a byte which is
+ * fine, the parser checks it as before; they never pass a byte which is
+ * not:
+ * - token: anything but the characters of a method or a header name
+ * - uri: controls and space
+ * - value: controls, CR included */
+typedef struct scanOps {
+    const char *name;
+    const char *(*token)(const char *p, const char *end);
+    const char *(*uri)(const char *p, const char *end);
+    const char *(*value)(const char *p, const char *end);
+} scanOps;
+
+#define SCAN_SCALAR 0
+#define SCAN_SSE42 1
+#define SCAN_AVX2 2
+
+/* The best scanners the CPU supports, chosen at startup */
+extern scanOps scan_ops;
+
+#define scanToken(p,end) scan_ops.token((p),(end))
+#define scanUri(p,end) scan_ops.uri((p),(end))
+#define scanValue(p,end) scan_ops.value((p),(end))
+
+int scanSelect(int level);
+
+#endif // SCAN_H
@@ -44,12 +44,19 @@ list *listCreate(void)
 
     if ((list = malloc(sizeof(*list))) == NULL)
         return NULL;
+    listInit(list);
+    return list;
+}
+
+/* Initialize an empty list allocated by the caller (embedded in another
+ * structure). */
+void listInit(list *list)
+{
     list->head = list->tail = NULL;
     list->len = 0;
     list->dup = NULL;
     list->free = NULL;
     list->match = NULL;
-    return list;
 }
 
 /* Free the whole list.
@@ -110,6 +117,15 @@ list *listAddNodeTail(list *list, void *value)
     if ((node = malloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
+    listLinkNodeTail(list,node);
+    return list;
+}
+
+/* Add a node allocated by the caller, its value already set, to tail.
+ *
+ * This function can't fail. */
+void listLinkNodeTail(list *list, listNode *node)
+{
     if (list->len == 0) {
         list->head = list->tail = node;
         node->prev = node->next = NULL;
@@ -120,7 +136,6 @@ list *listAddNodeTail(list *list, void *value)
         list->tail = node;
     }
     list->len++;
-    return list;
 }
 
 list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
@@ -157,6 +172,17 @@ list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
  *
  * This function can't fail. */
 void listDelNode(list *list, listNode *node)
+{
+    listUnlinkNode(list,node);
+    if (list->free) list->free(node->value);
+    free(node);
+}
+
+/* Remove the specified node from the list without freeing it nor its
+ * value: the caller owns the node again.
+ *
+ * This function can't fail. */
+void listUnlinkNode(list *list, listNode *node)
 {
     if (node->prev)
         node->prev->next = node->next;
@@ -166,8 +192,6 @@ void listDelNode(list *list, listNode *node)
         node->next->prev = node->prev;
     else
         list->tail = node->prev;
-    if (list->free) list->free(node->value);
-    free(node);
     list->len--;
 }
 
@@ -36,14 +36,15 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <limits.h>
+#include <sys/time.h>
 #include "dict.h"
 
 /* -------------------------- private prototypes ---------------------------- */
 
-static int _dictExpandIfNeeded(dict *ht);
+static int _dictExpandIfNeeded(dict *d);
 static unsigned long _dictNextPower(unsigned long size);
-static int _dictKeyIndex(dict *ht, const void *key);
-static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static int _dictKeyIndex(dict *d, const void *key);
+static int _dictInit(dict *d, dictType *type, void *privDataPtr);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -59,9 +60,9 @@ unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
 
 /* ----------------------------- API implementation ------------------------- */
 
-/* Reset an hashtable already initialized with ht_init().
+/* Reset a hash table already initialized with ht_init().
  * NOTE: This function should only called by ht_destroy(). */
-void _dictReset(dict *ht) {
+static void _dictReset(dictht *ht) {
     ht->table = NULL;
     ht->size = 0;
     ht->sizemask = 0;
@@ -70,101 +71,163 @@ void _dictReset(dict *ht) {
 
 /* Create a new hash table */
 dict *dictCreate(dictType *type, void *privDataPtr) {
-    dict *ht = malloc(sizeof(*ht));
-    _dictInit(ht,type,privDataPtr);
-    return ht;
+    dict *d = malloc(sizeof(*d));
+    _dictInit(d,type,privDataPtr);
+    return d;
 }
 
 /* Initialize the hash table */
-int _dictInit(dict *ht, dictType *type, void *privDataPtr) {
-    _dictReset(ht);
-    ht->type = type;
-    ht->privdata = privDataPtr;
+int _dictInit(dict *d, dictType *type, void *privDataPtr) {
+    _dictReset(&d->ht[0]);
+    _dictReset(&d->ht[1]);
+    d->type = type;
+    d->privdata = privDataPtr;
+    d->rehashidx = -1;
+    d->iterators = 0;
     return DICT_OK;
 }
 
-/* Expand or create the hashtable */
-int dictExpand(dict *ht, unsigned long size) {
-    dict n; /* the new hashtable */
-    unsigned long realsize = _dictNextPower(size), i;
+/* Resize the table to the minimal size that contains all the elements */
+int dictResize(dict *d) {
+    unsigned long minimal;
+
+    if (dictIsRehashing(d)) return DICT_ERR;
+    minimal = d->ht[0].used;
+    if (minimal < DICT_HT_INITIAL_SIZE)
+        minimal = DICT_HT_INITIAL_SIZE;
+    return dictExpand(d, minimal);
+}
+
+/* Expand or create the hash table. The entries are not moved here:
+ * a second table is allocated and rehashing is done incrementally. */
+int dictExpand(dict *d, unsigned long size) {
+    dictht n; /* the new hash table */
+    unsigned long realsize = _dictNextPower(size);
 
     /* the size is invalid if it is smaller than the number of
-     * elements already inside the hashtable */
-    if (ht->used > size)
+     * elements already inside the hash table */
+    if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
-    _dictInit(&n, ht->type, ht->privdata);
     n.size = realsize;
     n.sizemask = realsize-1;
     n.table = calloc(realsize,sizeof(dictEntry*));
+    n.used = 0;
 
-    /* Copy all the elements from the old to the new table:
-     * note that if the old hash table is empty ht->size is zero,
-     * so dictExpand just creates an hash table. */
-    n.used = ht->used;
-    for (i = 0; i < ht->size && ht->used > 0; i++) {
-        dictEntry *he, *nextHe;
+    /* Is this the first initialization? If so it's not really a rehashing
+     * we just set the first hash table so that it can accept keys. */
+    if (d->ht[0].table == NULL) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
 
-        if (ht->table[i] == NULL) continue;
+    /* Prepare a second hash table for incremental rehashing */
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
 
-        /* For each hash entry on this slot... */
-        he = ht->table[i];
-        while(he) {
+/* Performs N steps of incremental rehashing. Returns 1 if there are still
+ * keys to move from the old to the new hash table, otherwise 0 is returned.
+ * Note that a rehashing step consists in moving a bucket (that may have more
+ * than one key as we use chaining) from the old to the new hash table.
+ * At most N*10 empty buckets are visited, so a step is bounded even on a
+ * sparse table. */
+int dictRehash(dict *d, int n) {
+    int empty_visits = n*10;
+
+    if (!dictIsRehashing(d)) return 0;
+
+    while(n--) {
+        dictEntry *de, *nextde;
+
+        /* Check if we already rehashed the whole table... */
+        if (d->ht[0].used == 0) {
+            free(d->ht[0].table);
+            d->ht[0] = d->ht[1];
+            _dictReset(&d->ht[1]);
+            d->rehashidx = -1;
+            return 0;
+        }
+
+        /* Note that rehashidx can't overflow as we are sure there are more
+         * elements because ht[0].used != 0 */
+        assert(d->ht[0].size > (unsigned long)d->rehashidx);
+        while(d->ht[0].table[d->rehashidx] == NULL) {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        de = d->ht[0].table[d->rehashidx];
+        /* Move all the keys in this bucket from the old to the new hash HT */
+        while(de) {
             unsigned int h;
 
-            nextHe = he->next;
-            /* Get the new element index */
-            h = dictHashKey(ht, he->key) & n.sizemask;
-            he->next = n.table[h];
-            n.table[h] = he;
-            ht->used--;
-            /* Pass to the next element */
-            he = nextHe;
+            nextde = de->next;
+            /* Get the index in the new hash table */
+            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
+            de->next = d->ht[1].table[h];
+            d->ht[1].table[h] = de;
+            d->ht[0].used--;
+            d->ht[1].used++;
+            de = nextde;
         }
+        d->ht[0].table[d->rehashidx] = NULL;
+        d->rehashidx++;
     }
-    assert(ht->used == 0);
-    free(ht->table);
+    return 1;
+}
 
-    /* Remap the new hashtable in the old */
-    *ht = n;
-    return DICT_OK;
+static long long _dictTimeInMilliseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
 }
 
-/* Add an element to the target hash table */
-int dictAdd(dict *ht, void *key, void *val) {
-    int index;
-    dictEntry *entry;
+/* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds.
+ * Meant for the idle time of the thread owning the dict. */
+int dictRehashMilliseconds(dict *d, int ms) {
+    long long start = _dictTimeInMilliseconds();
+    int rehashes = 0;
 
-    /* Get the index of the new element, or -1 if
-     * the element already exists. */
-    if ((index = _dictKeyIndex(ht, key)) == -1)
-        return DICT_ERR;
+    if (d->iterators) return 0;
+    while(dictRehash(d,100)) {
+        rehashes += 100;
+        if (_dictTimeInMilliseconds()-start > ms) break;
+    }
+    return rehashes;
+}
 
-    /* Allocates the memory and stores key */
-    entry = malloc(sizeof(*entry));
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
+/* This function performs just a step of rehashing, and only if there are
+ * no iterators bound to our hash table. When we have iterators in the middle
+ * of a rehashing we can't mess with the two hash tables otherwise some element
+ * can be missed or duplicated.
+ *
+ * This function is called by common lookup or update operations in the
+ * dictionary so that the hash table automatically migrates from H1 to H2
+ * while it is actively used. */
+static void _dictRehashStep(dict *d) {
+    if (d->iterators == 0) dictRehash(d,DICT_REHASH_STEP);
+}
 
-    /* Set the hash entry fields. */
-    dictSetHashKey(ht, entry, key);
-    dictSetHashVal(ht, entry, val);
-    ht->used++;
-    return DICT_OK;
+/* Add an element to the target hash table */
+int dictAdd(dict *d, void *key, void *val) {
+    return dictAddGetDictEntry(d,key,val) ? DICT_OK : DICT_ERR;
 }
 
 /* Add an element, discarding the old if the key already exists.
  * Return 1 if the key was added from scratch, 0 if there was already an
  * element with such key and dictReplace() just performed a value update
  * operation. */
-int dictReplace(dict *ht, void *key, void *val) {
+int dictReplace(dict *d, void *key, void *val) {
     dictEntry *entry, auxentry;
 
     /* Try to add the element. If the key
      * does not exists dictAdd will suceed. */
-    if (dictAdd(ht, key, val) == DICT_OK)
+    if (dictAdd(d, key, val) == DICT_OK)
         return 1;
     /* It already exists, get the entry */
-    entry = dictFind(ht, key);
+    entry = dictFind(d, key);
     /* Free the old value and set the new one */
     /* Set the new value and free the old one. Note that it is important
      * to do that in this order, as the value may just be exactly the same
@@ -172,44 +235,49 @@ int dictReplace(dict *ht, void *key, void *val) {
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
     auxentry = *entry;
-    dictSetHashVal(ht, entry, val);
-    dictFreeEntryVal(ht, &auxentry);
+    dictSetHashVal(d, entry, val);
+    dictFreeEntryVal(d, &auxentry);
     return 0;
 }
 
 /* Search and remove an element */
-int dictDelete(dict *ht, const void *key) {
-    unsigned int h;
+int dictDelete(dict *d, const void *key) {
+    unsigned int h, idx;
     dictEntry *de, *prevde;
-
-    if (ht->size == 0)
-        return DICT_ERR;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    de = ht->table[h];
-
-    prevde = NULL;
-    while(de) {
-        if (dictCompareHashKeys(ht,key,de->key)) {
-            /* Unlink the element from the list */
-            if (prevde)
-                prevde->next = de->next;
-            else
-                ht->table[h] = de->next;
-
-            dictFreeEntryKey(ht,de);
-            dictFreeEntryVal(ht,de);
-            free(de);
-            ht->used--;
-            return DICT_OK;
+    int table;
+
+    if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
+
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        de = d->ht[table].table[idx];
+        prevde = NULL;
+        while(de) {
+            if (dictCompareHashKeys(d,key,de->key)) {
+                /* Unlink the element from the list */
+                if (prevde)
+                    prevde->next = de->next;
+                else
+                    d->ht[table].table[idx] = de->next;
+
+                dictFreeEntryKey(d,de);
+                dictFreeEntryVal(d,de);
+                free(de);
+                d->ht[table].used--;
+                return DICT_OK;
+            }
+            prevde = de;
+            de = de->next;
         }
-        prevde = de;
-        de = de->next;
+        if (!dictIsRehashing(d)) break;
     }
     return DICT_ERR; /* not found */
 }
 
 /* Destroy an entire hash table */
-int _dictClear(dict *ht) {
+static int _dictClear(dict *d, dictht *ht) {
     unsigned long i;
 
     /* Free all the elements */
@@ -219,8 +287,8 @@ int _dictClear(dict *ht) {
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
             nextHe = he->next;
-            dictFreeEntryKey(ht, he);
-            dictFreeEntryVal(ht, he);
+            dictFreeEntryKey(d, he);
+            dictFreeEntryVal(d, he);
             free(he);
             ht->used--;
             he = nextHe;
@@ -233,23 +301,39 @@ int _dictClear(dict *ht) {
     return DICT_OK; /* never fails */
 }
 
+/* Remove all the elements, the dict stays usable: an empty dict holds no
+ * allocation but itself */
+void dictEmpty(dict *d) {
+    _dictClear(d,&d->ht[0]);
+    _dictClear(d,&d->ht[1]);
+    d->rehashidx = -1;
+    d->iterators = 0;
+}
+
 /* Clear & Release the hash table */
-void dictRelease(dict *ht) {
-    _dictClear(ht);
-    free(ht);
+void dictRelease(dict *d) {
+    _dictClear(d,&d->ht[0]);
+    _dictClear(d,&d->ht[1]);
+    free(d);
 }
 
-dictEntry *dictFind(dict *ht, const void *key) {
+dictEntry *dictFind(dict *d, const void *key) {
     dictEntry *he;
-    unsigned int h;
-
-    if (ht->size == 0) return NULL;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return he;
-        he = he->next;
+    unsigned int h, idx;
+    int table;
+
+    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        he = d->ht[table].table[idx];
+        while(he) {
+            if (dictCompareHashKeys(d, key, he->key))
+                return he;
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) return NULL;
     }
     return NULL;
 }
@@ -263,10 +347,11 @@ void *dictFetchValue(dict *d, const void *key) {
 }
 
 
-dictIterator *dictGetIterator(dict *ht) {
+dictIterator *dictGetIterator(dict *d) {
     dictIterator *iter = malloc(sizeof(*iter));
 
-    iter->ht = ht;
+    iter->d = d;
+    iter->table = 0;
     iter->index = -1;
     iter->entry = NULL;
     iter->nextEntry = NULL;
@@ -276,10 +361,20 @@ dictIterator *dictGetIterator(dict *ht) {
 dictEntry *dictNext(dictIterator *iter) {
     while (1) {
         if (iter->entry == NULL) {
+            dictht *ht = &iter->d->ht[iter->table];
+            if (iter->index == -1 && iter->table == 0)
+                iter->d->iterators++;
             iter->index++;
-            if (iter->index >=
-                    (signed)iter->ht->size) break;
-            iter->entry = iter->ht->table[iter->index];
+            if (iter->index >= (signed) ht->size) {
+                if (dictIsRehashing(iter->d) && iter->table == 0) {
+                    iter->table++;
+                    iter->index = 0;
+                    ht = &iter->d->ht[1];
+                } else {
+                    break;
+                }
+            }
+            iter->entry = ht->table[iter->index];
         } else {
             iter->entry = iter->nextEntry;
         }
@@ -294,19 +389,24 @@ dictEntry *dictNext(dictIterator *iter) {
 }
 
 void dictReleaseIterator(dictIterator *iter) {
+    if (!(iter->index == -1 && iter->table == 0))
+        iter->d->iterators--;
     free(iter);
 }
 
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
-static int _dictExpandIfNeeded(dict *ht) {
-    /* If the hash table is empty expand it to the intial size,
-     * if the table is "full" dobule its size. */
-    if (ht->size == 0)
-        return dictExpand(ht, DICT_HT_INITIAL_SIZE);
-    if (ht->used == ht->size)
-        return dictExpand(ht, ht->size*2);
+static int _dictExpandIfNeeded(dict *d) {
+    /* Incremental rehashing already in progress. Return. */
+    if (dictIsRehashing(d)) return DICT_OK;
+
+    /* If the hash table is empty expand it to the intial size. */
+    if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+
+    /* If we reached the 1:1 ratio, we double the number of buckets */
+    if (d->ht[0].used >= d->ht[0].size)
+        return dictExpand(d, d->ht[0].used*2);
     return DICT_OK;
 }
 
@@ -324,44 +424,58 @@ static unsigned long _dictNextPower(unsigned long size) {
 
 /* Returns the index of a free slot that can be populated with
  * an hash entry for the given 'key'.
- * If the key already exists, -1 is returned. */
-static int _dictKeyIndex(dict *ht, const void *key) {
-    unsigned int h;
+ * If the key already exists, -1 is returned.
+ *
+ * Note that if we are in the process of rehashing the hash table, the
+ * index is always returned in the context of the second (new) hash table. */
+static int _dictKeyIndex(dict *d, const void *key) {
+    unsigned int h, idx = 0;
     dictEntry *he;
+    int table;
 
     /* Expand the hashtable if needed */
-    if (_dictExpandIfNeeded(ht) == DICT_ERR)
+    if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
     /* Compute the key hash value */
-    h = dictHashKey(ht, key) & ht->sizemask;
-    /* Search if this slot does not already contain the given key */
-    he = ht->table[h];
-    while(he) {
-        if (dictCompareHashKeys(ht, key, he->key))
-            return -1;
-        he = he->next;
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        /* Search if this slot does not already contain the given key */
+        he = d->ht[table].table[idx];
+        while(he) {
+            if (dictCompareHashKeys(d, key, he->key))
+                return -1;
+            he = he->next;
+        }
+        if (!dictIsRehashing(d)) break;
     }
-    return h;
+    return idx;
 }
 
-/* Add an element to the target hash table */
-dictEntry *dictAddGetDictEntry(dict *ht, void *key, void *val) {
+/* Add an element to the target hash table, return the new entry or NULL if
+ * the key already exists */
+dictEntry *dictAddGetDictEntry(dict *d, void *key, void *val) {
     int index;
     dictEntry *entry;
+    dictht *ht;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(ht, key)) == -1)
+    if ((index = _dictKeyIndex(d, key)) == -1)
         return NULL;
 
-    /* Allocates the memory and stores key */
+    /* Allocates the memory and stores key.
+     * While rehashing, new entries only go to the new table. */
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
     entry = malloc(sizeof(*entry));
     entry->next = ht->table[index];
     ht->table[index] = entry;
+    ht->used++;
 
     /* Set the hash entry fields. */
-    dictSetHashKey(ht, entry, key);
-    dictSetHashVal(ht, entry, val);
-    ht->used++;
+    dictSetHashKey(d, entry, key);
+    dictSetHashVal(d, entry, val);
     return entry;
 }
@@ -57,24 +57,38 @@ typedef struct dictType {
     void (*valDestructor)(void *privdata, void *obj);
 } dictType;
 
-typedef struct dict {
+/* This is our hash table structure. Every dictionary has two of this as we
+ * implement incremental rehashing, for the old to the new table. */
+typedef struct dictht {
     dictEntry **table;
-    dictType *type;
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
+} dictht;
+
+typedef struct dict {
+    dictType *type;
     void *privdata;
+    dictht ht[2];
+    long rehashidx; /* rehashing not in progress if rehashidx == -1 */
+    int iterators; /* number of iterators currently running */
 } dict;
 
+/* Rehashing is paused while an iterator is running, so the entries can
+ * not move under it. Entries may still be deleted while iterating. */
 typedef struct dictIterator {
-    dict *ht;
-    int index;
+    dict *d;
+    int table;
+    long index;
     dictEntry *entry, *nextEntry;
 } dictIterator;
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Buckets moved to the new table by each add/find/delete while rehashing */
+#define DICT_REHASH_STEP 1
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeEntryVal(ht, entry) \
     if ((ht)->type->valDestructor) \
@@ -107,22 +121,30 @@ typedef struct dictIterator {
 
 #define dictGetEntryKey(he) ((he)->key)
 #define dictGetEntryVal(he) ((he)->val)
-#define dictSlots(ht) ((ht)->size)
-#define dictSize(ht) ((ht)->used)
+#define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
+#define dictIsRehashing(d) ((d)->rehashidx != -1)
+/* Buckets of the old table already moved, out of dictRehashTotal() */
+#define dictRehashDone(d) (dictIsRehashing(d) ? (unsigned long)(d)->rehashidx : 0)
+#define dictRehashTotal(d) (dictIsRehashing(d) ? (d)->ht[0].size : 0)
 
 /* API */
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
 dict *dictCreate(dictType *type, void *privDataPtr);
-int dictExpand(dict *ht, unsigned long size);
-int dictAdd(dict *ht, void *key, void *val);
-int dictReplace(dict *ht, void *key, void *val);
-int dictDelete(dict *ht, const void *key);
-void dictRelease(dict *ht);
-dictEntry * dictFind(dict *ht, const void *key);
+int dictExpand(dict *d, unsigned long size);
+int dictResize(dict *d);
+int dictRehash(dict *d, int n);
+int dictRehashMilliseconds(dict *d, int ms);
+int dictAdd(dict *d, void *key, void *val);
+int dictReplace(dict *d, void *key, void *val);
+int dictDelete(dict *d, const void *key);
+void dictRelease(dict *d);
+void dictEmpty(dict *d);
+dictEntry * dictFind(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
-dictIterator *dictGetIterator(dict *ht);
+dictIterator *dictGetIterator(dict *d);
 dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
-dictEntry *dictAddGetDictEntry(dict *ht, void *key, void *val);
+dictEntry *dictAddGetDictEntry(dict *d, void *key, void *val);
 
 #endif /* __DICT_H */
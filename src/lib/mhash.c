@@ -47,9 +47,10 @@ char *mhashFunction(const unsigned char *buf, int len) {
     while (len--)
         hash = ((hash << 5) ^ hash) ^ (*buf++); /* hash * 33 + c */
     unsigned char *vhash = (unsigned char *)&hash;
-    char *result = (char*)malloc(_TMHASH_BYTE_SIZE+3);
+    /* two hex digits per byte, two '/' and the terminator */
+    char *result = (char*)malloc(2*_TMHASH_BYTE_SIZE+3);
     char *ptr = result;
-    ptr[_TMHASH_BYTE_SIZE] = '\0';
+    ptr[2*_TMHASH_BYTE_SIZE+2] = '\0';
 #if (_TMHASH == uint32_t)
     /* first byte */
     *ptr++ = bin2hex[*vhash >> 4];
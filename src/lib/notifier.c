@@ -0,0 +1,86 @@
+/* notifier.c - cross-thread wakeup through eventfd
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include "notifier.h"
+
+notifier *notifierCreate(void) {
+    notifier *n = malloc(sizeof(*n));
+    if(n == NULL) return NULL;
+    n->fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if(n->fd < 0) {
+        free(n);
+        return NULL;
+    }
+    n->pending = 0;
+    return n;
+}
+
+void notifierRelease(notifier *n) {
+    if(n) {
+        close(n->fd);
+        free(n);
+    }
+}
+
+/* Called by the producer after it has pushed a message.
+ * Only write() is used, so it is also safe inside a signal handler. */
+void notifierSignal(notifier *n) {
+    uint64_t one = 1;
+    if(__sync_bool_compare_and_swap(&n->pending,0,1)) {
+        if(write(n->fd,&one,sizeof(one)) != sizeof(one)) {
+            /* The counter can only overflow if nobody ever reads it,
+             * the fd is readable anyway so the consumer will wake up. */
+        }
+    }
+}
+
+/* Called by the consumer BEFORE it drains its queues: every message pushed
+ * after this point signals the eventfd again, every message pushed before
+ * is seen by the draining that follows. */
+void notifierClear(notifier *n) {
+    uint64_t count;
+    if(read(n->fd,&count,sizeof(count)) < 0) {
+        /* EAGAIN: nothing to consume */
+    }
+    n->pending = 0;
+    __sync_synchronize();
+}
+
+/* Block until the notifier is signaled or timeout (milliseconds, -1 for
+ * infinite) expires. Return 1 when signaled, 0 otherwise. */
+int notifierWait(notifier *n, int timeout) {
+    struct pollfd pfd;
+    pfd.fd = n->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd,1,timeout) > 0;
+}
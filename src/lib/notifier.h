@@ -1,4 +1,4 @@
-/* safe_queue.h
+/* notifier.h - cross-thread wakeup through eventfd
  *
  * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
  * All rights reserved.
@@ -25,29 +25,27 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef SAFE_LIST_H
-#define SAFE_LIST_H
-#include "malloc.h"
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
 
-#define SAFE_QUEUE_OK 1
-#define SAFE_QUEUE_ERR 0
+#define NOTIFIER_OK 0
+#define NOTIFIER_ERR -1
 
-typedef struct safeQueueEntry_t {
-    void *value;
-    struct safeQueueEntry_t *next;
-} safeQueueEntry;
+/* A notifier wakes up a thread sleeping in poll/epoll_wait when another
+ * thread (or a signal handler) has put something for it in a queue.
+ * Signals are coalesced: only the first signal after a notifierClear()
+ * costs a write() on the eventfd, the following ones are plain memory ops. */
+typedef struct notifier {
+    int fd;
+    volatile int pending;
+} notifier;
 
-typedef struct {
-    safeQueueEntry *head;
-    safeQueueEntry *tail;
-    int lastNodeRetrieved;
-    void (*free)(void *ptr);
-} safeQueue;
+#define notifierFd(n) ((n)->fd)
 
+notifier *notifierCreate(void);
+void notifierRelease(notifier *n);
+void notifierSignal(notifier *n);
+void notifierClear(notifier *n);
+int notifierWait(notifier *n, int timeout);
 
-safeQueue *safeQueueCreate();
-void safeQueueRelease(safeQueue **q_in);
-int safeQueuePush(safeQueue *ll, void *value);
-void * safeQueuePop(safeQueue *ll);
-
-#endif // SAFE_LIST_H
+#endif // NOTIFIER_H
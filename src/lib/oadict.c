@@ -0,0 +1,526 @@
+/* oadict.c - open addressing hash table with SIMD group probing
+ *
+ * Control bytes and probing follow the SwissTable design: each slot has a
+ * control byte holding 7 bits of the hash, and lookups scan a group of 16
+ * control bytes at once. Groups are probed with a triangular sequence, a
+ * lookup stops at the first group having an empty slot.
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "oadict.h"
+
+#define GW OADICT_GROUP_WIDTH
+
+/* Position of the first group to probe, and tag stored in the control byte */
+#define H1(h) ((h) >> 7)
+#define H2(h) ((signed char)((h) & 0x7f))
+
+/* ------------------------------ group matching ---------------------------- */
+
+#ifdef __SSE2__
+/* Bit i of the result is set when control byte i of the group equals tag */
+static inline unsigned int _groupMatch(const signed char *ctrl, signed char tag) {
+    __m128i g = _mm_load_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g,_mm_set1_epi8(tag)));
+}
+
+/* Bit i of the result is set when slot i is empty or deleted */
+static inline unsigned int _groupMatchFree(const signed char *ctrl) {
+    __m128i g = _mm_load_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1),g));
+}
+#else
+static inline unsigned int _groupMatch(const signed char *ctrl, signed char tag) {
+    unsigned int m = 0;
+    int i;
+    for (i = 0; i < GW; i++)
+        if (ctrl[i] == tag) m |= 1u << i;
+    return m;
+}
+
+static inline unsigned int _groupMatchFree(const signed char *ctrl) {
+    unsigned int m = 0;
+    int i;
+    for (i = 0; i < GW; i++)
+        if (ctrl[i] < -1) m |= 1u << i;
+    return m;
+}
+#endif
+
+#define _groupMatchEmpty(ctrl) _groupMatch((ctrl),OADICT_CTRL_EMPTY)
+#define _groupOf(pos) ((pos) & ~(unsigned long)(GW-1))
+
+/* --------------------------------- tables --------------------------------- */
+
+/* dictType hash functions may be weak in the high bits (djb), mix them */
+static unsigned int _oadictHash(oadict *d, const void *key) {
+    unsigned int h = dictHashKey(d,key);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static void _oadictTableReset(oadictTable *t) {
+    t->ctrl = NULL;
+    t->slots = NULL;
+    t->size = 0;
+    t->groupmask = 0;
+    t->used = 0;
+    t->growth_left = 0;
+}
+
+static int _oadictTableInit(oadictTable *t, unsigned long size) {
+    void *ctrl;
+    if (posix_memalign(&ctrl,GW,size) != 0) return OADICT_ERR;
+    t->slots = malloc(sizeof(oadictSlot)*size);
+    if (t->slots == NULL) {
+        free(ctrl);
+        return OADICT_ERR;
+    }
+    t->ctrl = ctrl;
+    memset(t->ctrl,OADICT_CTRL_EMPTY,size);
+    t->size = size;
+    t->groupmask = size/GW-1;
+    t->used = 0;
+    t->growth_left = size-size/8;
+    return OADICT_OK;
+}
+
+/* Return the position of the key in t, or -1 */
+static long _oadictFindIn(oadict *d, oadictTable *t, const void *key, unsigned int h) {
+    unsigned long g, step = 0;
+    unsigned int m;
+    signed char *ctrl;
+
+    if (t->size == 0) return -1;
+    g = H1(h) & t->groupmask;
+    while(1) {
+        ctrl = t->ctrl+g*GW;
+        m = _groupMatch(ctrl,H2(h));
+        while(m) {
+            unsigned long pos = g*GW+__builtin_ctz(m);
+            if (dictCompareHashKeys(d,key,t->slots[pos].key))
+                return pos;
+            m &= m-1;
+        }
+        if (_groupMatchEmpty(ctrl)) return -1;
+        g = (g+(++step)) & t->groupmask;
+    }
+}
+
+/* Return the position of the key and set *table, or -1 */
+static long _oadictLookup(oadict *d, const void *key, unsigned int h, int *table) {
+    long pos;
+    if ((pos = _oadictFindIn(d,&d->t[0],key,h)) != -1) {
+        *table = 0;
+        return pos;
+    }
+    if (oadictIsRehashing(d) && (pos = _oadictFindIn(d,&d->t[1],key,h)) != -1) {
+        *table = 1;
+        return pos;
+    }
+    return -1;
+}
+
+/* Insert a key known to be absent. The table must have growth left. */
+static unsigned long _oadictInsertIn(oadictTable *t, unsigned int h, void *key, void *val) {
+    unsigned long g = H1(h) & t->groupmask, step = 0, pos;
+    unsigned int m;
+    while((m = _groupMatchFree(t->ctrl+g*GW)) == 0)
+        g = (g+(++step)) & t->groupmask;
+    pos = g*GW+__builtin_ctz(m);
+    if (t->ctrl[pos] == OADICT_CTRL_EMPTY) t->growth_left--;
+    t->ctrl[pos] = H2(h);
+    t->slots[pos].key = key;
+    t->slots[pos].val = val;
+    t->used++;
+    return pos;
+}
+
+/* When the group still has an empty slot, no probe sequence went past it:
+ * the slot can be empty again. Otherwise it becomes a tombstone. */
+static void _oadictEraseAt(oadictTable *t, unsigned long pos) {
+    if (_groupMatchEmpty(t->ctrl+_groupOf(pos))) {
+        t->ctrl[pos] = OADICT_CTRL_EMPTY;
+        t->growth_left++;
+    } else {
+        t->ctrl[pos] = OADICT_CTRL_DELETED;
+    }
+    t->used--;
+}
+
+static void _oadictTableClear(oadict *d, oadictTable *t) {
+    unsigned long i;
+    for (i = 0; i < t->size && t->used > 0; i++) {
+        if (t->ctrl[i] < 0) continue;
+        dictFreeEntryKey(d,&t->slots[i]);
+        dictFreeEntryVal(d,&t->slots[i]);
+        t->used--;
+    }
+    free(t->ctrl);
+    free(t->slots);
+    _oadictTableReset(t);
+}
+
+/* ----------------------------- API implementation ------------------------- */
+
+oadict *oadictCreate(dictType *type, void *privDataPtr) {
+    oadict *d = malloc(sizeof(*d));
+    d->type = type;
+    d->privdata = privDataPtr;
+    _oadictTableReset(&d->t[0]);
+    _oadictTableReset(&d->t[1]);
+    d->rehashidx = -1;
+    d->iterators = 0;
+    return d;
+}
+
+void oadictRelease(oadict *d) {
+    _oadictTableClear(d,&d->t[0]);
+    _oadictTableClear(d,&d->t[1]);
+    free(d);
+}
+
+/* Create the table, or allocate a new one able to hold size keys and start
+ * moving the keys into it */
+int oadictExpand(oadict *d, unsigned long size) {
+    oadictTable n;
+    unsigned long realsize = OADICT_INITIAL_SIZE;
+
+    if (oadictIsRehashing(d)) return OADICT_ERR;
+    while (realsize-realsize/8 <= size || realsize-realsize/8 <= d->t[0].used)
+        realsize *= 2;
+    if (_oadictTableInit(&n,realsize) == OADICT_ERR) return OADICT_ERR;
+    if (d->t[0].ctrl == NULL) {
+        d->t[0] = n;
+        return OADICT_OK;
+    }
+    d->t[1] = n;
+    d->rehashidx = 0;
+    return OADICT_OK;
+}
+
+/* Move n groups of the old table into the new one. Return 1 if there are
+ * still keys to move, 0 otherwise. Moved slots become tombstones, so the
+ * lookups still probing the old table see the same sequences. */
+int oadictRehash(oadict *d, int n) {
+    oadictTable *t0 = &d->t[0], *t1 = &d->t[1];
+    if (!oadictIsRehashing(d)) return 0;
+    while(n--) {
+        unsigned long base, i;
+        if (t0->used == 0 || (unsigned long)d->rehashidx > t0->groupmask) {
+            free(t0->ctrl);
+            free(t0->slots);
+            *t0 = *t1;
+            _oadictTableReset(t1);
+            d->rehashidx = -1;
+            return 0;
+        }
+        base = d->rehashidx*GW;
+        for (i = base; i < base+GW; i++) {
+            if (t0->ctrl[i] < 0) continue;
+            _oadictInsertIn(t1,_oadictHash(d,t0->slots[i].key),
+                            t0->slots[i].key,t0->slots[i].val);
+            t0->ctrl[i] = OADICT_CTRL_DELETED;
+            t0->used--;
+        }
+        d->rehashidx++;
+    }
+    return 1;
+}
+
+static long long _oadictTimeInMilliseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
+}
+
+/* Rehash for an amount of time between ms milliseconds and ms+1 milliseconds */
+int oadictRehashMilliseconds(oadict *d, int ms) {
+    long long start = _oadictTimeInMilliseconds();
+    int rehashes = 0;
+
+    if (d->iterators) return 0;
+    while(oadictRehash(d,100)) {
+        rehashes += 100;
+        if (_oadictTimeInMilliseconds()-start > ms) break;
+    }
+    return rehashes;
+}
+
+static void _oadictRehashStep(oadict *d) {
+    if (d->iterators == 0) oadictRehash(d,OADICT_REHASH_STEP);
+}
+
+/* Make sure the next insertion has room */
+static int _oadictExpandIfNeeded(oadict *d) {
+    if (oadictIsRehashing(d)) {
+        if (d->t[1].growth_left) return OADICT_OK;
+        /* The new table filled up before the end of the rehashing */
+        while(oadictRehash(d,100));
+    }
+    if (d->t[0].size == 0) return oadictExpand(d,0);
+    if (d->t[0].growth_left) return OADICT_OK;
+    /* Full of tombstones rather than keys: same size is enough */
+    if (d->t[0].used <= d->t[0].size*7/16)
+        return oadictExpand(d,d->t[0].used);
+    return oadictExpand(d,d->t[0].size);
+}
+
+int oadictAdd(oadict *d, void *key, void *val) {
+    unsigned int h;
+    oadictTable *t;
+    oadictSlot *slot;
+    unsigned long pos;
+    int table;
+
+    if (oadictIsRehashing(d)) _oadictRehashStep(d);
+    h = _oadictHash(d,key);
+    if (_oadictLookup(d,key,h,&table) != -1) return OADICT_ERR;
+    if (_oadictExpandIfNeeded(d) == OADICT_ERR) return OADICT_ERR;
+    /* While rehashing, new keys only go to the new table */
+    t = oadictIsRehashing(d) ? &d->t[1] : &d->t[0];
+    pos = _oadictInsertIn(t,h,NULL,NULL);
+    slot = &t->slots[pos];
+    dictSetHashKey(d,slot,key);
+    dictSetHashVal(d,slot,val);
+    return OADICT_OK;
+}
+
+/* Add an element, discarding the old if the key already exists.
+ * Return 1 if the key was added from scratch, 0 on update. As for dict, the
+ * new value is set before the old one is freed. */
+int oadictReplace(oadict *d, void *key, void *val) {
+    oadictSlot *slot, aux;
+    long pos;
+    int table;
+
+    if (oadictAdd(d,key,val) == OADICT_OK) return 1;
+    pos = _oadictLookup(d,key,_oadictHash(d,key),&table);
+    slot = &d->t[table].slots[pos];
+    aux = *slot;
+    dictSetHashVal(d,slot,val);
+    dictFreeEntryVal(d,&aux);
+    return 0;
+}
+
+int oadictDelete(oadict *d, const void *key) {
+    oadictTable *t;
+    long pos;
+    int table;
+
+    if (oadictSize(d) == 0) return OADICT_ERR;
+    if (oadictIsRehashing(d)) _oadictRehashStep(d);
+    if ((pos = _oadictLookup(d,key,_oadictHash(d,key),&table)) == -1)
+        return OADICT_ERR;
+    t = &d->t[table];
+    dictFreeEntryKey(d,&t->slots[pos]);
+    dictFreeEntryVal(d,&t->slots[pos]);
+    _oadictEraseAt(t,pos);
+    return OADICT_OK;
+}
+
+void *oadictFetchValue(oadict *d, const void *key) {
+    long pos;
+    int table;
+
+    if (oadictSize(d) == 0) return NULL;
+    if (oadictIsRehashing(d)) _oadictRehashStep(d);
+    if ((pos = _oadictLookup(d,key,_oadictHash(d,key),&table)) == -1)
+        return NULL;
+    return d->t[table].slots[pos].val;
+}
+
+/* Bytes allocated for the dict and its tables, keys and values excluded */
+size_t oadictMemory(oadict *d) {
+    size_t mem = malloc_usable_size(d);
+    int i;
+    for (i = 0; i <= 1; i++) {
+        if (d->t[i].ctrl == NULL) continue;
+        mem += malloc_usable_size(d->t[i].ctrl)+malloc_usable_size(d->t[i].slots);
+    }
+    return mem;
+}
+
+/* Rehashing is paused while an iterator is running. The slot returned may
+ * be deleted before calling oadictNext() again. */
+oadictIterator *oadictGetIterator(oadict *d) {
+    oadictIterator *iter = malloc(sizeof(*iter));
+
+    iter->d = d;
+    iter->table = 0;
+    iter->index = -1;
+    d->iterators++;
+    return iter;
+}
+
+oadictSlot *oadictNext(oadictIterator *iter) {
+    oadictTable *t;
+    while(iter->table <= 1) {
+        t = &iter->d->t[iter->table];
+        while(++iter->index < (long)t->size) {
+            if (t->ctrl[iter->index] >= 0)
+                return &t->slots[iter->index];
+        }
+        iter->table++;
+        iter->index = -1;
+    }
+    return NULL;
+}
+
+void oadictReleaseIterator(oadictIterator *iter) {
+    iter->d->iterators--;
+    free(iter);
+}
+
+#ifdef OADICT_BENCHMARK_MAIN
+/* gcc -O2 -DOADICT_BENCHMARK_MAIN -Isrc src/lib/oadict.c src/lib/dict.c -o oadict-bench
+ *
+ * Compare with the chained dict on integer keys: insertion, lookups of
+ * present and absent keys in random order, then deletion. */
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_STRIDE 2654435761UL
+
+/* A real mixer: a bijective hash of sequential keys would spare dict any
+ * chaining, which string keys never do */
+static unsigned int benchHash(const void *key) {
+    unsigned long k = (unsigned long)key;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdUL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53UL;
+    k ^= k >> 33;
+    return (unsigned int)k;
+}
+
+static dictType benchType = {
+    benchHash,  /* hash function */
+    NULL,       /* key dup */
+    NULL,       /* val dup */
+    NULL,       /* key compare */
+    NULL,       /* key destructor */
+    NULL        /* val destructor */
+};
+
+static double benchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static long benchRss(void) {
+    long pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm","r");
+    if (fp) {
+        if (fscanf(fp,"%ld %ld",&pages,&rss) != 2) rss = 0;
+        fclose(fp);
+    }
+    return rss*4096;
+}
+
+/* Visit 1..n in a scrambled order, BENCH_STRIDE is prime */
+#define BENCH_KEY(i,n) ((void*)((((i)*BENCH_STRIDE)%(n))+1))
+
+static void benchReport(const char *name, const char *op, unsigned long n, double t) {
+    printf("%-7s %-12s %8.2f Mops/s\n",name,op,n/t/1e6);
+}
+
+static void benchDict(unsigned long n) {
+    dict *d = dictCreate(&benchType,NULL);
+    unsigned long i, found = 0;
+    long rss = benchRss();
+    double t;
+
+    t = benchNow();
+    for (i = 0; i < n; i++) dictAdd(d,(void*)(i+1),(void*)i);
+    benchReport("dict","insert",n,benchNow()-t);
+    printf("dict    memory       %8.1f bytes/key\n",(double)(benchRss()-rss)/n);
+    t = benchNow();
+    for (i = 0; i < n; i++) found += dictFind(d,BENCH_KEY(i,n)) != NULL;
+    benchReport("dict","lookup hit",n,benchNow()-t);
+    t = benchNow();
+    for (i = 0; i < n; i++) found += dictFind(d,(void*)(n+1+i)) != NULL;
+    benchReport("dict","lookup miss",n,benchNow()-t);
+    t = benchNow();
+    for (i = 0; i < n; i++) dictDelete(d,BENCH_KEY(i,n));
+    benchReport("dict","delete",n,benchNow()-t);
+    if (found != n) printf("dict: %lu keys found, expected %lu\n",found,n);
+    dictRelease(d);
+}
+
+static void benchOadict(unsigned long n) {
+    oadict *d = oadictCreate(&benchType,NULL);
+    unsigned long i, found = 0;
+    long rss = benchRss();
+    double t;
+
+    t = benchNow();
+    for (i = 0; i < n; i++) oadictAdd(d,(void*)(i+1),(void*)i);
+    benchReport("oadict","insert",n,benchNow()-t);
+    printf("oadict  memory       %8.1f bytes/key\n",(double)(benchRss()-rss)/n);
+    t = benchNow();
+    for (i = 0; i < n; i++)
+        found += oadictFetchValue(d,BENCH_KEY(i,n)) == (char*)BENCH_KEY(i,n)-1;
+    benchReport("oadict","lookup hit",n,benchNow()-t);
+    t = benchNow();
+    for (i = 0; i < n; i++) found += oadictFetchValue(d,(void*)(n+1+i)) != NULL;
+    benchReport("oadict","lookup miss",n,benchNow()-t);
+    t = benchNow();
+    for (i = 0; i < n; i++) oadictDelete(d,BENCH_KEY(i,n));
+    benchReport("oadict","delete",n,benchNow()-t);
+    if (found != n || oadictSize(d) != 0)
+        printf("oadict: %lu keys found, %lu left, expected %lu and 0\n",
+               found,oadictSize(d),n);
+    oadictRelease(d);
+}
+
+int main(int argc, char **argv) {
+    unsigned long sizes[] = {1000000UL, 10000000UL};
+    unsigned int i;
+    (void)argc;
+    (void)argv;
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        printf("== %lu keys\n",sizes[i]);
+        benchDict(sizes[i]);
+        benchOadict(sizes[i]);
+    }
+    return 0;
+}
+#endif
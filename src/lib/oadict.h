@@ -0,0 +1,107 @@
+/* oadict.h - open addressing hash table with SIMD group probing
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OADICT_H
+#define OADICT_H
+
+#include "dict.h"
+
+#define OADICT_OK DICT_OK
+#define OADICT_ERR DICT_ERR
+
+/* Slots are probed by groups: the control bytes of a group are compared to
+ * the 7-bit tag of the hash at once (one SSE2 compare), only the slots whose
+ * tag matches are compared with the key. */
+#define OADICT_GROUP_WIDTH 16
+#define OADICT_INITIAL_SIZE OADICT_GROUP_WIDTH
+
+/* Control byte of a slot: the tag (0..127) of the hash when the slot is
+ * full, or one of the following values. */
+#define OADICT_CTRL_EMPTY ((signed char)-128)
+#define OADICT_CTRL_DELETED ((signed char)-2)
+
+/* Keys and values are stored inline, there is no allocation per entry.
+ * A slot may move when the table is modified: don't keep pointers to it. */
+typedef struct oadictSlot {
+    void *key;
+    void *val;
+} oadictSlot;
+
+typedef struct oadictTable {
+    signed char *ctrl;        /* size control bytes, 16-byte aligned */
+    oadictSlot *slots;
+    unsigned long size;       /* a power of two, at least one group */
+    unsigned long groupmask;  /* number of groups - 1 */
+    unsigned long used;
+    unsigned long growth_left; /* insertions into empty slots before the
+                                * load factor reaches 7/8 */
+} oadictTable;
+
+/* Like dict, an oadict grows with incremental rehashing: when a table is
+ * full a bigger one is allocated, and each operation moves a few groups of
+ * the old table into the new one. */
+typedef struct oadict {
+    dictType *type;
+    void *privdata;
+    oadictTable t[2];
+    long rehashidx; /* next group of t[0] to move, -1 when not rehashing */
+    int iterators;  /* number of iterators currently running */
+} oadict;
+
+typedef struct oadictIterator {
+    oadict *d;
+    int table;
+    long index;
+} oadictIterator;
+
+/* Groups moved to the new table by each add/find/delete while rehashing */
+#define OADICT_REHASH_STEP 1
+
+#define oadictSize(d) ((d)->t[0].used+(d)->t[1].used)
+#define oadictSlots(d) ((d)->t[0].size+(d)->t[1].size)
+#define oadictIsRehashing(d) ((d)->rehashidx != -1)
+/* Groups of the old table already moved, out of oadictRehashTotal() */
+#define oadictRehashDone(d) (oadictIsRehashing(d) ? (unsigned long)(d)->rehashidx : 0)
+#define oadictRehashTotal(d) (oadictIsRehashing(d) ? (d)->t[0].groupmask+1 : 0)
+#define oadictSlotKey(s) ((s)->key)
+#define oadictSlotVal(s) ((s)->val)
+
+oadict *oadictCreate(dictType *type, void *privDataPtr);
+void oadictRelease(oadict *d);
+int oadictExpand(oadict *d, unsigned long size);
+int oadictRehash(oadict *d, int n);
+int oadictRehashMilliseconds(oadict *d, int ms);
+int oadictAdd(oadict *d, void *key, void *val);
+int oadictReplace(oadict *d, void *key, void *val);
+int oadictDelete(oadict *d, const void *key);
+void *oadictFetchValue(oadict *d, const void *key);
+size_t oadictMemory(oadict *d);
+oadictIterator *oadictGetIterator(oadict *d);
+oadictSlot *oadictNext(oadictIterator *iter);
+void oadictReleaseIterator(oadictIterator *iter);
+
+#endif // OADICT_H
@@ -2,20 +2,36 @@
  */
 
 #include "objSds.h"
+#include "rcu.h"
+#include "slab.h"
+#include "ufile.h"
 
 objSds *objSdsCreate(){
     objSds *obj = malloc((sizeof(*obj)));
     obj->state = OBJSDS_WAITING;
     obj->ptr = NULL;
+    obj->header = NULL;
+    obj->fd = -1;
+    obj->fsize = 0;
+    obj->status = 200;
+    obj->mtime = 0;
     obj->ref = 1;
+    obj->hits = 0;
     obj->waiting_entries = listCreate();
     return obj;
 }
 
-objSds *objSdsFromSds(sds ptr){
+objSds *objSdsFromSds(sds header, sds ptr){
     objSds *obj = malloc((sizeof(*obj)));
+    obj->state = OBJSDS_WAITING;
     obj->ptr = ptr;
+    obj->header = header;
+    obj->fd = -1;
+    obj->fsize = 0;
+    obj->status = 200;
+    obj->mtime = 0;
     obj->ref = 1;
+    obj->hits = 0;
     obj->waiting_entries = listCreate();
     return obj;
 }
@@ -25,15 +41,56 @@ void objSdsAddWaitingEntry(objSds *obj, void* entry){
 }
 
 void objSdsAddRef(objSds *obj){
-    obj->ref++;
+    __atomic_add_fetch(&obj->ref,1,__ATOMIC_RELAXED);
 }
 
-void objSdsSubRef(objSds *obj){
-    assert(obj->ref);
-    obj->ref--;
-    if(obj->ref == 0) {
-        sdsfree(obj->ptr);
-        listRelease(obj->waiting_entries);
-        free(obj);
+/* Take a reference on an object found in the shared index.
+ * Fail if the last reference has already been dropped. */
+int objSdsTryAddRef(objSds *obj){
+    int ref = __atomic_load_n(&obj->ref,__ATOMIC_RELAXED);
+    while(ref > 0) {
+        if(__atomic_compare_exchange_n(&obj->ref,&ref,ref+1,1,
+                                       __ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+            return 1;
     }
+    return 0;
+}
+
+static void _objSdsFree(void *ptr){
+    objSds *obj = ptr;
+    slabSdsFree(obj->ptr);
+    sdsfree(obj->header);
+    if(obj->fd != -1) ufileCloseBody(obj->fd);
+    listRelease(obj->waiting_entries);
+    free(obj);
+}
+
+void objSdsSubRef(objSds *obj){
+    int ref = __atomic_sub_fetch(&obj->ref,1,__ATOMIC_ACQ_REL);
+    assert(ref >= 0);
+    if(ref == 0) rcuDefer(_objSdsFree,obj);
+}
+
+/* OBJSDS_OK is stored after ptr, readers load it before ptr */
+void objSdsSetState(objSds *obj, int state){
+    __atomic_store_n(&obj->state,state,__ATOMIC_RELEASE);
+}
+
+int objSdsGetState(objSds *obj){
+    return __atomic_load_n(&obj->state,__ATOMIC_ACQUIRE);
+}
+
+/* Count a hit. Saturated counters are not written again, so the line of a
+ * hot object stays shared between the workers. Concurrent hits may be
+ * counted once. */
+void objSdsTouch(objSds *obj){
+    unsigned char hits = __atomic_load_n(&obj->hits,__ATOMIC_RELAXED);
+    if(hits < OBJSDS_MAX_HITS)
+        __atomic_store_n(&obj->hits,hits+1,__ATOMIC_RELAXED);
+}
+
+/* Return the hits counted since the last call and reset them */
+unsigned int objSdsTakeHits(objSds *obj){
+    if(__atomic_load_n(&obj->hits,__ATOMIC_RELAXED) == 0) return 0;
+    return __atomic_exchange_n(&obj->hits,0,__ATOMIC_RELAXED);
 }
@@ -5,6 +5,7 @@
 #define OBJSDS_H
 #include <malloc.h>
 #include <assert.h>
+#include <time.h>
 #include "ccache_config.h"
 #include "sds.h"
 #include "adlist.h"
@@ -13,18 +14,50 @@
 #define OBJSDS_OK 1
 #define OBJSDS_ERR 2
 
+/* Hits counted on an object between two looks of the eviction policy */
+#define OBJSDS_MAX_HITS 15
+
+/* ptr, header and state are written by the master shard owning the
+ * object only, before the object is published. ref is shared by the
+ * master and the workers holding the object, and the object itself is
+ * released through rcuDefer() as readers of the shared index may still
+ * look at it.
+ * hits is counted by the workers and collected by the master.
+ * ptr is the body, allocated in the slabs (see slab.h). header holds the
+ * status line and the headers of the body, not ended by the blank line,
+ * so each response can add its own. Both are never modified once
+ * published: replies send them as they are. A body served from its file
+ * has no ptr: fd is kept open until the object is freed, and the body is
+ * its first fsize bytes. status is the one of header, mtime the time the
+ * file of the body was modified, 0 if unknown. */
 typedef struct {
     int state;
     sds ptr;
+    sds header;
+    int fd;
+    size_t fsize;
+    int status;
+    time_t mtime;
     int ref;
+    unsigned char hits;
     list *waiting_entries;
 } objSds;
 
+/* Length of the body sent, from memory or from the file */
+#define objSdsBodyLen(obj) ((obj)->ptr ? sdslen((obj)->ptr) : (obj)->fsize)
+/* Bytes of the body kept in memory */
+#define objSdsMemLen(obj) ((obj)->ptr ? sdslen((obj)->ptr) : 0)
+
 objSds *objSdsCreate();
 void objSdsAddWaitingEntry(objSds *obj, void* entry);
-objSds *objSdsFromSds(sds ptr);
+objSds *objSdsFromSds(sds header, sds ptr);
 void objSdsAddRef(objSds *obj);
+int objSdsTryAddRef(objSds *obj);
 void objSdsSubRef(objSds *obj);
+void objSdsSetState(objSds *obj, int state);
+int objSdsGetState(objSds *obj);
+void objSdsTouch(objSds *obj);
+unsigned int objSdsTakeHits(objSds *obj);
 
 #if(CCACHE_LOG_LEVEL == CCACHE_DEBUG)
     #define OBJ_REPORT_REF(obj) printf("OBJECT %p REF %d \n",obj,obj->ref)
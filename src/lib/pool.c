@@ -1,4 +1,4 @@
-/* safe_queue.c - lock-free queue allowing one producer and one consumer
+/* pool.c - free lists of fixed size objects, owned by one thread
  *
  * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
  * All rights reserved.
@@ -25,57 +25,43 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include "safe_queue.h"
+#include <stdlib.h>
+#include <malloc.h>
+#include "pool.h"
 
-safeQueue * safeQueueCreate() {
-    safeQueue *sl = malloc(sizeof(*sl));
-    sl->head = NULL;
-    sl->tail = malloc(sizeof(safeQueueEntry));
-    sl->tail->next = NULL;
-    sl->free = NULL;
-    return sl;
+/* Objects of size bytes (at least a pointer), max of them kept once
+ * released */
+void poolInit(pool *p, size_t size, unsigned int max) {
+    p->free = NULL;
+    p->size = size < sizeof(void*) ? sizeof(void*) : size;
+    p->count = 0;
+    p->max = max;
+    p->mem = 0;
+    p->stats.hits = 0;
+    p->stats.misses = 0;
 }
 
-void safeQueueRelease(safeQueue **pp_ll) {
-    safeQueueEntry *curr_node;
-    safeQueueEntry *next_node;
-    void *val_to_free;
-    if(pp_ll&&*pp_ll) {
-        safeQueue *ll = (safeQueue *)(*pp_ll);
-        if(ll->free) {
-            while((val_to_free = safeQueuePop(ll)))
-                ll->free(val_to_free);
-        }
-        curr_node = ll->head;
-        while(curr_node) {
-            next_node = curr_node->next;
-            free(curr_node);
-            curr_node = next_node;
-        }
-        free(ll);
-        *pp_ll = NULL;
+/* Last released first: its cache lines are likely still warm */
+void *poolAlloc(pool *p) {
+    void *obj = p->free;
+    if (obj) {
+        p->free = *(void**)obj;
+        p->count--;
+        p->mem -= malloc_usable_size(obj);
+        poolCountHit(&p->stats);
+        return obj;
     }
+    poolCountMiss(&p->stats);
+    return malloc(p->size);
 }
 
-
-int safeQueuePush(safeQueue *ll, void *value) {
-    safeQueueEntry *node = malloc(sizeof(*node));
-    if(node == NULL) return SAFE_QUEUE_ERR;
-    node->value = value;
-    node->next = NULL;
-    ll->tail->next = node;
-    ll->tail = node;
-    if(ll->head == NULL) ll->head = ll->tail;
-    return SAFE_QUEUE_OK;
-}
-
-
-void * safeQueuePop(safeQueue *ll) {
-    if(ll->head == NULL) return NULL;    
-    void* re = ll->head->value;
-    safeQueueEntry *ln = ll->head;
-    if(ll->head->next) free(ln);
-    ll->head = ll->head->next;
-    return re;
+void poolFree(pool *p, void *obj) {
+    if (p->count == p->max) {
+        free(obj);
+        return;
+    }
+    *(void**)obj = p->free;
+    p->free = obj;
+    p->count++;
+    p->mem += malloc_usable_size(obj);
 }
-
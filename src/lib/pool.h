@@ -0,0 +1,63 @@
+/* pool.h - free lists of fixed size objects, owned by one thread
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Objects taken from a pool (hits) or from malloc (misses). Written by the
+ * thread owning the pool, read by the status: relaxed atomic stores. */
+typedef struct poolStats {
+    unsigned long long hits;
+    unsigned long long misses;
+} poolStats;
+
+#define poolCountHit(s) __atomic_store_n(&(s)->hits,(s)->hits+1,__ATOMIC_RELAXED)
+#define poolCountMiss(s) __atomic_store_n(&(s)->misses,(s)->misses+1,__ATOMIC_RELAXED)
+#define poolStatsHits(s) __atomic_load_n(&(s)->hits,__ATOMIC_RELAXED)
+#define poolStatsMisses(s) __atomic_load_n(&(s)->misses,__ATOMIC_RELAXED)
+
+/* Released objects are kept for the next allocations, up to max of them,
+ * instead of going back to malloc. They are linked through their first
+ * word, which the owner must set again when it takes one. */
+typedef struct pool {
+    void *free;         /* last released object */
+    size_t size;
+    unsigned int count; /* objects kept */
+    unsigned int max;
+    size_t mem;         /* bytes kept, as allocated */
+    poolStats stats;
+} pool;
+
+void poolInit(pool *p, size_t size, unsigned int max);
+void *poolAlloc(pool *p);
+void poolFree(pool *p, void *obj);
+
+#define poolMemory(p) ((p)->mem)
+
+#endif // POOL_H
@@ -0,0 +1,151 @@
+/* rcu.c - quiescent-state based read-copy-update
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include "rcu.h"
+
+#define RCU_CACHELINE 64
+
+/* Epoch of a reader: 0 when the reader is offline, otherwise the global
+ * epoch it has seen at its last quiescent state. */
+typedef struct rcuReader {
+    unsigned long epoch;
+    int used;
+} __attribute__((aligned(RCU_CACHELINE))) rcuReader;
+
+/* An object waiting for the end of its grace period */
+typedef struct rcuDeferred {
+    struct rcuDeferred *next;
+    unsigned long epoch;
+    rcuCallback *fn;
+    void *ptr;
+} rcuDeferred;
+
+static unsigned long rcu_epoch __attribute__((aligned(RCU_CACHELINE))) = 1;
+static rcuReader rcu_readers[RCU_MAX_READERS];
+static int rcu_num_readers = 0;
+
+static __thread rcuReader *rcu_self = NULL;
+/* Deferred objects of the calling thread, oldest first */
+static __thread rcuDeferred *rcu_head = NULL;
+static __thread rcuDeferred *rcu_tail = NULL;
+static __thread unsigned long rcu_pending = 0;
+
+#define rcuLoad(p) __atomic_load_n((p),__ATOMIC_SEQ_CST)
+#define rcuStore(p,v) __atomic_store_n((p),(v),__ATOMIC_SEQ_CST)
+#define rcuFence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Register the calling thread as a reader. The thread is online on return. */
+int rcuRegisterReader(void) {
+    int i, n;
+    if(rcu_self) return RCU_OK;
+    for(i = 0; i < RCU_MAX_READERS; i++) {
+        if(__sync_bool_compare_and_swap(&rcu_readers[i].used,0,1)) {
+            rcu_self = rcu_readers+i;
+            /* Writers only scan the slots below rcu_num_readers */
+            while((n = rcuLoad(&rcu_num_readers)) <= i)
+                __sync_bool_compare_and_swap(&rcu_num_readers,n,i+1);
+            rcuOnline();
+            return RCU_OK;
+        }
+    }
+    return RCU_ERR;
+}
+
+void rcuUnregisterReader(void) {
+    if(rcu_self == NULL) return;
+    rcuOffline();
+    rcuStore(&rcu_self->used,0);
+    rcu_self = NULL;
+}
+
+/* The reader holds no pointer to shared objects anymore */
+void rcuQuiescent(void) {
+    rcuFence();
+    rcuStore(&rcu_self->epoch,rcuLoad(&rcu_epoch));
+    rcuFence();
+}
+
+/* The reader won't touch shared objects until rcuOnline() */
+void rcuOffline(void) {
+    rcuFence();
+    rcuStore(&rcu_self->epoch,0);
+}
+
+void rcuOnline(void) {
+    rcuStore(&rcu_self->epoch,rcuLoad(&rcu_epoch));
+    rcuFence();
+}
+
+/* Call fn(ptr) once all readers are done with ptr.
+ * ptr must already be unreachable for readers that come online later. */
+void rcuDefer(rcuCallback *fn, void *ptr) {
+    rcuDeferred *d = malloc(sizeof(*d));
+    d->next = NULL;
+    d->fn = fn;
+    d->ptr = ptr;
+    d->epoch = __atomic_add_fetch(&rcu_epoch,1,__ATOMIC_SEQ_CST);
+    if(rcu_tail) rcu_tail->next = d;
+    else rcu_head = d;
+    rcu_tail = d;
+    rcu_pending++;
+}
+
+/* The oldest epoch an online reader may still be in */
+static unsigned long _rcuSafeEpoch(void) {
+    unsigned long safe = rcuLoad(&rcu_epoch), e;
+    int i, n = rcuLoad(&rcu_num_readers);
+    rcuFence();
+    for(i = 0; i < n; i++) {
+        e = rcuLoad(&rcu_readers[i].epoch);
+        if(e && e < safe) safe = e;
+    }
+    return safe;
+}
+
+/* Release the objects deferred by the calling thread whose grace period is
+ * over. Return the number of released objects. */
+unsigned long rcuReclaim(void) {
+    unsigned long safe, n = 0;
+    rcuDeferred *d;
+    if(rcu_head == NULL) return 0;
+    safe = _rcuSafeEpoch();
+    while((d = rcu_head) != NULL && d->epoch <= safe) {
+        rcu_head = d->next;
+        if(rcu_head == NULL) rcu_tail = NULL;
+        d->fn(d->ptr);
+        free(d);
+        n++;
+    }
+    rcu_pending -= n;
+    return n;
+}
+
+/* Number of objects deferred by the calling thread and not yet released */
+unsigned long rcuPending(void) {
+    return rcu_pending;
+}
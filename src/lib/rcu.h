@@ -0,0 +1,59 @@
+/* rcu.h - quiescent-state based read-copy-update
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+#define RCU_OK 0
+#define RCU_ERR -1
+
+/* Maximum number of reader threads */
+#define RCU_MAX_READERS 128
+
+/* Readers (the event loops) never lock anything: a reader is inside a
+ * read-side critical section whenever it is online, and it reports a
+ * quiescent state by calling rcuQuiescent() or by going offline, typically
+ * right before sleeping in epoll_wait.
+ *
+ * Writers unpublish an object first, then hand it to rcuDefer(). The object
+ * is released by rcuReclaim() once every online reader went through a
+ * quiescent state, so no reader can still hold a pointer to it.
+ * Deferred objects are kept per thread: each thread deferring objects must
+ * call rcuReclaim() from time to time. */
+typedef void rcuCallback(void *ptr);
+
+int rcuRegisterReader(void);
+void rcuUnregisterReader(void);
+void rcuQuiescent(void);
+void rcuOffline(void);
+void rcuOnline(void);
+
+void rcuDefer(rcuCallback *fn, void *ptr);
+unsigned long rcuReclaim(void);
+unsigned long rcuPending(void);
+
+#endif // RCU_H
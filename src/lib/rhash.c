@@ -0,0 +1,175 @@
+/* rhash.c - read-mostly hash table: one writer, lock-free readers
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "rhash.h"
+#include "rcu.h"
+
+/* Publishing (writer) and reading (readers) a pointer */
+#define rhashPublish(p,v) __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+#define rhashLoad(p) __atomic_load_n((p),__ATOMIC_ACQUIRE)
+
+static size_t _rhashTableMemory(rhashTable *t) {
+    return malloc_usable_size(t)+malloc_usable_size(t->buckets);
+}
+
+static rhashTable *_rhashTableCreate(unsigned long size) {
+    rhashTable *t = malloc(sizeof(*t));
+    t->size = size;
+    t->sizemask = size-1;
+    t->buckets = calloc(size,sizeof(rhashNode*));
+    return t;
+}
+
+static rhashNode *_rhashNodeCreate(const char *key, size_t keylen, unsigned int hash, void *val) {
+    rhashNode *n = malloc(sizeof(*n)+keylen+1);
+    n->next = NULL;
+    n->hash = hash;
+    n->val = val;
+    n->keylen = keylen;
+    memcpy(n->key,key,keylen);
+    n->key[keylen] = '\0';
+    return n;
+}
+
+/* Release a table left behind by a resize, together with its nodes */
+static void _rhashTableFree(void *ptr) {
+    rhashTable *t = ptr;
+    rhashNode *n, *next;
+    unsigned long i;
+    for(i = 0; i < t->size; i++) {
+        for(n = t->buckets[i]; n; n = next) {
+            next = n->next;
+            free(n);
+        }
+    }
+    free(t->buckets);
+    free(t);
+}
+
+rhash *rhashCreate(void) {
+    rhash *h = malloc(sizeof(*h));
+    h->table = _rhashTableCreate(RHASH_INITIAL_SIZE);
+    h->used = 0;
+    h->mem = _rhashTableMemory(h->table);
+    return h;
+}
+
+/* Readers may walk the old table while the writer fills the new one:
+ * nodes are copied rather than moved, and the old table is released after
+ * a grace period. The writer pays for the copy, readers never wait. */
+static void _rhashGrow(rhash *h) {
+    rhashTable *old = h->table;
+    rhashTable *t = _rhashTableCreate(old->size*2);
+    rhashNode *n, *copy;
+    unsigned long i, idx;
+    for(i = 0; i < old->size; i++) {
+        for(n = old->buckets[i]; n; n = n->next) {
+            copy = _rhashNodeCreate(n->key,n->keylen,n->hash,n->val);
+            idx = n->hash & t->sizemask;
+            copy->next = t->buckets[idx];
+            t->buckets[idx] = copy;
+        }
+    }
+    rhashPublish(&h->table,t);
+    /* The copies are as big as the nodes they replace */
+    h->mem += _rhashTableMemory(t)-_rhashTableMemory(old);
+    rcuDefer(_rhashTableFree,old);
+}
+
+static rhashNode **_rhashLink(rhashTable *t, const char *key, size_t keylen, unsigned int hash) {
+    rhashNode **link = &t->buckets[hash & t->sizemask];
+    rhashNode *n;
+    while((n = *link) != NULL) {
+        if(n->hash == hash && n->keylen == keylen && memcmp(n->key,key,keylen) == 0)
+            return link;
+        link = &n->next;
+    }
+    return NULL;
+}
+
+void *rhashFind(rhash *h, const char *key, size_t keylen, unsigned int hash) {
+    rhashTable *t = rhashLoad(&h->table);
+    rhashNode *n = rhashLoad(&t->buckets[hash & t->sizemask]);
+    while(n) {
+        if(n->hash == hash && n->keylen == keylen && memcmp(n->key,key,keylen) == 0)
+            return rhashLoad(&n->val);
+        n = rhashLoad(&n->next);
+    }
+    return NULL;
+}
+
+/* Return RHASH_ERR if the key already exists */
+int rhashAdd(rhash *h, sds key, unsigned int hash, void *val) {
+    rhashTable *t = h->table;
+    rhashNode *n;
+    unsigned long idx;
+    if(_rhashLink(t,key,sdslen(key),hash)) return RHASH_ERR;
+    if(h->used >= t->size) {
+        _rhashGrow(h);
+        t = h->table;
+    }
+    n = _rhashNodeCreate(key,sdslen(key),hash,val);
+    idx = hash & t->sizemask;
+    n->next = t->buckets[idx];
+    /* The node is complete before readers can reach it */
+    rhashPublish(&t->buckets[idx],n);
+    h->used++;
+    h->mem += malloc_usable_size(n);
+    return RHASH_OK;
+}
+
+/* Add or update the key. Return the previous value, or NULL. */
+void *rhashReplace(rhash *h, sds key, unsigned int hash, void *val) {
+    rhashNode **link = _rhashLink(h->table,key,sdslen(key),hash);
+    void *old;
+    if(link == NULL) {
+        rhashAdd(h,key,hash,val);
+        return NULL;
+    }
+    old = (*link)->val;
+    rhashPublish(&(*link)->val,val);
+    return old;
+}
+
+/* Unlink the key and return its value, or NULL if not found.
+ * Readers may still see the value until their next quiescent state. */
+void *rhashDelete(rhash *h, sds key, unsigned int hash) {
+    rhashNode **link = _rhashLink(h->table,key,sdslen(key),hash);
+    rhashNode *n;
+    void *val;
+    if(link == NULL) return NULL;
+    n = *link;
+    val = n->val;
+    rhashPublish(link,n->next);
+    h->mem -= malloc_usable_size(n);
+    rcuDefer(free,n);
+    h->used--;
+    return val;
+}
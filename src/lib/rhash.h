@@ -0,0 +1,74 @@
+/* rhash.h - read-mostly hash table: one writer, lock-free readers
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RHASH_H
+#define RHASH_H
+
+#include "sds.h"
+
+#define RHASH_OK 0
+#define RHASH_ERR 1
+
+#define RHASH_INITIAL_SIZE 16
+
+/* A node owns a copy of its key, so readers never touch memory the writer
+ * may free before the end of a grace period. */
+typedef struct rhashNode {
+    struct rhashNode *next;
+    unsigned int hash;
+    void *val;
+    size_t keylen;
+    char key[];
+} rhashNode;
+
+typedef struct rhashTable {
+    unsigned long size;
+    unsigned long sizemask;
+    rhashNode **buckets;
+} rhashTable;
+
+/* Only one thread may modify a rhash. Any thread registered as rcu reader
+ * may call rhashFind() concurrently, the result stays valid until the
+ * reader's next quiescent state. Removed nodes (and the tables left behind
+ * by a resize) are released through rcuDefer(). */
+typedef struct rhash {
+    rhashTable *table;
+    unsigned long used;
+    size_t mem; /* bytes allocated for the nodes and the current table */
+} rhash;
+
+rhash *rhashCreate(void);
+void *rhashFind(rhash *h, const char *key, size_t keylen, unsigned int hash);
+int rhashAdd(rhash *h, sds key, unsigned int hash, void *val);
+void *rhashReplace(rhash *h, sds key, unsigned int hash, void *val);
+void *rhashDelete(rhash *h, sds key, unsigned int hash);
+
+#define rhashSize(h) ((h)->used)
+#define rhashSlots(h) ((h)->table->size)
+#define rhashMemory(h) ((h)->mem)
+
+#endif // RHASH_H
@@ -0,0 +1,324 @@
+/* ring.c - bounded lock-free ring buffers (SPSC and MPSC)
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include "ring.h"
+
+/* Memory ordering: a producer writes the value, then publishes it with a
+ * RELEASE store (tail for SPSC, slot sequence for MPSC). The consumer reads
+ * the index with an ACQUIRE load before reading the value, and gives the
+ * slot back with a RELEASE store once the value has been read. */
+#define ringLoad(p) __atomic_load_n(p,__ATOMIC_ACQUIRE)
+#define ringStore(p,v) __atomic_store_n(p,v,__ATOMIC_RELEASE)
+#define ringLoadRelaxed(p) __atomic_load_n(p,__ATOMIC_RELAXED)
+
+static unsigned long _ringNextPower(unsigned long size) {
+    unsigned long i = 2;
+    while(i < size) i *= 2;
+    return i;
+}
+
+ring *ringCreate(unsigned long size, int flags) {
+    ring *r;
+    unsigned long i;
+    if(posix_memalign((void**)&r,RING_CACHELINE,sizeof(*r))) return NULL;
+    r->size = _ringNextPower(size);
+    r->mask = r->size - 1;
+    r->flags = flags;
+    r->values = NULL;
+    r->slots = NULL;
+    r->head = r->tail = 0;
+    r->head_cache = r->tail_cache = 0;
+    if(flags&RING_MPSC) {
+        if(posix_memalign((void**)&r->slots,RING_CACHELINE,r->size*sizeof(ringSlot))) {
+            free(r);
+            return NULL;
+        }
+        for(i = 0; i < r->size; i++) {
+            r->slots[i].seq = i;
+            r->slots[i].value = NULL;
+        }
+    }
+    else {
+        if(posix_memalign((void**)&r->values,RING_CACHELINE,r->size*sizeof(void*))) {
+            free(r);
+            return NULL;
+        }
+    }
+    return r;
+}
+
+void ringRelease(ring *r) {
+    if(r) {
+        free(r->values);
+        free(r->slots);
+        free(r);
+    }
+}
+
+/* ---------------------- one producer, one consumer ------------------------ */
+
+static unsigned int _ringPushSpsc(ring *r, void **values, unsigned int n) {
+    unsigned long tail = ringLoadRelaxed(&r->tail);
+    unsigned long room = r->size - (tail - r->head_cache);
+    unsigned int i;
+    if(room < n) {
+        r->head_cache = ringLoad(&r->head);
+        room = r->size - (tail - r->head_cache);
+        if(room < n) n = room;
+    }
+    for(i = 0; i < n; i++)
+        r->values[(tail+i)&r->mask] = values[i];
+    if(n) ringStore(&r->tail,tail+n);
+    return n;
+}
+
+static unsigned int _ringPopSpsc(ring *r, void **values, unsigned int n) {
+    unsigned long head = ringLoadRelaxed(&r->head);
+    unsigned long avail = r->tail_cache - head;
+    unsigned int i;
+    if(avail < n) {
+        r->tail_cache = ringLoad(&r->tail);
+        avail = r->tail_cache - head;
+        if(avail < n) n = avail;
+    }
+    for(i = 0; i < n; i++)
+        values[i] = r->values[(head+i)&r->mask];
+    if(n) ringStore(&r->head,head+n);
+    return n;
+}
+
+/* ---------------------- many producers, one consumer ---------------------- */
+
+static int _ringPushMpsc(ring *r, void *value) {
+    unsigned long pos = ringLoadRelaxed(&r->tail);
+    ringSlot *slot;
+    long dif;
+    while(1) {
+        slot = &r->slots[pos&r->mask];
+        dif = (long)(ringLoad(&slot->seq) - pos);
+        if(dif == 0) {
+            /* The slot is free: try to claim it */
+            if(__atomic_compare_exchange_n(&r->tail,&pos,pos+1,1,
+                                           __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+            /* pos has been reloaded by the failed CAS */
+        }
+        else if(dif < 0) {
+            /* The consumer has not released this slot yet: full */
+            return RING_ERR;
+        }
+        else {
+            /* Another producer took the slot */
+            pos = ringLoadRelaxed(&r->tail);
+        }
+    }
+    slot->value = value;
+    ringStore(&slot->seq,pos+1);
+    return RING_OK;
+}
+
+static void *_ringPopMpsc(ring *r) {
+    unsigned long pos = r->head;
+    ringSlot *slot = &r->slots[pos&r->mask];
+    void *value;
+    if((long)(ringLoad(&slot->seq) - (pos+1)) < 0) return NULL; /* empty */
+    value = slot->value;
+    ringStore(&r->head,pos+1);
+    ringStore(&slot->seq,pos+r->mask+1);
+    return value;
+}
+
+/* ------------------------------- API -------------------------------------- */
+
+/* Return RING_ERR when the ring is full. value must not be NULL. */
+int ringPush(ring *r, void *value) {
+    if(r->flags&RING_MPSC) return _ringPushMpsc(r,value);
+    return _ringPushSpsc(r,&value,1) ? RING_OK : RING_ERR;
+}
+
+/* Return NULL when the ring is empty */
+void *ringPop(ring *r) {
+    void *value;
+    if(r->flags&RING_MPSC) return _ringPopMpsc(r);
+    return _ringPopSpsc(r,&value,1) ? value : NULL;
+}
+
+/* Push up to n values, return the number of values actually pushed.
+ * For a SPSC ring the whole batch is published with a single store. */
+unsigned int ringPushBatch(ring *r, void **values, unsigned int n) {
+    unsigned int i;
+    if(!(r->flags&RING_MPSC)) return _ringPushSpsc(r,values,n);
+    for(i = 0; i < n; i++) {
+        if(_ringPushMpsc(r,values[i]) == RING_ERR) break;
+    }
+    return i;
+}
+
+/* Pop up to n values, return the number of values actually popped */
+unsigned int ringPopBatch(ring *r, void **values, unsigned int n) {
+    unsigned int i;
+    if(!(r->flags&RING_MPSC)) return _ringPopSpsc(r,values,n);
+    for(i = 0; i < n; i++) {
+        if((values[i] = _ringPopMpsc(r)) == NULL) break;
+    }
+    return i;
+}
+
+/* Approximate number of queued values (exact when called by the consumer
+ * while no producer is running). */
+unsigned long ringCount(ring *r) {
+    unsigned long head = ringLoad(&r->head);
+    unsigned long tail = ringLoad(&r->tail);
+    return tail > head ? tail - head : 0;
+}
+
+#ifdef RING_BENCHMARK_MAIN
+/* gcc -O2 -DRING_BENCHMARK_MAIN -Isrc src/lib/ring.c -lpthread -o ring-bench
+ *
+ * Compare the rings with the former safeQueue scheme: one malloc per push and
+ * one free per pop on a linked list (made thread-safe here with a mutex, as
+ * the original had no barriers at all). */
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#define BENCH_OPS 10000000UL
+#define BENCH_BATCH 32
+#define BENCH_PRODUCERS 4
+
+typedef struct benchNode {
+    void *value;
+    struct benchNode *next;
+} benchNode;
+
+typedef struct {
+    benchNode *head, *tail;
+    pthread_mutex_t lock;
+} benchList;
+
+static benchList blist;
+static ring *bring;
+static int bbatch;
+static unsigned long bper;
+
+static double benchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void listPush(void *value) {
+    benchNode *n = malloc(sizeof(*n));
+    n->value = value;
+    n->next = NULL;
+    pthread_mutex_lock(&blist.lock);
+    if(blist.tail) blist.tail->next = n;
+    else blist.head = n;
+    blist.tail = n;
+    pthread_mutex_unlock(&blist.lock);
+}
+
+static void *listPop(void) {
+    benchNode *n;
+    void *value;
+    pthread_mutex_lock(&blist.lock);
+    n = blist.head;
+    if(n) {
+        blist.head = n->next;
+        if(!blist.head) blist.tail = NULL;
+    }
+    pthread_mutex_unlock(&blist.lock);
+    if(!n) return NULL;
+    value = n->value;
+    free(n);
+    return value;
+}
+
+static void *benchProducer(void *arg) {
+    unsigned long i = 0, base = (unsigned long)arg*bper;
+    void *vals[BENCH_BATCH];
+    unsigned int j, done;
+    while(i < bper) {
+        if(bring == NULL) {
+            listPush((void*)(base+i+1));
+            i++;
+        }
+        else if(bbatch) {
+            for(j = 0; j < BENCH_BATCH; j++) vals[j] = (void*)(base+i+j+1);
+            done = 0;
+            while(done < BENCH_BATCH && i+done < bper) {
+                j = ringPushBatch(bring,vals+done,BENCH_BATCH-done);
+                if(j == 0) sched_yield(); /* full: let the consumer run */
+                done += j;
+            }
+            i += done;
+        }
+        else {
+            while(ringPush(bring,(void*)(base+i+1)) == RING_ERR) sched_yield();
+            i++;
+        }
+    }
+    return NULL;
+}
+
+static void bench(const char *name, ring *r, int batch, int producers) {
+    pthread_t tids[BENCH_PRODUCERS];
+    void *vals[BENCH_BATCH];
+    unsigned long got = 0, last, total;
+    double start;
+    int i;
+    bring = r;
+    bbatch = batch;
+    bper = BENCH_OPS/producers;
+    total = bper*producers;
+    start = benchNow();
+    for(i = 0; i < producers; i++)
+        pthread_create(&tids[i],NULL,benchProducer,(void*)(unsigned long)i);
+    while(got < total) {
+        last = got;
+        if(r == NULL) got += listPop() != NULL;
+        else if(batch) got += ringPopBatch(r,vals,BENCH_BATCH);
+        else got += ringPop(r) != NULL;
+        if(got == last) sched_yield(); /* empty: let the producers run */
+    }
+    for(i = 0; i < producers; i++) pthread_join(tids[i],NULL);
+    printf("%-28s %8.2f Mops/s\n",name,total/(benchNow()-start)/1e6);
+}
+
+int main(void) {
+    pthread_mutex_init(&blist.lock,NULL);
+    bench("malloc list, 1 producer",NULL,0,1);
+    bench("malloc list, 4 producers",NULL,0,BENCH_PRODUCERS);
+    bench("ring spsc",ringCreate(4096,RING_SPSC),0,1);
+    bench("ring spsc, batch 32",ringCreate(4096,RING_SPSC),1,1);
+    bench("ring mpsc, 1 producer",ringCreate(4096,RING_MPSC),0,1);
+    bench("ring mpsc, 4 producers",ringCreate(4096,RING_MPSC),0,BENCH_PRODUCERS);
+    return 0;
+}
+#endif
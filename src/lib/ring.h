@@ -0,0 +1,78 @@
+/* ring.h - bounded lock-free ring buffers (SPSC and MPSC)
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#define RING_OK 1
+#define RING_ERR 0  /* the ring is full: the producer has to back off */
+
+/* Flags */
+#define RING_SPSC 0 /* one producer thread, one consumer thread */
+#define RING_MPSC 1 /* many producer threads, one consumer thread */
+
+#define RING_CACHELINE 64
+#define RING_ALIGNED __attribute__((aligned(RING_CACHELINE)))
+
+/* Slot of a MPSC ring: the sequence number tells producers and the consumer
+ * whose turn it is to use the slot (D. Vyukov's bounded queue). */
+typedef struct ringSlot {
+    unsigned long seq;
+    void *value;
+} ringSlot;
+
+/* Producer and consumer indexes live on their own cache lines, so the two
+ * sides never bounce the same line between cores. Each side also keeps a
+ * snapshot of the other side's index and only reloads it when the ring
+ * looks full (producer) or empty (consumer). */
+typedef struct ring {
+    /* Read-only after ringCreate() */
+    unsigned long size;
+    unsigned long mask;
+    int flags;
+    void **values;     /* RING_SPSC */
+    ringSlot *slots;   /* RING_MPSC */
+    /* Consumer side */
+    unsigned long head RING_ALIGNED;
+    unsigned long tail_cache;
+    /* Producer side */
+    unsigned long tail RING_ALIGNED;
+    unsigned long head_cache;
+} RING_ALIGNED ring;
+
+/* size is rounded up to a power of two */
+ring *ringCreate(unsigned long size, int flags);
+void ringRelease(ring *r);
+int ringPush(ring *r, void *value);
+void *ringPop(ring *r);
+unsigned int ringPushBatch(ring *r, void **values, unsigned int n);
+unsigned int ringPopBatch(ring *r, void **values, unsigned int n);
+unsigned long ringCount(ring *r);
+
+#define ringSize(r) ((r)->size)
+
+#endif // RING_H
@@ -85,6 +85,13 @@ void sdsfree(sds s) {
     free(s-sizeof(struct sdshdr));
 }
 
+/* Bytes actually allocated for the string: header, free space and the
+ * rounding of the allocator included */
+size_t sdsAllocSize(sds s) {
+    if (s == NULL) return 0;
+    return malloc_usable_size(s-sizeof(struct sdshdr));
+}
+
 void sdsupdatelen(sds s) {
     struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
     int reallen = strlen(s);
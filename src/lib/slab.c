@@ -0,0 +1,351 @@
+/* slab.c - size-class slab allocator for cached replies
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "ccache_config.h"
+#include "slab.h"
+#include "util.h"
+
+/* Cached replies are allocated when loaded and freed when evicted, in no
+ * particular order. With malloc, a few live replies are enough to keep
+ * the pages of many dead ones, and a big reply does not fit in the holes
+ * left by small ones. Here each size class has its own slabs: a freed
+ * chunk is reused by the next reply of its class, and a slab without live
+ * chunks goes back to the system. */
+
+#define SLAB_LARGE (-1) /* class of a mapping holding one large object */
+
+typedef struct slabPage {
+    struct slabPage *prev, *next; /* slabs of the class with free chunks */
+    void *free;          /* released chunks, linked through their first word */
+    char *unused;        /* chunks never handed out start here */
+    size_t mapped;       /* bytes mapped */
+    int cls;
+    int listed;          /* in the list of its class */
+    unsigned int used;   /* chunks handed out */
+    unsigned int huge;   /* backed by MAP_HUGETLB pages */
+} slabPage;
+
+typedef struct slabClass {
+    pthread_mutex_t lock;
+    size_t size;             /* of the chunks */
+    unsigned int per_slab;
+    slabPage *partial;       /* slabs with free chunks, fullest first */
+    unsigned long slabs;
+    unsigned long used;      /* chunks handed out */
+} slabClass;
+
+static slabClass slab_classes[SLAB_MAX_CLASSES];
+static int slab_num_classes = 0;
+static int slab_pages = SLAB_PAGES_DEFAULT;
+static int slab_hugetlb = 0;     /* MAP_HUGETLB works */
+static size_t slab_page_size = 4096;
+
+static pthread_mutex_t slab_empty_lock = PTHREAD_MUTEX_INITIALIZER;
+static slabPage *slab_empty = NULL;
+static int slab_num_empty = 0;
+
+/* Statistics, updated atomically and read without locking */
+static size_t slab_mapped = 0;       /* bytes mapped, empty slabs included */
+static unsigned long slab_huge = 0;  /* slabs backed by MAP_HUGETLB */
+static unsigned long slab_large = 0; /* objects having their own mapping */
+static size_t slab_large_bytes = 0;
+
+#define slabStatAdd(var,n) __atomic_add_fetch(&(var),(n),__ATOMIC_RELAXED)
+#define slabStatSub(var,n) __atomic_sub_fetch(&(var),(n),__ATOMIC_RELAXED)
+#define slabStatGet(var) __atomic_load_n(&(var),__ATOMIC_RELAXED)
+
+#define _slabPageOf(ptr) ((slabPage*)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_SIZE-1)))
+
+void slabInit(int pages) {
+    size_t size = SLAB_MIN_CHUNK;
+    int i;
+    slab_pages = pages;
+    slab_page_size = sysconf(_SC_PAGESIZE);
+    for(i = 0; i < SLAB_MAX_CLASSES && size < SLAB_MAX_CHUNK; i++) {
+        slab_classes[i].size = size;
+        size = (size_t)(size*SLAB_GROWTH+15) & ~(size_t)15;
+    }
+    slab_classes[i++].size = SLAB_MAX_CHUNK;
+    slab_num_classes = i;
+    for(i = 0; i < slab_num_classes; i++) {
+        pthread_mutex_init(&slab_classes[i].lock,NULL);
+        slab_classes[i].per_slab = (SLAB_SIZE-SLAB_HEADER_SIZE)/slab_classes[i].size;
+    }
+    if(pages == SLAB_PAGES_HUGE) {
+        /* Huge pages have to be reserved (vm.nr_hugepages), check the
+         * pool and its page size once */
+        void *p = mmap(NULL,SLAB_SIZE,PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+        if(p != MAP_FAILED) {
+            slab_hugetlb = ((uintptr_t)p & (SLAB_SIZE-1)) == 0;
+            munmap(p,SLAB_SIZE);
+        }
+        if(!slab_hugetlb)
+            ulog(CCACHE_WARNING,"No huge page reserved, slabs use transparent huge pages.");
+    }
+}
+
+static int _slabClassOf(size_t size) {
+    int lo = 0, hi = slab_num_classes-1, mid;
+    if(size > SLAB_MAX_CHUNK) return SLAB_LARGE;
+    while(lo < hi) {
+        mid = (lo+hi)/2;
+        if(slab_classes[mid].size < size) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Map len bytes aligned on SLAB_SIZE, so the header is found from any
+ * address inside */
+static slabPage *_slabMap(size_t len, int hugetlb) {
+    char *p, *aligned;
+    size_t head;
+    if(hugetlb && slab_hugetlb) {
+        p = mmap(NULL,len,PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+        if(p != MAP_FAILED) {
+            ((slabPage*)p)->huge = 1;
+            return (slabPage*)p;
+        }
+        /* The pool is exhausted: fall back to normal pages */
+    }
+    p = mmap(NULL,len+SLAB_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(p == MAP_FAILED) return NULL;
+    aligned = (char*)(((uintptr_t)p+SLAB_SIZE-1) & ~(uintptr_t)(SLAB_SIZE-1));
+    head = aligned-p;
+    if(head) munmap(p,head);
+    munmap(aligned+len,SLAB_SIZE-head);
+    if(slab_pages == SLAB_PAGES_HUGE && len >= SLAB_SIZE)
+        madvise(aligned,len,MADV_HUGEPAGE);
+    ((slabPage*)aligned)->huge = 0;
+    return (slabPage*)aligned;
+}
+
+static void _slabUnmap(slabPage *page) {
+    slabStatSub(slab_mapped,page->mapped);
+    if(page->huge) slabStatSub(slab_huge,1);
+    munmap(page,page->mapped);
+}
+
+/* Called with the lock of the class */
+static slabPage *_slabNewPage(int cls) {
+    slabPage *page;
+    pthread_mutex_lock(&slab_empty_lock);
+    if((page = slab_empty) != NULL) {
+        slab_empty = page->next;
+        slab_num_empty--;
+    }
+    pthread_mutex_unlock(&slab_empty_lock);
+    if(page == NULL) {
+        if((page = _slabMap(SLAB_SIZE,1)) == NULL) return NULL;
+        page->mapped = SLAB_SIZE;
+        slabStatAdd(slab_mapped,SLAB_SIZE);
+        if(page->huge) slabStatAdd(slab_huge,1);
+    }
+    page->prev = page->next = NULL;
+    page->free = NULL;
+    page->unused = (char*)page+SLAB_HEADER_SIZE;
+    page->cls = cls;
+    page->listed = 0;
+    page->used = 0;
+    slabStatAdd(slab_classes[cls].slabs,1);
+    return page;
+}
+
+static void _slabReleasePage(slabPage *page) {
+    pthread_mutex_lock(&slab_empty_lock);
+    if(slab_num_empty < SLAB_MAX_EMPTY) {
+        page->next = slab_empty;
+        slab_empty = page;
+        slab_num_empty++;
+        page = NULL;
+    }
+    pthread_mutex_unlock(&slab_empty_lock);
+    if(page) _slabUnmap(page);
+}
+
+static void _slabListAdd(slabClass *sc, slabPage *page) {
+    page->prev = NULL;
+    page->next = sc->partial;
+    if(sc->partial) sc->partial->prev = page;
+    sc->partial = page;
+    page->listed = 1;
+}
+
+static void _slabListDel(slabClass *sc, slabPage *page) {
+    if(page->prev) page->prev->next = page->next;
+    else sc->partial = page->next;
+    if(page->next) page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+    page->listed = 0;
+}
+
+static void *_slabAllocLarge(size_t size) {
+    size_t len = (SLAB_HEADER_SIZE+size+slab_page_size-1) & ~(slab_page_size-1);
+    slabPage *page = _slabMap(len,0);
+    if(page == NULL) return NULL;
+    page->mapped = len;
+    page->cls = SLAB_LARGE;
+    slabStatAdd(slab_mapped,len);
+    slabStatAdd(slab_large,1);
+    slabStatAdd(slab_large_bytes,len);
+    return (char*)page+SLAB_HEADER_SIZE;
+}
+
+void *slabAlloc(size_t size) {
+    slabClass *sc;
+    slabPage *page;
+    void *chunk;
+    int cls;
+    if(slab_num_classes == 0) slabInit(SLAB_PAGES_DEFAULT);
+    if((cls = _slabClassOf(size)) == SLAB_LARGE) return _slabAllocLarge(size);
+    sc = slab_classes+cls;
+    pthread_mutex_lock(&sc->lock);
+    if((page = sc->partial) == NULL) {
+        if((page = _slabNewPage(cls)) == NULL) {
+            pthread_mutex_unlock(&sc->lock);
+            return NULL;
+        }
+        _slabListAdd(sc,page);
+    }
+    if(page->free) {
+        chunk = page->free;
+        page->free = *(void**)chunk;
+    }
+    else {
+        chunk = page->unused;
+        page->unused += sc->size;
+    }
+    if(++page->used == sc->per_slab) _slabListDel(sc,page);
+    slabStatAdd(sc->used,1);
+    pthread_mutex_unlock(&sc->lock);
+    return chunk;
+}
+
+/* A slab whose last chunk is freed is released. A full slab getting a free
+ * chunk goes first in the list of its class, so the fullest slabs are
+ * filled up and the others have a chance to empty. */
+void slabFree(void *ptr) {
+    slabClass *sc;
+    slabPage *page;
+    if(ptr == NULL) return;
+    page = _slabPageOf(ptr);
+    if(page->cls == SLAB_LARGE) {
+        slabStatSub(slab_large,1);
+        slabStatSub(slab_large_bytes,page->mapped);
+        _slabUnmap(page);
+        return;
+    }
+    sc = slab_classes+page->cls;
+    pthread_mutex_lock(&sc->lock);
+    *(void**)ptr = page->free;
+    page->free = ptr;
+    slabStatSub(sc->used,1);
+    if(--page->used == 0) {
+        if(page->listed) _slabListDel(sc,page);
+        slabStatSub(sc->slabs,1);
+        pthread_mutex_unlock(&sc->lock);
+        _slabReleasePage(page);
+        return;
+    }
+    if(!page->listed) _slabListAdd(sc,page);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+size_t slabUsableSize(void *ptr) {
+    slabPage *page = _slabPageOf(ptr);
+    if(page->cls == SLAB_LARGE) return page->mapped-SLAB_HEADER_SIZE;
+    return slab_classes[page->cls].size;
+}
+
+/* The content is left uninitialized, only the terminator is set */
+sds slabSdsCreate(size_t len) {
+    struct sdshdr *sh = slabAlloc(sizeof(struct sdshdr)+len+1);
+    if(sh == NULL) return NULL;
+    sh->len = len;
+    sh->free = 0;
+    sh->buf[len] = '\0';
+    return sh->buf;
+}
+
+sds slabSdsNewLen(const void *init, size_t len) {
+    sds s = slabSdsCreate(len);
+    if(s && len) memcpy(s,init,len);
+    return s;
+}
+
+void slabSdsFree(sds s) {
+    if(s == NULL) return;
+    slabFree(s-sizeof(struct sdshdr));
+}
+
+size_t slabSdsAllocSize(sds s) {
+    return slabUsableSize(s-sizeof(struct sdshdr));
+}
+
+/* Bytes taken from the system, empty slabs included */
+size_t slabMapped(void) {
+    return slabStatGet(slab_mapped);
+}
+
+/* Occupancy of the slabs: how much of the mapped memory holds objects,
+ * and how many slabs of each class for how many chunks in use. A slab is
+ * one huge page when backed by hugetlb (HUGE) or by THP. */
+sds slabCatStatus(sds s) {
+    size_t mapped = slabStatGet(slab_mapped);
+    size_t inuse = slabStatGet(slab_large_bytes);
+    unsigned long slabs = 0, used;
+    int i;
+    for(i = 0; i < slab_num_classes; i++) {
+        slabs += slabStatGet(slab_classes[i].slabs);
+        inuse += slabStatGet(slab_classes[i].used)*slab_classes[i].size;
+    }
+    s = sdscatprintf(s,"SLAB MAPPED: %-6.2lf IN USE: %-6.2lf (%.1lf%%) SLABS: %lu HUGE: %lu EMPTY: %d LARGE: %lu (%.2lf) PAGES: %s\n",
+                     BYTES_TO_MEGABYTES(mapped),BYTES_TO_MEGABYTES(inuse),
+                     mapped ? 100.0*inuse/mapped : 0.0,
+                     slabs,slabStatGet(slab_huge),slabStatGet(slab_num_empty),
+                     slabStatGet(slab_large),
+                     BYTES_TO_MEGABYTES(slabStatGet(slab_large_bytes)),
+                     slab_pages != SLAB_PAGES_HUGE ? "default" :
+                        slab_hugetlb ? "hugetlb" : "thp");
+    for(i = 0; i < slab_num_classes; i++) {
+        if((slabs = slabStatGet(slab_classes[i].slabs)) == 0) continue;
+        used = slabStatGet(slab_classes[i].used);
+        s = sdscatprintf(s,"SLAB CLASS %-2d CHUNK: %-7lu SLABS: %-5lu CHUNKS: %lu/%lu (%.1lf%%)\n",
+                         i,(unsigned long)slab_classes[i].size,slabs,
+                         used,slabs*slab_classes[i].per_slab,
+                         100.0*used/(slabs*slab_classes[i].per_slab));
+    }
+    return s;
+}
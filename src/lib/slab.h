@@ -0,0 +1,71 @@
+/* slab.h - size-class slab allocator for cached replies
+ *
+ * Copyright (c) 2013, Nguyen Truong Minh <nguyentrminh at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include "sds.h"
+
+/* Objects are carved out of slabs of one huge page: the objects of a class
+ * are packed together, and a slab can be backed by a single TLB entry.
+ * The slab of an object is found by masking its address. */
+#define SLAB_SIZE (2L<<20)
+/* Header at the start of each slab, one cache line */
+#define SLAB_HEADER_SIZE 64
+/* Chunk sizes grow by SLAB_GROWTH from SLAB_MIN_CHUNK to SLAB_MAX_CHUNK.
+ * Bigger objects get a mapping of their own. */
+#define SLAB_MIN_CHUNK 64
+#define SLAB_MAX_CHUNK (SLAB_SIZE/4)
+#define SLAB_GROWTH 1.25
+#define SLAB_MAX_CLASSES 64
+/* Empty slabs kept for any class rather than given back to the system */
+#define SLAB_MAX_EMPTY 4
+
+/* Backing of the slabs */
+#define SLAB_PAGES_DEFAULT 0 /* system setting for transparent huge pages */
+#define SLAB_PAGES_HUGE 1    /* MAP_HUGETLB, else madvise(MADV_HUGEPAGE) */
+
+/* Must be called before the first allocation */
+void slabInit(int pages);
+
+/* Thread safe. Freeing may happen in any thread. */
+void *slabAlloc(size_t size);
+void slabFree(void *ptr);
+size_t slabUsableSize(void *ptr);
+
+/* Replies are sds strings living in a chunk. They are immutable:
+ * never grow them with the sds functions, nor free them with sdsfree(). */
+sds slabSdsCreate(size_t len);
+sds slabSdsNewLen(const void *init, size_t len);
+void slabSdsFree(sds s);
+size_t slabSdsAllocSize(sds s);
+
+size_t slabMapped(void);
+sds slabCatStatus(sds s);
+
+#endif // SLAB_H
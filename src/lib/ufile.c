@@ -36,6 +36,7 @@
 #include <dirent.h>
 #include "ufile.h"
 #include "lib/util.h"
+#include "lib/slab.h"
 
 
 
@@ -48,7 +49,17 @@ void freeFileInfo(void *ptr)
     }
 }
 
-sds ufileMmapHttpReply(char *fn)
+/* Bodies are cached as they are read, in one slab chunk released with
+ * slabSdsFree(). The header is precomputed apart (see replyObjectHeader) */
+static sds _ufileBodyCreate(size_t size)
+{
+    sds content = slabSdsCreate(size);
+    if(content == NULL)
+        ulog(CCACHE_WARNING,"ufile no memory for a body of %zu bytes",size);
+    return content;
+}
+
+sds ufileMmapRead(char *fn)
 {
     int fdin;
     struct stat fs;
@@ -60,55 +71,47 @@ sds ufileMmapHttpReply(char *fn)
         ulog(CCACHE_WARNING,"ufile fstat[%s] %s",fn,strerror(errno));
         return NULL;
     }
-    sds content = sdsempty();
     size_t size = fs.st_size;
-    content = sdscatprintf(content,"HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n",size);
-    content = sdsMakeRoomFor(content,size);
-    size_t before = sdslen(content);
-    char* dst = content + before;
+    sds content = _ufileBodyCreate(size);
+    if(content == NULL) {
+        close(fdin);
+        return NULL;
+    }
     char *src;
     if ((src = mmap(0, size, PROT_READ, MAP_SHARED, fdin, 0)) == MAP_FAILED) {
         ulog(CCACHE_WARNING,"ufile mmap[%s] %s",fn,strerror(errno));
-        sdsfree(content);
+        slabSdsFree(content);
         close(fdin);
         return NULL;
     }
-    memcpy(dst,src,size);
+    memcpy(content,src,size);
     munmap(src,size);
-    sdsaddlen(content,size);
     close(fdin);
     return content;
 
 }
 
-/* Use native UNIX API syscall */
-sds ufileMakeHttpReplyFromFile(char* fn)
+/* Files kept open for their body to be sent from them */
+static int ufile_open_files = 0;
+
+/* Read size bytes of the open file fd into a body, then close it */
+static sds _ufileReadFd(char *fn, int fd, size_t size)
 {
-    int fd;
-    struct stat fs;
-    if((fd = open(fn,O_RDONLY)) < 0) {
-        ulog(CCACHE_WARNING,"ufile open[%s] %s",fn,strerror(errno));
-        return NULL;
-    }
-    if (fstat(fd, &fs)) {
-        ulog(CCACHE_WARNING,"ufile fstat[%s] %s",fn,strerror(errno));
+    sds content = _ufileBodyCreate(size);
+    char *ptr = content;
+    if(content == NULL) {
+        close(fd);
         return NULL;
     }
-    sds content = sdsempty();
-    size_t size = fs.st_size;
-    content = sdscatprintf(content,"HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n",size);
-    content = sdsMakeRoomFor(content,size);
-    size_t before = sdslen(content);
-    char* ptr = content + before;
     size_t nleft = size;
     ssize_t nread;
     while(nleft>0) {
-        if((nread = read(fd, content+sdslen(content), nleft)) < 0) {
+        if((nread = read(fd, ptr, nleft)) < 0) {
             if(errno == EINTR) /* Interrupted by sighandler */
                 nread = 0; /* call read again */
             else {
                 ulog(CCACHE_WARNING,"ufile read[%s] %s",fn,strerror(errno));
-                sdsfree(content);
+                slabSdsFree(content);
                 close(fd);
                 return NULL;
             }
@@ -119,13 +122,58 @@ sds ufileMakeHttpReplyFromFile(char* fn)
         nleft -= nread;
         ptr += nread;
     }
-    sdsaddlen(content,size);
     close(fd);
     return content;
 }
 
+/* Files of at least min bytes are kept open rather than read, as long as
+ * no more than CCACHE_MAX_OPEN_FILES are: NULL is returned, with the file
+ * in *fd and its size in *size, to be released by ufileCloseBody().
+ * Otherwise *fd is -1 and the body read is returned, NULL on error.
+ * mtime is set to the last modification of the file. */
+sds ufileOpenBody(char *fn, size_t min, int *fd, size_t *size, time_t *mtime)
+{
+    int fdin;
+    struct stat fs;
+    *fd = -1;
+    if((fdin = open(fn,O_RDONLY)) < 0) {
+        ulog(CCACHE_WARNING,"ufile open[%s] %s",fn,strerror(errno));
+        return NULL;
+    }
+    if (fstat(fdin, &fs)) {
+        ulog(CCACHE_WARNING,"ufile fstat[%s] %s",fn,strerror(errno));
+        close(fdin);
+        return NULL;
+    }
+    *size = fs.st_size;
+    *mtime = fs.st_mtime;
+    if(S_ISREG(fs.st_mode) && *size > 0 && *size >= min) {
+        if(__atomic_add_fetch(&ufile_open_files,1,__ATOMIC_RELAXED) <= CCACHE_MAX_OPEN_FILES) {
+            *fd = fdin;
+            return NULL;
+        }
+        __atomic_sub_fetch(&ufile_open_files,1,__ATOMIC_RELAXED);
+    }
+    return _ufileReadFd(fn,fdin,*size);
+}
+
+void ufileCloseBody(int fd)
+{
+    close(fd);
+    __atomic_sub_fetch(&ufile_open_files,1,__ATOMIC_RELAXED);
+}
+
+/* Use native UNIX API syscall */
+sds ufileReadFile(char* fn)
+{
+    int fd;
+    size_t size;
+    time_t mtime;
+    return ufileOpenBody(fn,SIZE_MAX,&fd,&size,&mtime);
+}
+
 /* Use C standard I/O */
-sds _ufileMakeHttpReplyFromFile(char *filepath)
+sds _ufileReadFile(char *filepath)
 {
     FILE* fp;
     fp = fopen (filepath, "r");
@@ -141,31 +189,30 @@ sds _ufileMakeHttpReplyFromFile(char *filepath)
         ulog(CCACHE_WARNING,"ufile fstat[%s] %s",filepath,strerror(errno));
         return NULL;
     }
-    sds content = sdsempty();
     size_t size = fs.st_size;
-    content = sdscatprintf(content,"HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n",size);
-    content = sdsMakeRoomFor(content,size);
-    size_t before = sdslen(content);
-    char* ptr = content + before;
-    if (!fread (ptr, size, 1, fp)) {
+    sds content = _ufileBodyCreate(size);
+    if(content == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+    if (size && !fread (content, size, 1, fp)) {
         ulog(CCACHE_WARNING,"ufile fread[%s] %s",filepath,strerror(errno));
-        sdsfree(content);
+        slabSdsFree(content);
+        fclose(fp);
         return NULL;
     }
     if (fclose (fp)) {
         ulog(CCACHE_WARNING,"ufile fclose[%s] %s",filepath,strerror(errno));
     }
 
-    sdsaddlen(content,size);
     //printf("==== Content ====  \n%s\n Content Length: %ld \n",content,sdslen(content));
     return content;
 }
 
-sds ufilMakettpReplyFromBuffer(uchar *buf, size_t len)
+sds ufileFromBuffer(uchar *buf, size_t len)
 {
-    sds content = sdsempty();
-    content = sdscatprintf(content,"HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n\r\n",len);
-    content = sdscatlen(content,buf,len);
+    sds content = _ufileBodyCreate(len);
+    if(content) memcpy(content,buf,len);
     return content;
 }
 
@@ -37,10 +37,13 @@ typedef unsigned char uchar;
 
 
 
-sds ufileMakeHttpReplyFromFile(char *filepath);
-sds _ufileMakeHttpReplyFromFile(char *filepath);
-sds ufileMmapHttpReply(char *filepath);
-sds ufilMakettpReplyFromBuffer(uchar *buf, size_t len);
+/* Bodies are allocated in the slabs, free them with slabSdsFree() */
+sds ufileReadFile(char *filepath);
+sds _ufileReadFile(char *filepath);
+sds ufileMmapRead(char *filepath);
+sds ufileFromBuffer(uchar *buf, size_t len);
+sds ufileOpenBody(char *fn, size_t min, int *fd, size_t *size, time_t *mtime);
+void ufileCloseBody(int fd);
 
 ssize_t ufileWriteFile(char *fn, void *src, size_t size);
 ssize_t ufileMmapWrite(char *fn, void *src, size_t size);
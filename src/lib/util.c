@@ -356,6 +356,16 @@ long long mstime(void) {
     return ustime()/1000;
 }
 
+/* Return the resident set size of the process in bytes, 0 if unknown */
+size_t utilRss(void) {
+    long pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm","r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp,"%ld %ld",&pages,&rss) != 2) rss = 0;
+    fclose(fp);
+    return (size_t)rss*sysconf(_SC_PAGESIZE);
+}
+
 #ifdef UTIL_TEST_MAIN
 #include <assert.h>
 
@@ -472,12 +482,13 @@ int main(int argc, char **argv) {
 
 void ulog(int level, const char *fmt, ...) {
     const char *c = ".-*#";
-    time_t now = time(NULL);
+    time_t now;
     va_list ap;
     FILE *fp;
     char buf[64];
     char msg[1024];
     if (level < CCACHE_LOG_LEVEL) return;
+    now = time(NULL);
 
 #if (CCACHE_LOG_LEVEL == CCACHE_DEBUG)
     fp = stdout;
@@ -1,6 +1,8 @@
 #ifndef __CCACHE_UTIL_H
 #define __CCACHE_UTIL_H
 
+#include <stddef.h>
+
 int stringmatchlen(const char *p, int plen, const char *s, int slen, int nocase);
 int stringmatch(const char *p, const char *s, int nocase);
 int stringstartwith(const char *s1, const char *s2);
@@ -13,6 +15,7 @@ long long ustime(void);
 int notsafePath(char *buf);
 
 long long mstime(void);
+size_t utilRss(void);
 
 int utilMkdir(char *dn);
 int utilMkSubDirs(char *fullname, int baseoffset);
@@ -32,10 +32,13 @@
 #include "ccache_config.h"
 #include "organizer/bio.h"
 #include "cache/mcache.h"
+#include "cache/evict.h"
+#include "lib/slab.h"
 #include "signal_handler.h"
 #include "http/request_handler.h"
-#include "usage.c"
 #include "net/http_server.h"
+#include "service/zoom.h"
+#include "usage.c"
 
 int main(int argc, char* argv[])
 {
@@ -44,9 +47,14 @@ int main(int argc, char* argv[])
      setupSignalHandlers();
      struct ccache_options options = getOptions(argc,argv);
      bioSetDirs(options.srcd,options.tmpd);
+     bioSetSendfileMinSize(options.sendfile);
+     zoomSetSnap(options.zoomsnap);
+     cacheMasterSetShards(options.masters);
+     cacheMasterSetPolicy(options.evict);
+     slabInit(options.hugepages ? SLAB_PAGES_HUGE : SLAB_PAGES_DEFAULT);
      requestHandleInitializeGlobalCache();
      cacheMasterInit();
-     initServer(options.addr, options.port);
+     initServer(options.addr, options.port, options.accept);
      return 0;
 }
 
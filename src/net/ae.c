@@ -31,6 +31,7 @@
  */
 
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -41,25 +42,180 @@
 #include "ae.h"
 #include "client.h"
 #include "cache/mcache.h"
+#include "lib/rcu.h"
 
 
-static aeFileEvent *aeEvents = server.events;
-
+/* Serve the clients waiting for the objects the master replied with */
 static void unwatchClient(ccache *c) {
     cacheEntry *ce;
     while((ce=cacheGetMessage(c,CACHE_REPLY_NEW)) != NULL) {
         httpClient *client;
-        list *waiting_clients = ce->waiting_clients;
-        sds obuf = ce->val;
+        c->inflight--;
+        list *waiting_clients = &ce->waiting_clients;
+        objSds *obj = ce->val;
         listIter li;
         listNode *ln;
         listRewind(waiting_clients,&li);
         while ((ln = listNext(&li)) != NULL) {
             client = listNodeValue(ln);
-            unblockClient(client,obuf);
-            listDelNode(waiting_clients,ln);
+            /* Each client holds its own reference until its reply is sent */
+            objSdsAddRef(obj);
+            unblockClient(client,obj);
+            cacheDelWaitingClient(c,waiting_clients,ln);
+        }
+        /* Drop the reference of the entry */
+        objSdsSubRef(obj);
+        cacheRemove(c,ce);
+    }
+}
+
+/* The master signaled that some entries of the slave cache are ready */
+static void cacheReplyHandler(aeEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    ccache *c = clientData;
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(mask);
+    notifierClear(c->wakeup);
+    unwatchClient(c);
+}
+
+/* CLOCK_MONOTONIC_COARSE is read from the vDSO, without a syscall.
+ * Its resolution (a few ms) is finer than the tick of the timers. */
+static long long aeMonotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+    return (long long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+void aeTimerInit(aeTimer *timer, aeTimerProc *proc, void *clientData) {
+    timer->prev = timer->next = NULL;
+    timer->slot = NULL;
+    timer->expires = 0;
+    timer->proc = proc;
+    timer->clientData = clientData;
+}
+
+/* A timer due within AE_WHEEL_ROOT_SIZE ticks goes into the root slot of
+ * its tick. Later ones go into the slot of a coarser level, and move down
+ * (cascade) when the root wraps around to their range. */
+static void _aeTimerLink(aeTimerWheel *w, aeTimer *t) {
+    unsigned long long delta;
+    aeTimer **slot;
+    if (t->expires < w->clk) t->expires = w->clk;
+    delta = t->expires - w->clk;
+    if (delta < AE_WHEEL_ROOT_SIZE) {
+        unsigned int idx = t->expires & (AE_WHEEL_ROOT_SIZE-1);
+        slot = w->root + idx;
+        w->root_map[idx >> 6] |= 1ULL << (idx & 63);
+    } else {
+        int level = 0, shift = AE_WHEEL_ROOT_BITS;
+        while (level < AE_WHEEL_LEVELS-2 && delta >= 1ULL << (shift+AE_WHEEL_BITS)) {
+            level++;
+            shift += AE_WHEEL_BITS;
         }
+        if (delta >= 1ULL << (shift+AE_WHEEL_BITS))
+            t->expires = w->clk + (1ULL << (shift+AE_WHEEL_BITS)) - 1;
+        slot = &w->levels[level][(t->expires >> shift) & (AE_WHEEL_SIZE-1)];
+    }
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot) (*slot)->prev = t;
+    *slot = t;
+}
+
+static void _aeTimerUnlink(aeTimerWheel *w, aeTimer *t) {
+    if (t->prev) t->prev->next = t->next;
+    else *t->slot = t->next;
+    if (t->next) t->next->prev = t->prev;
+    if (*t->slot == NULL && t->slot >= w->root && t->slot < w->root+AE_WHEEL_ROOT_SIZE) {
+        unsigned int idx = t->slot - w->root;
+        w->root_map[idx >> 6] &= ~(1ULL << (idx & 63));
     }
+    t->prev = t->next = NULL;
+    t->slot = NULL;
+}
+
+/* Arm (or move) the timer to fire in ms, never earlier */
+void aeTimerSet(aeEventLoop *eventLoop, aeTimer *timer, long long ms) {
+    aeTimerWheel *w = &eventLoop->timers;
+    if (timer->slot) _aeTimerUnlink(w,timer);
+    else w->count++;
+    if (ms < 0) ms = 0;
+    timer->expires = (eventLoop->now+ms+AE_TIMER_TICK-1)/AE_TIMER_TICK;
+    _aeTimerLink(w,timer);
+}
+
+void aeTimerCancel(aeEventLoop *eventLoop, aeTimer *timer) {
+    if (timer->slot == NULL) return;
+    _aeTimerUnlink(&eventLoop->timers,timer);
+    eventLoop->timers.count--;
+}
+
+static void _aeTimerCascade(aeTimerWheel *w, int level, unsigned int idx) {
+    aeTimer *t = w->levels[level][idx], *next;
+    w->levels[level][idx] = NULL;
+    while (t) {
+        next = t->next;
+        _aeTimerLink(w,t);
+        t = next;
+    }
+}
+
+/* Run the ticks up to the clock of the loop. A handler may arm, move or
+ * cancel any timer, its own included. */
+static void aeProcessTimers(aeEventLoop *eventLoop) {
+    aeTimerWheel *w = &eventLoop->timers;
+    unsigned long long target = eventLoop->now/AE_TIMER_TICK;
+    aeTimer *t;
+    if (w->count == 0) {
+        /* Nothing to cascade: skip the idle ticks */
+        if (w->clk <= target) w->clk = target+1;
+        return;
+    }
+    while (w->clk <= target) {
+        unsigned int idx = w->clk & (AE_WHEEL_ROOT_SIZE-1);
+        if (idx == 0) {
+            int level, shift = AE_WHEEL_ROOT_BITS;
+            for (level = 0; level < AE_WHEEL_LEVELS-1; level++, shift += AE_WHEEL_BITS) {
+                unsigned int j = (w->clk >> shift) & (AE_WHEEL_SIZE-1);
+                _aeTimerCascade(w,level,j);
+                if (j) break;
+            }
+        }
+        /* Timers armed from now on for this slot belong to the next round */
+        w->running = w->root[idx];
+        w->root[idx] = NULL;
+        w->root_map[idx >> 6] &= ~(1ULL << (idx & 63));
+        for (t = w->running; t; t = t->next) t->slot = &w->running;
+        w->clk++;
+        while ((t = w->running) != NULL) {
+            _aeTimerUnlink(w,t);
+            w->count--;
+            t->proc(eventLoop,t->clientData);
+        }
+    }
+}
+
+/* Milliseconds until the first root slot holding timers, or until the
+ * next cascade. -1 without any timer. */
+static long long aeTimerNext(aeEventLoop *eventLoop) {
+    aeTimerWheel *w = &eventLoop->timers;
+    unsigned int idx, j;
+    unsigned long long ticks;
+    long long ms;
+    if (w->count == 0) return -1;
+    idx = w->clk & (AE_WHEEL_ROOT_SIZE-1);
+    ticks = AE_WHEEL_ROOT_SIZE-idx;
+    for (j = idx; j < AE_WHEEL_ROOT_SIZE; j = (j|63)+1) {
+        unsigned long long word = w->root_map[j >> 6] >> (j & 63);
+        if (word) {
+            ticks = j+__builtin_ctzll(word)-idx;
+            break;
+        }
+    }
+    ms = (long long)(w->clk+ticks)*AE_TIMER_TICK-eventLoop->now;
+    return ms < 0 ? 0 : ms;
 }
 
 /* We received a SIGTERM,  shuttingdown here in a safe way, as it is
@@ -71,17 +227,21 @@ void workerBeforeSleep(struct aeEventLoop *eventLoop){
     }
     */
     unwatchClient(eventLoop->cache);    
-#ifdef AE_MAX_CLIENT_IDLE_TIME
-    if (eventLoop->maxidletime)
-        closeTimedoutClients(eventLoop);
-#endif
-    if(shouldIFreeSomeData()) {
-        cacheDeleteStaleEntries(eventLoop->cache,1);
-    }
+    /* Free the objects released by this worker once no reader uses them */
+    rcuReclaim();
+}
+
+/* Nothing to do but to return from epoll_wait */
+static void aeWakeupHandler(aeEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    AE_NOTUSED(fd);
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+    notifierClear(eventLoop->wakeup);
 }
 
 aeEventLoop *aeCreateEventLoop(void) {
     aeEventLoop *eventLoop;
+    int i;
 
     eventLoop = malloc(sizeof(*eventLoop));
     if (!eventLoop) return NULL;
@@ -93,68 +253,127 @@ aeEventLoop *aeCreateEventLoop(void) {
     }
     eventLoop->stop = 0;
     eventLoop->numfds = 0;
-    eventLoop->clients = listCreate();
-#ifdef AE_MAX_CLIENT_PER_WORKER
-    eventLoop->maxclients = AE_MAX_CLIENT_PER_WORKER;
-#endif
+    for (i = 0; i < AE_MAX_PROC_EVENTS; i++)
+        eventLoop->procs[i].fd = -1;
+    eventLoop->now = aeMonotonicMs();
+    memset(&eventLoop->timers,0,sizeof(eventLoop->timers));
+    eventLoop->timers.clk = eventLoop->now/AE_TIMER_TICK;
+    eventLoop->wakeup = notifierCreate();
+    if (eventLoop->wakeup == NULL) {
+        close(eventLoop->epfd);
+        free(eventLoop);
+        return NULL;
+    }
+    if (aeCreateProcEvent(eventLoop,notifierFd(eventLoop->wakeup),AE_READABLE,
+                          aeWakeupHandler,NULL) == AE_ERR) {
+        notifierRelease(eventLoop->wakeup);
+        close(eventLoop->epfd);
+        free(eventLoop);
+        return NULL;
+    }
 #ifdef AE_MAX_CLIENT_IDLE_TIME
     eventLoop->maxidletime = AE_MAX_CLIENT_IDLE_TIME;
 #endif
+    if (clientTableCreate(eventLoop,AE_MAX_CLIENT_PER_WORKER) != CCACHE_OK) {
+        aeDeleteProcEvent(eventLoop,notifierFd(eventLoop->wakeup));
+        notifierRelease(eventLoop->wakeup);
+        close(eventLoop->epfd);
+        free(eventLoop);
+        return NULL;
+    }
     return eventLoop;
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    clientTableRelease(eventLoop);
+    aeDeleteProcEvent(eventLoop,notifierFd(eventLoop->wakeup));
+    notifierRelease(eventLoop->wakeup);
     close(eventLoop->epfd);
     free(eventLoop);
 }
 
+/* May be called from any thread */
 void aeStop(aeEventLoop *eventLoop) {
     eventLoop->stop = 1;
+    aeWakeup(eventLoop);
+}
+
+void aeWakeup(aeEventLoop *eventLoop) {
+    notifierSignal(eventLoop->wakeup);
 }
 
-int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask, void *clientData)
-{    
-    if (fd >= AE_FD_SET_SIZE) return AE_ERR;
-    aeFileEvent *fe = aeEvents + fd;
-    fe->ee->events = mask;
-    /* add/modify event associated with fd to event loop */
-    if (epoll_ctl(eventLoop->epfd,EPOLL_CTL_ADD,fd,fe->ee))
+/* Register fd with the event embedded in its owner */
+int aeCreateFileEvent(aeEventLoop *eventLoop, aeFileEvent *fe, int fd, int mask, void *clientData)
+{
+    fe->ee.events = mask;
+    fe->ee.data.ptr = fe;
+    if (epoll_ctl(eventLoop->epfd,EPOLL_CTL_ADD,fd,&fe->ee))
         return AE_ERR;
+    fe->fd = fd;
+    fe->proc = NULL;
     fe->clientData = clientData;
     eventLoop->numfds++;
-    printf("Add fd %d mask %d\n",fd,fe->ee->events);
     return AE_OK;
 }
 
-int aeModifyFileEvent(aeEventLoop *eventLoop, int fd, int mask, void *clientData)
+int aeModifyFileEvent(aeEventLoop *eventLoop, aeFileEvent *fe, int mask)
 {
-    if (fd >= AE_FD_SET_SIZE) return AE_ERR;
-    aeFileEvent *fe = aeEvents + fd;
-    fe->ee->events = mask;
-    /* add/modify event associated with fd to event loop */
-    if (epoll_ctl(eventLoop->epfd,EPOLL_CTL_MOD,fd,fe->ee))
+    fe->ee.events = mask;
+    if (epoll_ctl(eventLoop->epfd,EPOLL_CTL_MOD,fe->fd,&fe->ee))
         return AE_ERR;
-    fe->clientData = clientData;
-    printf("Modify fd %d mask %d\n",fd,fe->ee->events);
     return AE_OK;
 }
 
-int aeDeleteFileEvent(aeEventLoop *eventLoop, int fd)
+/* The event may still be in the batch being dispatched: it is marked
+ * unactivated so that the loop skips it. */
+int aeDeleteFileEvent(aeEventLoop *eventLoop, aeFileEvent *fe)
 {
-    aeFileEvent *fe = aeEvents + fd;
-    fe->clientData = NULL;
-    if (fe->ee->events == AE_UNACTIVATED)
+    if (!aeFileEventIsActive(fe))
         return AE_ERR; /* safe check */
     /* Note, Kernel < 2.6.9 requires a non null event pointer even for
      * EPOLL_CTL_DEL. */
-    if(epoll_ctl(eventLoop->epfd,EPOLL_CTL_DEL,fd,fe->ee))
-        return AE_ERR;
-    fe->ee->events = AE_UNACTIVATED;
+    epoll_ctl(eventLoop->epfd,EPOLL_CTL_DEL,fe->fd,&fe->ee);
+    fe->ee.events = AE_UNACTIVATED;
+    fe->fd = -1;
+    fe->clientData = NULL;
+    fe->proc = NULL;
     eventLoop->numfds--;
-    printf("Delete fd %d mask %d\n",fd,fe->ee->events);
     return AE_OK;
 }
 
+/* Non-client fds take one of the few events of the loop itself */
+int aeCreateProcEvent(aeEventLoop *eventLoop, int fd, int mask, aeFileProc *proc, void *clientData)
+{
+    int i;
+    for (i = 0; i < AE_MAX_PROC_EVENTS; i++) {
+        aeFileEvent *fe = eventLoop->procs+i;
+        if (aeFileEventIsActive(fe)) continue;
+        if (aeCreateFileEvent(eventLoop,fe,fd,mask,clientData) == AE_ERR)
+            return AE_ERR;
+        fe->proc = proc;
+        return AE_OK;
+    }
+    return AE_ERR;
+}
+
+int aeDeleteProcEvent(aeEventLoop *eventLoop, int fd)
+{
+    int i;
+    for (i = 0; i < AE_MAX_PROC_EVENTS; i++) {
+        aeFileEvent *fe = eventLoop->procs+i;
+        if (fe->fd == fd)
+            return aeDeleteFileEvent(eventLoop,fe);
+    }
+    return AE_ERR;
+}
+
+/* Make the event loop serve the replies the master puts in the slave cache */
+int aeAttachCache(aeEventLoop *eventLoop, ccache *c)
+{
+    eventLoop->cache = c;
+    return aeCreateProcEvent(eventLoop,notifierFd(c->wakeup),AE_READABLE,cacheReplyHandler,c);
+}
+
 /*
 static void aeGetTime(long *seconds, long *milliseconds)
 {
@@ -166,32 +385,48 @@ static void aeGetTime(long *seconds, long *milliseconds)
 }
 */
 
+/* Sleep until an event or the next timer, then run both. Replies of the
+ * master and other threads wake the loop up through the eventfd of its
+ * notifiers. The clock of the loop is read once per iteration. */
 void aeProcessEvents(aeEventLoop *eventLoop)
 {
-
-        int numevents = epoll_wait(eventLoop->epfd,eventLoop->newees,AE_MAX_EPOLL_EVENTS,1);
-        if(numevents < 1) {
-            /* No waiting client */
-            usleep(10000);
-            return;
-        }
+        long long timeout = aeTimerNext(eventLoop);
+        if (rcuPending() && (timeout < 0 || timeout > AE_RECLAIM_PERIOD))
+            timeout = AE_RECLAIM_PERIOD;
+        /* Objects found in the shared index are not kept across epoll_wait,
+         * so a long sleep does not delay the writers */
+        rcuOffline();
+        int numevents = epoll_wait(eventLoop->epfd,eventLoop->newees,AE_MAX_EPOLL_EVENTS,(int)timeout);
+        rcuOnline();
+        eventLoop->now = aeMonotonicMs();
+        if(numevents < 0) numevents = 0; /* signal */
         struct epoll_event *newees = eventLoop->newees;
         struct epoll_event *fired_ee;
-        int fd;
         aeFileEvent *fe;
         while(numevents--) {
             fired_ee = newees++;
-            fd = fired_ee->data.fd;
-            fe = aeEvents + fd;
-            if (fired_ee->events & fe->ee->events & AE_READABLE) {
-                printf("Read\n");
-                readQueryFromClient(eventLoop,fd,fe->clientData);
+            fe = fired_ee->data.ptr;
+            /* Deleted by a handler of this batch */
+            if (!aeFileEventIsActive(fe)) continue;
+            if (fe->proc) {
+                fe->proc(eventLoop,fe->fd,fe->clientData,fired_ee->events);
+                continue;
+            }
+#ifdef AE_EDGE_TRIGGERED
+            clientHandleEvents(eventLoop,fe->clientData,fired_ee->events);
+#else
+            if (fired_ee->events & fe->ee.events & AE_READABLE) {
+                readQueryFromClient(eventLoop,fe->fd,fe->clientData);
             }
-            if (fired_ee->events & fe->ee->events & AE_WRITABLE) {
-                printf("Write\n");
-                sendReplyToClient(eventLoop,fd,fe->clientData);
-            }            
+            /* The client may have been freed by the read */
+            if (aeFileEventIsActive(fe) &&
+                fired_ee->events & fe->ee.events & AE_WRITABLE) {
+                sendReplyToClient(eventLoop,fe->fd,fe->clientData);
+            }
+#endif
         };
+        aeProcessTimers(eventLoop);
+        clientTableRecycle(eventLoop);
 }
 
 void aeMain(aeEventLoop *eventLoop) {    
@@ -37,6 +37,7 @@
 #include "lib/adlist.h"
 #include "ccache_config.h"
 #include "cache/cache.h"
+#include "lib/notifier.h"
 
 
 #define AE_OK 0
@@ -49,12 +50,55 @@
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
 
-/* File event structure */
+struct aeEventLoop;
+
+/* Handler of a non-client fd (wakeup notifiers, listening sockets...).
+ * Client fds are dispatched to the client handlers. */
+typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
+
+/* Timers of a loop are kept in a hierarchical timing wheel: a timer is
+ * armed, moved or cancelled in O(1), and it is embedded in its owner,
+ * so there is no allocation either. Its resolution is one tick. */
+#define AE_TIMER_TICK 10 /* ms */
+#define AE_WHEEL_ROOT_BITS 8 /* first level: 256 ticks */
+#define AE_WHEEL_BITS 6      /* next levels: 64 slots each */
+#define AE_WHEEL_LEVELS 4    /* up to 2^26 ticks, about 7 days */
+#define AE_WHEEL_ROOT_SIZE (1 << AE_WHEEL_ROOT_BITS)
+#define AE_WHEEL_SIZE (1 << AE_WHEEL_BITS)
+
+typedef void aeTimerProc(struct aeEventLoop *eventLoop, void *clientData);
+
+typedef struct aeTimer {
+    struct aeTimer *prev, *next;
+    struct aeTimer **slot;     /* NULL when not armed */
+    unsigned long long expires; /* tick */
+    aeTimerProc *proc;
+    void *clientData;
+} aeTimer;
+
+typedef struct aeTimerWheel {
+    unsigned long long clk;    /* next tick to run */
+    unsigned long count;       /* armed timers */
+    aeTimer *running;          /* timers of the tick being run */
+    unsigned long long root_map[AE_WHEEL_ROOT_SIZE/64]; /* non-empty root slots */
+    aeTimer *root[AE_WHEEL_ROOT_SIZE];
+    aeTimer *levels[AE_WHEEL_LEVELS-1][AE_WHEEL_SIZE];
+} aeTimerWheel;
+
+/* File event structure, embedded in its owner: epoll reports the event
+ * itself (ee.data.ptr), so no table indexed by fd is needed. */
 typedef struct aeFileEvent {
-    struct epoll_event *ee;
+    struct epoll_event ee;
+    int fd;           /* -1 once deleted */
+    aeFileProc *proc; /* NULL for a client */
     void *clientData;
 } aeFileEvent;
 
+/* Non-client fds of a loop: its wakeup, its cache, a listening socket */
+#define AE_MAX_PROC_EVENTS 4
+
+struct httpClient;
+
 
 /* State of an event based program */
 typedef struct aeEventLoop {
@@ -65,13 +109,20 @@ typedef struct aeEventLoop {
     int stop;
     void *apidata; /* This is used for polling API specific data */
     /* for epoll apidata = {epoll fd, array of events} */
-    list *clients;    
+    aeFileEvent procs[AE_MAX_PROC_EVENTS];
+    /* Connection table, see clientTableCreate() */
+    struct httpClient *conns;      /* maxclients slots */
+    struct httpClient *freeconns;  /* released slots */
+    struct httpClient *heldconns;  /* released since the last batch */
+    unsigned int usedconns;        /* slots handed out at least once */
+    unsigned int numclients;
+    unsigned int maxclients;
     ccache *cache;
+    notifier *wakeup; /* other threads wake the loop up (aeStop) */
+    long long now;    /* ms, monotonic, refreshed once per iteration */
+    aeTimerWheel timers;
     int myid;
     int numworkers;
-#ifdef AE_MAX_CLIENT_PER_WORKER
-    unsigned int maxclients;
-#endif
 #ifdef AE_MAX_CLIENT_IDLE_TIME
     unsigned int maxidletime;
 #endif
@@ -81,9 +132,20 @@ typedef struct aeEventLoop {
 aeEventLoop *aeCreateEventLoop(void);
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
 void aeStop(aeEventLoop *eventLoop);
-int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask, void *clientData);
-int aeModifyFileEvent(aeEventLoop *eventLoop, int fd, int mask, void *clientData);
-int aeDeleteFileEvent(aeEventLoop *eventLoop, int fd);
+void aeWakeup(aeEventLoop *eventLoop);
+void aeTimerInit(aeTimer *timer, aeTimerProc *proc, void *clientData);
+void aeTimerSet(aeEventLoop *eventLoop, aeTimer *timer, long long ms);
+void aeTimerCancel(aeEventLoop *eventLoop, aeTimer *timer);
+#define aeTimerIsArmed(timer) ((timer)->slot != NULL)
+/* Absolute time, in ms of the loop clock, at which the timer fires */
+#define aeTimerExpires(timer) ((long long)(timer)->expires*AE_TIMER_TICK)
+#define aeFileEventIsActive(fe) ((fe)->fd != -1)
+int aeCreateFileEvent(aeEventLoop *eventLoop, aeFileEvent *fe, int fd, int mask, void *clientData);
+int aeModifyFileEvent(aeEventLoop *eventLoop, aeFileEvent *fe, int mask);
+int aeDeleteFileEvent(aeEventLoop *eventLoop, aeFileEvent *fe);
+int aeCreateProcEvent(aeEventLoop *eventLoop, int fd, int mask, aeFileProc *proc, void *clientData);
+int aeDeleteProcEvent(aeEventLoop *eventLoop, int fd);
+int aeAttachCache(aeEventLoop *eventLoop, ccache *c);
 void aeProcessEvents(aeEventLoop *eventLoop);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
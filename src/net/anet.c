@@ -28,7 +28,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-
+#define _GNU_SOURCE /* accept4 */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -285,13 +285,23 @@ static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len) {
     return ANET_OK;
 }
 
-int anetTcpServer(char *err, int port, char *bindaddr)
+#define ANET_SERVER_NONE 0
+#define ANET_SERVER_REUSEPORT 1
+static int anetTcpGenericServer(char *err, int port, char *bindaddr, int flags)
 {
-    int s;
+    int s, on = 1;
     struct sockaddr_in sa;
 
     if ((s = anetCreateSocket(err,AF_INET)) == ANET_ERR)
         return ANET_ERR;
+    /* Several sockets may listen on the port, the kernel spreads the
+     * connections among them */
+    if ((flags & ANET_SERVER_REUSEPORT) &&
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        anetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+        close(s);
+        return ANET_ERR;
+    }
 
     memset(&sa,0,sizeof(sa));
     sa.sin_family = AF_INET;
@@ -307,6 +317,16 @@ int anetTcpServer(char *err, int port, char *bindaddr)
     return s;
 }
 
+int anetTcpServer(char *err, int port, char *bindaddr)
+{
+    return anetTcpGenericServer(err,port,bindaddr,ANET_SERVER_NONE);
+}
+
+int anetTcpReusePortServer(char *err, int port, char *bindaddr)
+{
+    return anetTcpGenericServer(err,port,bindaddr,ANET_SERVER_REUSEPORT);
+}
+
 int anetUnixServer(char *err, char *path, mode_t perm)
 {
     int s;
@@ -325,20 +345,23 @@ int anetUnixServer(char *err, char *path, mode_t perm)
     return s;
 }
 
-static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len) {
+static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *len, int flags) {
     int fd;
     while(1) {
         /* s is the socket listening on port 6379 */
         /* sa will be set to client address */
         /* sa and its len are output */
         /* See: http://beej.us/guide/bgnet/output/html/multipage/acceptman.html */
-        fd = accept(s,sa,len);
+        fd = accept4(s,sa,len,flags);
         if (fd == -1) {
             /* the system call was interrupted by a signal
                that was caught before a valid connection arried
             */
             if (errno == EINTR)
                 continue;
+            /* No more pending connection on a nonblocking socket */
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return ANET_ERR;
             else {
                 anetSetError(err, "accept: %s", strerror(errno));
                 return ANET_ERR;
@@ -349,23 +372,35 @@ static int anetGenericAccept(char *err, int s, struct sockaddr *sa, socklen_t *l
     return fd;
 }
 
-int anetTcpAccept(char *err, int s, char *ip, int *port) {
+static int anetTcpGenericAccept(char *err, int s, char *ip, int *port, int flags) {
     int fd;
     struct sockaddr_in sa;
     socklen_t salen = sizeof(sa);
-    if ((fd = anetGenericAccept(err,s,(struct sockaddr*)&sa,&salen)) == ANET_ERR)
+    if ((fd = anetGenericAccept(err,s,(struct sockaddr*)&sa,&salen,flags)) == ANET_ERR)
         return ANET_ERR;
 
-    if (ip) strcpy(ip,inet_ntoa(sa.sin_addr));
+    if (ip) inet_ntop(AF_INET,&sa.sin_addr,ip,INET_ADDRSTRLEN);
     if (port) *port = ntohs(sa.sin_port);
     return fd;
 }
 
+int anetTcpAccept(char *err, int s, char *ip, int *port) {
+    return anetTcpGenericAccept(err,s,ip,port,0);
+}
+
+/* The accepted socket is nonblocking already. On a nonblocking listening
+ * socket, ANET_ERR with errno EAGAIN means no more pending connection.
+ * The address of the peer is kept binary, see anetFormatAddr(). */
+int anetTcpNonBlockAccept(char *err, int s, struct sockaddr_in *sa) {
+    socklen_t salen = sizeof(*sa);
+    return anetGenericAccept(err,s,(struct sockaddr*)sa,&salen,SOCK_NONBLOCK|SOCK_CLOEXEC);
+}
+
 int anetUnixAccept(char *err, int s) {
     int fd;
     struct sockaddr_un sa;
     socklen_t salen = sizeof(sa);
-    if ((fd = anetGenericAccept(err,s,(struct sockaddr*)&sa,&salen)) == ANET_ERR)
+    if ((fd = anetGenericAccept(err,s,(struct sockaddr*)&sa,&salen,0)) == ANET_ERR)
         return ANET_ERR;
 
     return fd;
@@ -380,3 +415,11 @@ int anetPeerToString(int fd, char *ip, int *port) {
     if (port) *port = ntohs(sa.sin_port);
     return 0;
 }
+
+/* "ip:port" of an address, in a buffer of ANET_ADDR_LEN bytes at least */
+char *anetFormatAddr(const struct sockaddr_in *sa, char *buf, size_t len) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET,&sa->sin_addr,ip,sizeof(ip));
+    snprintf(buf,len,"%s:%d",ip,ntohs(sa->sin_port));
+    return buf;
+}
@@ -34,6 +34,10 @@
 #define ANET_OK 0
 #define ANET_ERR -1
 #define ANET_ERR_LEN 256
+/* "255.255.255.255:65535" */
+#define ANET_ADDR_LEN 22
+
+#include <netinet/in.h>
 
 #if defined(__sun)
 #define AF_LOCAL AF_UNIX
@@ -46,13 +50,16 @@ int anetUnixNonBlockConnect(char *err, char *path);
 int anetRead(int fd, char *buf, int count);
 int anetResolve(char *err, char *host, char *ipbuf);
 int anetTcpServer(char *err, int port, char *bindaddr);
+int anetTcpReusePortServer(char *err, int port, char *bindaddr);
 //int anetUnixServer(char *err, char *path, mode_t perm);
 int anetTcpAccept(char *err, int serversock, char *ip, int *port);
+int anetTcpNonBlockAccept(char *err, int serversock, struct sockaddr_in *sa);
 int anetUnixAccept(char *err, int serversock);
 int anetWrite(int fd, char *buf, int count);
 int anetNonBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
 int anetPeerToString(int fd, char *ip, int *port);
+char *anetFormatAddr(const struct sockaddr_in *sa, char *buf, size_t len);
 
 #endif
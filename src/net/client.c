@@ -1,4 +1,7 @@
+#include <stdlib.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include "client.h"
 #include "malloc.h"
 #include "anet.h"   /* Networking the easy way */
@@ -9,200 +12,558 @@
 
 static int _installWriteEvent(aeEventLoop *el, httpClient *c);
 static void blockClient(aeEventLoop *el, httpClient *c);
+static void clientTimeoutHandler(aeEventLoop *el, void *clientData);
+static void _resumeClient(aeEventLoop *el, httpClient *c);
 
+#ifdef AE_MAX_CLIENT_IDLE_TIME
+#define clientIdleTime(el) ((el)->maxidletime*1000LL)
+#else
+#define clientIdleTime(el) (AE_MAX_HEADER_TIME*1000LL)
+#endif
+
+/* More requests can be handled: none is blocked, the connection stays
+ * open and the queue of replies is not full */
+#define clientCanParse(c) (!(c)->blocked && !(c)->closing && \
+                           (c)->qlen < AE_MAX_CLIENT_PIPELINE)
+/* The query buffer holds bytes not parsed yet. Once parsed, the start of
+ * a request stays there until the rest of it is read. */
+#define clientPending(c) (sdslen((c)->querybuf) > (c)->req->size)
+/* Nothing is left to answer on a connection that ends */
+#define clientDone(c) ((c)->qlen == 0 && \
+                       ((c)->closing || ((c)->eof && !clientPending(c))))
+#define clientReply(c,i) ((c)->reps[((c)->qhead+(i)) % AE_MAX_CLIENT_PIPELINE])
+#define clientLastReply(c) clientReply(c,(c)->qlen-1)
+
+/* Decided once a request is parsed and told in its reply. Without an idle
+ * time, connections do not persist. */
+static void clientSetKeepAlive(httpClient *c, reply *rep, int http11, int keepalive) {
+#ifndef AE_MAX_CLIENT_IDLE_TIME
+    keepalive = 0;
+#endif
+    if (++c->numrequests >= AE_MAX_CLIENT_REQUESTS) keepalive = 0;
+    if (!keepalive) c->closing = 1;
+    replySetKeepAlive(rep,http11,keepalive);
+}
+
+/* A client has one deadline at a time, depending on what it is doing:
+ * sending a request header (AE_MAX_HEADER_TIME from its first byte),
+ * waiting for an object (AE_MAX_BLOCKED_TIME), or else being idle.
+ * The timer is only moved when the deadline gets earlier. Pushing it back,
+ * as every read or write of an active client does, is a plain store: the
+ * timer fires at the former time and is armed again for the rest. */
+static void clientSetDeadline(httpClient *c, long long deadline) {
+    c->deadline = deadline;
+    if (!aeTimerIsArmed(&c->timer) || aeTimerExpires(&c->timer) > deadline)
+        aeTimerSet(c->el,&c->timer,deadline-c->el->now);
+}
+
+/* After some progress: the header and blocked deadlines are not pushed
+ * back, the idle one is */
+static void clientRefreshDeadline(httpClient *c) {
+    if (!c->blocked && !c->inrequest)
+        clientSetDeadline(c,c->el->now+clientIdleTime(c->el));
+}
+
+
+
+/* The connection table of a worker: maxclients slots, handed out in
+ * order then recycled last released first, so that a new connection
+ * lands on a warm slot and costs no allocation. The pages of the table
+ * are only backed once used. A released slot is held until the events
+ * of the batch are processed (clientTableRecycle): events of its former
+ * socket may still follow in the batch, and must not reach the next
+ * connection to take the slot. */
+int clientTableCreate(aeEventLoop *el, unsigned int maxclients) {
+    void *conns;
+    if (posix_memalign(&conns,CLIENT_CACHE_LINE,sizeof(httpClient)*maxclients))
+        return CCACHE_ERR;
+    el->conns = conns;
+    el->freeconns = el->heldconns = NULL;
+    el->usedconns = el->numclients = 0;
+    el->maxclients = maxclients;
+    return CCACHE_OK;
+}
+
+/* Connections still open are closed */
+void clientTableRelease(aeEventLoop *el) {
+    unsigned int i;
+    int j;
+    for (i = 0; i < el->usedconns; i++) {
+        httpClient *c = el->conns+i;
+        if (aeFileEventIsActive(&c->fe)) freeClient(c);
+        if (c->req) requestFree(c->req);
+        if (c->querybuf) sdsfree(c->querybuf);
+        for (j = 0; j < AE_MAX_CLIENT_PIPELINE; j++)
+            if (c->reps[j]) replyFree(c->reps[j]);
+    }
+    free(el->conns);
+    el->conns = el->freeconns = el->heldconns = NULL;
+    el->usedconns = 0;
+}
 
+static httpClient *_takeSlot(aeEventLoop *el) {
+    httpClient *c;
+    if ((c = el->freeconns) != NULL) {
+        el->freeconns = c->nextfree;
+        poolCountHit(&el->cache->clients);
+        return c;
+    }
+    if (el->usedconns == el->maxclients) return NULL;
+    poolCountMiss(&el->cache->clients);
+    cacheAddConnectionMemory(el->cache,sizeof(httpClient));
+    c = el->conns+el->usedconns++;
+    c->req = NULL;
+    c->querybuf = NULL;
+    memset(c->reps,0,sizeof(c->reps));
+    return c;
+}
+
+static void _releaseSlot(aeEventLoop *el, httpClient *c) {
+    c->fe.fd = -1;
+    c->nextfree = el->heldconns;
+    el->heldconns = c;
+}
 
-httpClient *createClient(aeEventLoop *el, int fd, const char* ip, int port) {
-    httpClient *c = malloc(sizeof(*c));
-    /* Set the socket to nonblock as the default state set by the kernel is blocking or waiting */
-    anetNonBlock(NULL,fd);
+/* Once the events of a batch are processed, the slots released meanwhile
+ * can be taken again */
+void clientTableRecycle(aeEventLoop *el) {
+    httpClient *c;
+    while ((c = el->heldconns) != NULL) {
+        el->heldconns = c->nextfree;
+        c->nextfree = el->freeconns;
+        el->freeconns = c;
+    }
+}
+
+/* Returns NULL, without closing fd, when the table is full (errno EMFILE)
+ * or the socket cannot be registered. */
+httpClient *createClient(aeEventLoop *el, int fd, const struct sockaddr_in *addr) {
+    httpClient *c = _takeSlot(el);
+    if (c == NULL) {
+        errno = EMFILE;
+        return NULL;
+    }
+    if (c->req == NULL) {
+        c->req = requestCreate();
+        cacheAddConnectionMemory(el->cache,malloc_usable_size(c->req));
+    }
+    if (c->querybuf == NULL) c->querybuf = sdsempty();
+    /* The socket is accepted nonblocking, in the thread of el */
     anetTcpNoDelay(NULL,fd);
-    c->fd = fd;
-    c->rep = replyCreate();
+    c->el = el;
+    c->qhead = c->qlen = 0;
     c->bufpos = 0;
-    c->req = requestCreate();
-    c->lastinteraction = time(NULL);
-    c->ip = strdup(ip);
-    c->port = port;
-    c->elNode = NULL;
+    c->inrequest = 0;
     c->blocked = 0;
-    c->el = el;
-    c->elNode = listAddNodeTailGetNode(el->clients,c);
-    if (aeCreateFileEvent(el, fd, AE_READABLE, c) == AE_ERR)
+    c->closing = 0;
+    c->eof = 0;
+    c->numrequests = 0;
+    c->ceList = NULL;
+    c->addr = *addr;
+#ifdef AE_EDGE_TRIGGERED
+    c->readable = c->writable = c->rdhup = 0;
+    if (aeCreateFileEvent(el,&c->fe,fd,AE_READABLE|AE_WRITABLE|EPOLLRDHUP|EPOLLET,c) == AE_ERR)
+#else
+    if (aeCreateFileEvent(el,&c->fe,fd,AE_READABLE,c) == AE_ERR)
+#endif
     {
-        printf("create client fail\n");
-        freeClient(c);
+        _releaseSlot(el,c);
         return NULL;
     }
+    el->numclients++;
+    aeTimerInit(&c->timer,clientTimeoutHandler,c);
+    clientSetDeadline(c,el->now+clientIdleTime(el));
     return c;
 }
 
 
+/* The reply of the next request, at the tail of the queue. Replies are
+ * kept by the slot, reset once sent. */
+static reply *_queueReply(httpClient *c) {
+    int i = (c->qhead+c->qlen) % AE_MAX_CLIENT_PIPELINE;
+    if (c->reps[i] == NULL) {
+        c->reps[i] = replyCreate();
+        poolCountMiss(&c->el->cache->replies);
+        cacheAddConnectionMemory(c->el->cache,malloc_usable_size(c->reps[i]));
+    }
+    else poolCountHit(&c->el->cache->replies);
+    c->qlen++;
+    return c->reps[i];
+}
+
+/* Handle the requests of buf in order, as long as the client can take
+ * more: a request is blocked, the connection is closing or the queue is
+ * full. nprocessed is set to the bytes of the requests handled, the rest
+ * is left for later: the request parsed from the buffer, without copy,
+ * must begin it when the next bytes are received (see requestParse()).
+ * The replies ready are written at once. Returns CCACHE_ERR when the
+ * client has been freed. */
+static int _processInputBuffer(aeEventLoop *el, httpClient *c, char *buf, size_t len,
+                               size_t *nprocessed) {
+    size_t pos = 0;
+    while (pos < len && clientCanParse(c)) {
+        request_parse_state state;
+        reply *rep;
+        if (!c->inrequest) {
+            /* Not extended by the next reads: a slow header is cut short */
+            c->inrequest = 1;
+            clientSetDeadline(c,el->now+AE_MAX_HEADER_TIME*1000LL);
+        }
+        state = requestParse(c->req,buf+pos,len-pos);
+        if (state == parse_not_completed) break;
+        c->inrequest = 0;
+        rep = _queueReply(c);
+        if (state == parse_completed) {
+            int handle_result;
+            clientSetKeepAlive(c,rep,requestHttp11(c->req),requestKeepAlive(c->req));
+            handle_result = requestHandle(c->req,rep,el->cache,c);
+            if(handle_result == HANDLER_BLOCK){
+                blockClient(el,c);
+                clientSetDeadline(c,el->now+AE_MAX_BLOCKED_TIME*1000LL);
+            }
+            /* For HANDLE_OK there is nothing to do */
+            else if(handle_result == HANDLER_ERR) requestHandleError(c->req,rep);
+            else if(handle_result == HANDLER_BUSY) requestHandleBusy(c->req,rep);
+        } else {
+            /* The rest of the stream cannot be parsed */
+            clientSetKeepAlive(c,rep,1,0);
+            requestHandleError(c->req,rep);
+        }
+        pos += c->req->size;
+        requestReset(c->req);
+    }
+    *nprocessed = pos;
+    clientRefreshDeadline(c);
+    if (clientReadyReplies(c)) return _installWriteEvent(el,c);
+    return CCACHE_OK;
+}
+
+/* Process the requests kept while the client could not take them */
+static int _processQueryBuffer(aeEventLoop *el, httpClient *c) {
+    size_t n;
+    if (_processInputBuffer(el,c,c->querybuf,sdslen(c->querybuf),&n) != CCACHE_OK)
+        return CCACHE_ERR;
+    c->querybuf = sdsrange(c->querybuf,n,-1);
+    if (clientDone(c)) {
+        freeClient(c);
+        return CCACHE_ERR;
+    }
+    return CCACHE_OK;
+}
+
+/* Process what was just read, after the requests kept if any, and keep
+ * what the client cannot take yet */
+static int _processReadBuffer(aeEventLoop *el, httpClient *c, char *buf, size_t nread) {
+    size_t n;
+    if (sdslen(c->querybuf)) {
+        c->querybuf = sdscatlen(c->querybuf,buf,nread);
+        return _processQueryBuffer(el,c);
+    }
+    if (_processInputBuffer(el,c,buf,nread,&n) != CCACHE_OK) return CCACHE_ERR;
+    if (n < nread) c->querybuf = sdscatlen(c->querybuf,buf+n,nread-n);
+    return CCACHE_OK;
+}
+
+/* The peer will not send more: answer what it sent, then close.
+ * Returns CCACHE_ERR when the client has been freed. */
+static int _endOfRequests(httpClient *c) {
+    c->eof = 1;
+    if (clientDone(c)) {
+        ulog(CCACHE_VERBOSE, "End of client request");
+        freeClient(c);
+        return CCACHE_ERR;
+    }
+    return CCACHE_OK;
+}
+
+/* Write the ready replies, from c->bufpos on, with a single writev.
+ * A body sent from its file ends the vector: its header goes with
+ * MSG_MORE, to leave with the first bytes of the body, which are then
+ * sent by sendfile. Replies fully sent are reset and leave the queue. */
+static ssize_t _writeReplies(httpClient *c) {
+    struct iovec iov[AE_MAX_CLIENT_PIPELINE*REPLY_MAX_IOVEC], *v = iov;
+    size_t lens[AE_MAX_CLIENT_PIPELINE], skip = c->bufpos, sent, flen = 0;
+    int ready = clientReadyReplies(c), cnt = 0, i, j;
+    ssize_t nwritten;
+    if (ready == 0) return 0;
+    for (i = 0; i < ready && flen == 0; i++) {
+        int parts = replyToIovec(clientReply(c,i),iov+cnt);
+        for (lens[i] = 0, j = 0; j < parts; j++) lens[i] += iov[cnt+j].iov_len;
+        cnt += parts;
+        flen = replyFileLen(clientReply(c,i));
+        lens[i] += flen;
+    }
+    ready = i;
+    if (ready == 1 && flen && skip >= lens[0]-flen) {
+        off_t offset = clientReply(c,0)->offset+skip-(lens[0]-flen);
+        nwritten = sendfile(c->fe.fd,clientReply(c,0)->cobj->fd,&offset,lens[0]-skip);
+        if (nwritten == 0) {
+            errno = EIO; /* the file is shorter than it was */
+            return -1;
+        }
+    }
+    else {
+        while (skip >= v->iov_len) {
+            skip -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        v->iov_base = (char*)v->iov_base+skip;
+        v->iov_len -= skip;
+        if (flen) {
+            struct msghdr msg;
+            memset(&msg,0,sizeof(msg));
+            msg.msg_iov = v;
+            msg.msg_iovlen = cnt;
+            nwritten = sendmsg(c->fe.fd,&msg,MSG_MORE);
+        }
+        else {
+            nwritten = (cnt == 1) ? write(c->fe.fd,v->iov_base,v->iov_len)
+                                  : writev(c->fe.fd,v,cnt);
+        }
+    }
+    if (nwritten <= 0) return nwritten;
+    sent = c->bufpos+nwritten;
+    for (i = 0; i < ready && sent >= lens[i]; i++) {
+        sent -= lens[i];
+        replyReset(clientReply(c,0));
+        c->qhead = (c->qhead+1) % AE_MAX_CLIENT_PIPELINE;
+        c->qlen--;
+    }
+    c->bufpos = sent;
+    return nwritten;
+}
+
+#ifndef AE_EDGE_TRIGGERED
+/* Level-triggered, the socket is watched for reads while the client can
+ * take requests, and for writes while replies are ready. Returns
+ * CCACHE_ERR when the client has been freed. */
+static int _updateEvents(aeEventLoop *el, httpClient *c) {
+    unsigned int mask = 0;
+    if (clientCanParse(c) && !c->eof) mask |= AE_READABLE;
+    if (clientReadyReplies(c)) mask |= AE_WRITABLE;
+    if (mask == c->fe.ee.events) return CCACHE_OK;
+    if (aeModifyFileEvent(el,&c->fe,mask) == AE_ERR) {
+        freeClient(c);
+        return CCACHE_ERR;
+    }
+    return CCACHE_OK;
+}
+
 void readQueryFromClient(aeEventLoop *el, int fd, httpClient *c) {
     char buf[CCACHE_IOBUF_LEN];
     int nread;
     nread = read(fd, buf, CCACHE_IOBUF_LEN);
     if (nread == -1) {
-        if (errno == EAGAIN) { /* try again */
-            nread = 0;
-        } else {
-            ulog(CCACHE_VERBOSE, "Reading from client: %s",strerror(errno));
+        if (errno == EAGAIN) return;
+        ulog(CCACHE_VERBOSE, "Reading from client: %s",strerror(errno));
+        freeClient(c);
+        return;
+    } else if (nread == 0) {
+        if (_endOfRequests(c) == CCACHE_OK) _updateEvents(el,c);
+        return;
+    }
+    if (_processReadBuffer(el,c,buf,nread) == CCACHE_OK)
+        _updateEvents(el,c);
+}
+
+/* Write as long as the socket takes it, rather than once per event */
+void sendReplyToClient(aeEventLoop *el, int fd, httpClient *c) {
+    CCACHE_NOTUSED(fd);
+    while (clientReadyReplies(c)) {
+        if (_writeReplies(c) == -1) {
+            if (errno == EAGAIN) break;
+            if (errno == EINTR) continue;
+            ulog(CCACHE_VERBOSE, "Error writing to client: %s", strerror(errno));
             freeClient(c);
             return;
         }
-    } else if (nread == 0) {
-        ulog(CCACHE_VERBOSE, "End of client request");
+    }
+    clientRefreshDeadline(c);
+    if (clientDone(c)) {
         freeClient(c);
         return;
     }
-    if (nread>0) {
-        printf("Read Request: %.2lf \n", (double)(clock()));
-        c->lastinteraction = time(NULL);
-        listMoveNodeToTail(el->clients,c->elNode);
-        /* NOTICE: nread or nread-1 */
-        switch(requestParse(c->req,buf,buf+nread)){
-        case parse_not_completed:
-            break;
-        case parse_completed:
-        {            
-            int handle_result = requestHandle(c->req,c->rep,el->cache,c);
-            if(handle_result == HANDLER_BLOCK){
-                blockClient(el,c);
-            }
-            else {
-                if (_installWriteEvent(el, c) != CCACHE_OK) return;
-                printf("Install Write: %.2lf\n", (double)(clock()));
-                /* For HANDLE_OK there is nothing to do */
-                if(handle_result == HANDLER_ERR) requestHandleError(c->req,c->rep);
-            }
-                break;
-        }
-        case parse_error:
-            if (_installWriteEvent(el, c) != CCACHE_OK) {
-                return;
-            }
-            requestHandleError(c->req,c->rep);
-            break;
-        default:
-            break;
-        };
+    /* Requests kept while the queue was full */
+    if (clientCanParse(c) && clientPending(c) &&
+        _processQueryBuffer(el,c) != CCACHE_OK)
+        return;
+    _updateEvents(el,c);
+}
+
+/* Level-triggered, the events were updated with the reply */
+static void _resumeClient(aeEventLoop *el, httpClient *c) {
+    CCACHE_NOTUSED(el);
+    CCACHE_NOTUSED(c);
+}
+
+#else
+/* Edge-triggered: the socket is registered once for reads and writes, and
+ * the client keeps track of what the socket is ready for. A readiness is
+ * only cleared by EAGAIN (or a short read when the peer did not close),
+ * as epoll does not report it again until then. */
+
+/* Read once and process what was read */
+static int _readFromClient(aeEventLoop *el, httpClient *c) {
+    char buf[CCACHE_IOBUF_LEN];
+    int nread;
+    nread = read(c->fe.fd, buf, CCACHE_IOBUF_LEN);
+    if (nread == -1) {
+        if (errno == EAGAIN) c->readable = 0;
+        if (errno == EAGAIN || errno == EINTR) return CCACHE_OK;
+        ulog(CCACHE_VERBOSE, "Reading from client: %s",strerror(errno));
+        freeClient(c);
+        return CCACHE_ERR;
+    } else if (nread == 0) {
+        c->readable = 0;
+        return _endOfRequests(c);
     }
+    /* The socket is empty, unless the peer closed it: read the end */
+    if (nread < CCACHE_IOBUF_LEN && !c->rdhup) c->readable = 0;
+    return _processReadBuffer(el,c,buf,nread);
 }
 
-void sendReplyToClient(aeEventLoop *el, int fd, httpClient *c) {
-    int nwritten = 0;
-
-    CCACHE_NOTUSED(el);    
-    if(c->rep) {
-        sds obuf = replyToBuffer(c->rep);
-        int towrite = sdslen(obuf) - c->bufpos;
-        nwritten = write(fd, obuf+c->bufpos,towrite);
-        /* Content */
-        if (nwritten == -1) {
+/* Write until the ready replies are sent or the socket is full. */
+static int _writeToClient(httpClient *c) {
+    while (c->writable && clientReadyReplies(c)) {
+        if (_writeReplies(c) == -1) {
             if (errno == EAGAIN) {
-                nwritten = 0;
-            } else {
-                ulog(CCACHE_VERBOSE,
-                     "Error writing to client: %s", strerror(errno));
-                freeClient(c);
-                return;
+                c->writable = 0;
+                break;
             }
-        }
-        c->lastinteraction = time(NULL);
-        listMoveNodeToTail(el->clients,c->elNode);
-        if(nwritten<towrite) {
-            c->bufpos += nwritten;
-        }
-        else {
-#ifdef AE_MAX_CLIENT_IDLE_TIME
-            resetClient(c);
-#else
+            if (errno == EINTR) continue;
+            ulog(CCACHE_VERBOSE, "Error writing to client: %s", strerror(errno));
             freeClient(c);
-#endif
-            aeModifyFileEvent(el,c->fd,AE_READABLE,c);
-            printf("Send Reply: %.2lf\n", (double)(clock()));
+            return CCACHE_ERR;
+        }
+    }
+    clientRefreshDeadline(c);
+    if (clientDone(c)) {
+        freeClient(c);
+        return CCACHE_ERR;
+    }
+    return CCACHE_OK;
+}
+
+/* Once a reply is sent out of the events of the client (the object came
+ * from the master), the socket or the query buffer may already hold the
+ * next requests: have epoll report the socket again. */
+static void _resumeClient(aeEventLoop *el, httpClient *c) {
+    if (!clientCanParse(c) || (!c->readable && !clientPending(c))) return;
+    if (aeModifyFileEvent(el,&c->fe,AE_READABLE|AE_WRITABLE|EPOLLRDHUP|EPOLLET) == AE_ERR)
+        freeClient(c);
+}
+
+/* Serve the client as far as its socket allows: the ready replies first,
+ * then the requests kept, then the next ones. */
+void clientHandleEvents(aeEventLoop *el, httpClient *c, int mask) {
+    if (mask & (AE_WRITABLE|EPOLLERR|EPOLLHUP)) c->writable = 1;
+    if (mask & (AE_READABLE|EPOLLRDHUP|EPOLLERR|EPOLLHUP)) c->readable = 1;
+    if (mask & (EPOLLRDHUP|EPOLLHUP)) c->rdhup = 1;
+    while (1) {
+        if (clientReadyReplies(c) && c->writable && _writeToClient(c) != CCACHE_OK)
+            return;
+        if (!clientCanParse(c)) return;
+        if (clientPending(c)) {
+            if (_processQueryBuffer(el,c) != CCACHE_OK) return;
+            continue;
         }
+        if (!c->readable) return;
+        if (_readFromClient(el,c) != CCACHE_OK) return;
     }
 }
+#endif
 
+/* The slot keeps the request, the replies and the query buffer, reset,
+ * for the next client */
 void freeClient(httpClient *c) {
-    aeDeleteFileEvent(c->el,c->fd);
-    close(c->fd);
-    /* Release memory */
-    if(c->ip) free(c->ip);
-    replyFree(c->rep);
-    requestFree(c->req);
-    if(c->elNode) listDelNode(c->el->clients,c->elNode);
-    free(c);
+    aeEventLoop *el = c->el;
+    int fd = c->fe.fd;
+    /* Do not leave a dangling client in the waiting list of a cache entry */
+    if (c->blocked) {
+        listNode *ln = listSearchKey(c->ceList,c);
+        if(ln) cacheDelWaitingClient(el->cache,c->ceList,ln);
+        c->blocked = 0;
+    }
+    aeTimerCancel(el,&c->timer);
+    aeDeleteFileEvent(el,&c->fe);
+    close(fd);
+    resetClient(c);
+    el->numclients--;
+    _releaseSlot(el,c);
 }
 
 
 
-/* resetClient prepare the client to process the next command */
+/* resetClient drops the requests in progress and the queued replies */
 void resetClient(httpClient *c) {
+    while (c->qlen) {
+        replyReset(clientReply(c,0));
+        c->qhead = (c->qhead+1) % AE_MAX_CLIENT_PIPELINE;
+        c->qlen--;
+    }
+    c->qhead = 0;
     c->bufpos = 0;
-    replyReset(c->rep);
+    c->inrequest = 0;
     requestReset(c->req);
+    sdsclear(c->querybuf);
 }
 
 
-#ifdef AE_MAX_CLIENT_IDLE_TIME
-int closeTimedoutClients(aeEventLoop *el) {    
-    if(el->myid != 0) {
-        httpClient *c;
-        int deletedNodes = 0;
-        time_t now = time(NULL);
-        listIter li;
-        listNode *ln;
-
-        listRewind(el->clients,&li);
-        while ((ln = listNext(&li)) != NULL) {
-            c = listNodeValue(ln);
-            if (el->maxidletime &&
-                    (now - c->lastinteraction > el->maxidletime))
-            {                
-                /* the client is waiting for reply */
-                if (c->blocked) {
-                    /* This situation happens when request_handler time exceeds client timeout.
-                     * Client timeout is typically 30 seconds and
-                     * Request_handler rarely consumes more than 1 second.
-                     * This rare case has a very small role in overall performance.                    
-                     */
-                    listNode *ln = listSearchKey(c->ceList,c);
-                    if(ln) listDelNode(c->ceList,ln);
-                }
-                freeClient(c);
-                deletedNodes++;
-            }
-            else break;
-        }
-        return deletedNodes;
-    }
-    return 0;
-}
-
-#endif
 
 void blockClient(aeEventLoop *el, httpClient *c)
 {
     (void)el;
     /*Problem with Client Connection: aeDeleteFileEvent(el,c->fd,AE_READABLE);*/
-    c->blocked = 1;    
+    c->blocked = 1;
+}
+
+/* Called once the client has been removed from the waiting list. The
+ * object answers the last request queued. */
+void unblockClient(httpClient *c, objSds *obj)
+{
+    c->blocked = 0;
+    c->ceList = NULL;
+    replySetCachedObject(clientLastReply(c),obj);
+    clientRefreshDeadline(c);
+    if (_installWriteEvent(c->el,c) == CCACHE_OK) _resumeClient(c->el,c);
 }
 
-void unblockClient(httpClient *c, sds obuf)
-{    
-    if(_installWriteEvent(c->el,c) == CCACHE_OK)
+/* The deadline of the client is over, unless it was pushed back since the
+ * timer was armed. A client waiting too long for its object is answered
+ * BUSY, other ones are closed. */
+static void clientTimeoutHandler(aeEventLoop *el, void *clientData) {
+    httpClient *c = clientData;
+    if (el->now < c->deadline) {
+        aeTimerSet(el,&c->timer,c->deadline-el->now);
+        return;
+    }
+    if (c->blocked) {
+        listNode *ln = listSearchKey(c->ceList,c);
+        if(ln) cacheDelWaitingClient(el->cache,c->ceList,ln);
         c->blocked = 0;
-    c->rep->obuf = obuf;
+        c->ceList = NULL;
+        requestHandleBusy(c->req,clientLastReply(c));
+        clientRefreshDeadline(c);
+        if (_installWriteEvent(el,c) == CCACHE_OK) _resumeClient(el,c);
+        return;
+    }
+#if (CCACHE_LOG_LEVEL <= CCACHE_VERBOSE)
+    char addr[ANET_ADDR_LEN];
+    ulog(CCACHE_VERBOSE,"Closing idle client %s",anetFormatAddr(&c->addr,addr,sizeof(addr)));
+#endif
+    freeClient(c);
 }
 
-/* Set the event loop to listen for write events on the client's socket.
- * Typically gets called every time a reply is built. */
+/* Have the ready replies written. Typically gets called every time replies
+ * are built. Edge-triggered, they are written right away if the socket is
+ * ready. Returns CCACHE_ERR when the client has been freed. */
 int _installWriteEvent(aeEventLoop *el, httpClient *c) {
-    if (c->fd <= 0) return CCACHE_ERR;
-    if (aeModifyFileEvent(el,c->fd,AE_WRITABLE,c) == AE_ERR)
-        return CCACHE_ERR;
+#ifdef AE_EDGE_TRIGGERED
+    CCACHE_NOTUSED(el);
+    if (c->writable) return _writeToClient(c);
     return CCACHE_OK;
+#else
+    return _updateEvents(el,c);
+#endif
 }
-
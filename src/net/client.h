@@ -13,6 +13,7 @@
 #include "http/reply.h"
 #include "http/request.h"
 #include "http_server.h"
+#include "anet.h"
 
 extern httpServer server;
 
@@ -20,43 +21,63 @@ extern httpServer server;
  * Data types
  *----------------------------------------------------------------------------*/
 
+/* A slot of the connection table of a worker. Slots are cache-line
+ * aligned, hot fields first, and are reused as they are: a connection
+ * keeps the request, replies and buffers of the former ones. */
+#define CLIENT_CACHE_LINE 64
+
+/* Requests of a connection are handled in order, pipelined ones included:
+ * their replies are queued until sent, at most AE_MAX_CLIENT_PIPELINE.
+ * A request waiting for its object (blocked) is the last one queued, the
+ * next ones are parsed once it is answered. */
 typedef struct httpClient {
-    int fd;    
-    char *ip;
-    int port;
-    reply *rep;
-    int bufpos;
-    request *req;
-    time_t lastinteraction; /* time of the last interaction, used for timeout */
-    listNode *elNode; /* point to the position this clients in its eventLoop's list of clients*/
-    int blocked;
+    aeFileEvent fe;     /* fe.fd is the socket */
     aeEventLoop *el;
+    int qhead;          /* first queued reply */
+    int qlen;           /* queued replies, the blocked one included */
+    size_t bufpos;      /* bytes of the first reply already sent */
+    int inrequest;      /* the header of a request is being read */
+#ifdef AE_EDGE_TRIGGERED
+    int readable;       /* the socket may hold unread data */
+    int writable;       /* the socket may accept more data */
+    int rdhup;          /* the peer closed its side */
+#endif
+    int blocked;
+    int closing;        /* closed once the queued replies are sent */
+    int eof;            /* the peer sent all its requests */
+    unsigned int numrequests;
+    request *req;       /* request being parsed */
+    sds querybuf;       /* read, not parsed yet (pipelined requests) */
     list *ceList; /* point to the position of this clients in cache waiting list */
-} httpClient;
-
-typedef struct {
-    int fd;
-    char *ip;
-    int port;
-    int wasAccepted;
-} clientEndpoint;
+    long long deadline; /* ms of the loop clock, see clientSetDeadline() */
+    aeTimer timer;
+    reply *reps[AE_MAX_CLIENT_PIPELINE]; /* ring of queued replies */
+    struct httpClient *nextfree; /* link in the released slots */
+    struct sockaddr_in addr;     /* peer, see anetFormatAddr() */
+} __attribute__((aligned(CLIENT_CACHE_LINE))) httpClient;
 
+/* Replies that can be written: all the queued ones but a blocked one */
+#define clientReadyReplies(c) ((c)->qlen-(c)->blocked)
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
  *----------------------------------------------------------------------------*/
 
-httpClient *createClient(aeEventLoop *el, int fd, const char *ip, int port);
-#ifdef AE_MAX_CLIENT_IDLE_TIME
-int closeTimedoutClients(aeEventLoop *el);
-#endif
+int clientTableCreate(aeEventLoop *el, unsigned int maxclients);
+void clientTableRelease(aeEventLoop *el);
+void clientTableRecycle(aeEventLoop *el);
+httpClient *createClient(aeEventLoop *el, int fd, const struct sockaddr_in *addr);
 
 void freeClient(httpClient *c);
 void resetClient(httpClient *c);
+#ifdef AE_EDGE_TRIGGERED
+void clientHandleEvents(aeEventLoop *el, httpClient *c, int mask);
+#else
 void sendReplyToClient(aeEventLoop *el, int fd, httpClient *c);
 void readQueryFromClient(aeEventLoop *el, int fd, httpClient *c);
+#endif
 
-void unblockClient(httpClient *c, sds obuf);
+void unblockClient(httpClient *c, objSds *obj);
 
 /*
 Use other mem allocator? NO
@@ -2,111 +2,128 @@
 #include <pthread.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include "cache/mcache.h"
 #include "cache/cache.h"
 #include "net/anet.h"
+#include "lib/rcu.h"
 #include "client.h"
 
 void *aeWorkerThread(void *eventloop)
 {
    aeEventLoop *el = eventloop;
+   /* Workers read the shared index of the master shards */
+   if (rcuRegisterReader() != RCU_OK) {
+      printf("ERROR: too many rcu readers\n");
+      exit(-1);
+   }
    aeMain(el);
+   rcuUnregisterReader();
    aeDeleteEventLoop(el);
-   free(el);
    pthread_exit(NULL);
 }
 
-static void acceptTcpHandler() {
-    int cport, cfd;
-    char cip[128];
-    int sfd = server.sfd;
-    httpWorker *workers = server.workers;
-
-    /* Accept new connection */
+/* Accept the pending connections of a listening socket of the worker, until
+ * the backlog is empty. The worker that accepts a connection serves it. */
+static void acceptTcpHandler(aeEventLoop *el, int sfd, void *clientData, int mask) {
+    int cfd;
+    struct sockaddr_in caddr;
     char neterr[ANET_ERR_LEN];
+    AE_NOTUSED(clientData);
+    AE_NOTUSED(mask);
+
     while(1) {
-        cfd = anetTcpAccept(neterr, sfd, cip, &cport);
-        if (cfd == AE_ERR) {
-            ulog(CCACHE_WARNING,"Accepting client connection: %s", neterr);
+        cfd = anetTcpNonBlockAccept(neterr, sfd, &caddr);
+        if (cfd == ANET_ERR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ulog(CCACHE_WARNING,"Accepting client connection: %s", neterr);
             return;
         }
-        ulog(CCACHE_DEBUG,"Accepted %s:%d", cip, cport);
-        /* Create a new client and add it to server.clients list */
-        /* NOTICE: must be called via function */
-        httpClient *c;
-        /* NOTICE: not fd but cfd. */
-        /* This el is from the master.
-         * We may Change el to one from workers.
-         */
-        printf("accept %d %.2lf \n",cfd,(double)(clock()));
-#if (CCACHE_NUM_WORKER_THREADS == 4)
-        httpWorker nextEL = workers[cfd&0x03];
-#else
-        static int numworkers = server.numworkers;
-        httpWorker nextEL = workers[cfd%numworkers];
-#endif
-        if ((c = createClient(nextEL,cfd,cip,cport)) == NULL) {            
-            ulog(CCACHE_WARNING,"No resource for new client %s",strerror(errno));
-            return;
-        }
-    #ifdef AE_MAX_CLIENT_PER_WORKER
-        /* Check for max client */
-        if (nextEL->maxclients && listLength(nextEL->clients) > nextEL->maxclients) {
-            static char *max_client_err = "-ERR MAX CLIENT\r\n";
-            /* That's a best effort error message, don't check write errors */
-            if (write(cfd,max_client_err,17) == -1) {
-                /* Nothing to do, Just to avoid the warning... */
+        if (createClient(el,cfd,&caddr) == NULL) {
+            if (errno == EMFILE) {
+                /* The connection table of the worker is full.
+                 * That's a best effort error message, don't check write errors */
+                static char *max_client_err = "-ERR MAX CLIENT\r\n";
+                if (write(cfd,max_client_err,17) == -1) {
+                    /* Nothing to do, Just to avoid the warning... */
+                }
+            } else {
+                ulog(CCACHE_WARNING,"No resource for new client %s",strerror(errno));
             }
-            freeClient(c);
-            return;
+            close(cfd);
         }
-    #endif
     }
 }
 
-void initServer(char *bindaddr, int port)
+static int _listen(int port, char *bindaddr, int reuseport) {
+    char neterr[ANET_ERR_LEN];
+    int sfd = reuseport ? anetTcpReusePortServer(neterr,port,bindaddr)
+                        : anetTcpServer(neterr,port,bindaddr);
+    if (sfd == ANET_ERR || anetNonBlock(neterr,sfd) == ANET_ERR) {
+        printf("ERROR: Opening port %d: %s\n",port, neterr);
+        exit(1);
+    }
+    return sfd;
+}
+
+/* Each worker accepts its own connections, so no thread caps the accept
+ * rate and a worker only takes new clients when it is able to run:
+ * - HTTP_ACCEPT_REUSEPORT: one listening socket per worker (SO_REUSEPORT),
+ *   the kernel spreads the connections among the sockets;
+ * - HTTP_ACCEPT_EXCLUSIVE: one shared socket, registered by every worker
+ *   with EPOLLEXCLUSIVE, so a connection wakes up one idle worker only.
+ * The calling thread waits for the workers. */
+void initServer(char *bindaddr, int port, int accept_mode)
 {
     server.sport = port;    
     server.sip = strdup(bindaddr);
     server.numworkers = CCACHE_NUM_WORKER_THREADS;
     server.workers = malloc(sizeof(aeEventLoop*)*server.numworkers);
-    int i;
-    /* Events with mask == AE_NONE are not set. So let's initialize the
-     * vector with it. */
-    for (i = 0; i < AE_FD_SET_SIZE; i++) {
-        struct epoll_event *ee = malloc(sizeof(struct epoll_event));
-        ee->data.u64 = 0; /* suppress union cause valgrin check warning */
-        ee->data.fd = i;
-        ee->events = AE_UNACTIVATED;
-        server.events[i].ee = ee;
-    }
-
+    server.accept_mode = accept_mode;
     pthread_t threads[CCACHE_NUM_WORKER_THREADS];
     int rc;
     long t;
     int numworkers = server.numworkers;
+    int reuseport = (accept_mode == HTTP_ACCEPT_REUSEPORT);
+    int sfd = server.sfd = reuseport ? -1 : _listen(port,bindaddr,0);
+    /* SO_REUSEPORT lets another process of the same user bind the port too
+     * and share its connections: a plain socket is bound first, so that
+     * starting on a port already in use fails as it should */
+    if (reuseport) close(_listen(port,bindaddr,0));
+    /* Sockets are registered before the workers run */
     for(t=0; t < numworkers; t++){
       httpWorker worker = aeCreateEventLoop();
+      if (worker == NULL) {
+         printf("ERROR: cannot create worker %ld\n", t);
+         exit(-1);
+      }
       worker->myid = t+1;
-      worker->cache = cacheAddSlave(worker);
+      if (aeAttachCache(worker,cacheAddSlave(worker)) == AE_ERR) {
+         printf("ERROR: cannot watch the cache of worker %ld\n", t);
+         exit(-1);
+      }
+      if (reuseport) sfd = _listen(port,bindaddr,1);
+      if (aeCreateProcEvent(worker,sfd,AE_READABLE|(reuseport ? 0 : EPOLLEXCLUSIVE),
+                            acceptTcpHandler,NULL) == AE_ERR) {
+         printf("ERROR: cannot accept in worker %ld: %s\n", t, strerror(errno));
+         exit(-1);
+      }
       server.workers[t] = worker;
-      rc = pthread_create(&threads[t], NULL, aeWorkerThread, worker);
+    }
+    cacheMasterSetBaseline();
+    for(t=0; t < numworkers; t++){
+      rc = pthread_create(&threads[t], NULL, aeWorkerThread, server.workers[t]);
       if (rc){
          printf("ERROR: return code from pthread_create() is %d\n", rc);
          exit(-1);
       }
-   }
-
-   char neterr[ANET_ERR_LEN];
-   int sfd = anetTcpServer(neterr,port,bindaddr);
-   if (sfd == ANET_ERR) {
-       printf("ERROR: Opening port %d: %s",port, neterr);
-       exit(1);
-   }
-   if (sfd > 0)
-       printf("The server is now ready to accept connections on port %d\n",port);
-   server.sfd = sfd;
-   acceptTcpHandler();
+    }
+    printf("The server is now ready to accept connections on port %d (%s)\n",port,
+           reuseport ? "reuseport" : "exclusive");
+    for(t=0; t < numworkers; t++)
+      pthread_join(threads[t],NULL);
 }
 
 unsigned int numConcurrentFD() {
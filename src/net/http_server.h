@@ -5,18 +5,28 @@
 
 typedef aeEventLoop* httpWorker;
 
+/* How the workers accept connections, see initServer() */
+#define HTTP_ACCEPT_REUSEPORT 0
+#define HTTP_ACCEPT_EXCLUSIVE 1
+
+/* Shared socket registered by several epoll instances, one of them is woken
+ * up per connection (Linux 4.5) */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
 typedef struct {
     int sport;
     char *sip;
-    int sfd;
+    int sfd;            /* shared listening socket, -1 with reuseport */
+    int accept_mode;
     httpWorker *workers;
     int numworkers;
-    aeFileEvent events[AE_FD_SET_SIZE]; /* Registered events */
 } httpServer;
 
 httpServer server;
 
-void initServer(char *bindaddr, int port);
+void initServer(char *bindaddr, int port, int accept_mode);
 unsigned int numConcurrentFD();
 
 #endif // HTTP_SERVER_H
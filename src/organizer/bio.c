@@ -5,13 +5,15 @@
 #include <stdlib.h>
 #include <string.h> /* strerror */
 #include <errno.h>
+#include <unistd.h> /* usleep */
 #include "lib/ufile.h"
 #include "lib/adlist.h"
-#include "lib/safe_queue.h"
+#include "lib/ring.h"
 #include "service/zoom.h"
 #include "lib/util.h" /* for stringstartwith */
 #include "bio.h"
 #include "lib/mhash.h"
+#include "cache/mcache.h"
 
 /* Thread-synchronization variable for each thread */
 static pthread_mutex_t bio_mutex[CCACHE_NUM_BIO_THREADS];
@@ -20,23 +22,28 @@ static pthread_cond_t bio_condvar[CCACHE_NUM_BIO_THREADS];
 /* Each thread has a list of io-pending jobs */
 static list *bio_jobs[CCACHE_NUM_BIO_THREADS];
 static unsigned long long bio_pending[CCACHE_NUM_BIO_THREADS];
-static safeQueue *bio_job_results[CCACHE_NUM_BIO_THREADS];
+/* Each (master shard, thread) pair has its own ring of finished jobs */
+static ring **bio_job_results;
+#define bioResultRing(shard,tid) (bio_job_results[(shard)*CCACHE_NUM_BIO_THREADS+(tid)])
 
 static sds srcDir;
 static sds tmpDir;
+static size_t sendfile_min_size = CCACHE_SENDFILE_MIN_SIZE;
 
 void *bioProcessBackgroundJobs(void *arg);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
 
-/* Initialize the background system, spawning the thread. */
+/* Initialize the background system, spawning the thread.
+ * The number of master shards must be known at this point. */
 void bioInit(void) {
     zoomServiceInit(srcDir);
     pthread_attr_t attr;
     pthread_t thread;
     size_t stacksize;
     int j;
+    int nrings = cacheMasterNumShards()*CCACHE_NUM_BIO_THREADS;
 
     /* Initialization of state vars and objects */
     for (j = 0; j < CCACHE_NUM_BIO_THREADS; j++) {
@@ -44,8 +51,10 @@ void bioInit(void) {
         pthread_cond_init(&bio_condvar[j],NULL);
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
-        bio_job_results[j] = safeQueueCreate();
     }
+    bio_job_results = malloc(sizeof(ring*)*nrings);
+    for (j = 0; j < nrings; j++)
+        bio_job_results[j] = ringCreate(BIO_RESULT_QUEUE_SIZE,RING_SPSC);
 
     /* Set the stack size as by default it may be small in some system */
     pthread_attr_init(&attr);
@@ -66,25 +75,27 @@ void bioInit(void) {
     }
 }
 
-static int ctid = 0;
-void bioPushGeneralJob(sds name) {
-    bioCreateBackgroundJob(ctid,name,BIO_GENERAL);
-    ctid++;
-    if(ctid == CCACHE_NUM_BIO_THREADS) ctid = 0;
+/* Shared by all master shards */
+static unsigned int ctid = 0;
+#define bioNextThread() (__sync_fetch_and_add(&ctid,1)%CCACHE_NUM_BIO_THREADS)
+void bioPushGeneralJob(int shard, sds name) {
+    bioCreateBackgroundJob(bioNextThread(),shard,name,BIO_GENERAL);
 }
 void bioPushRemoveFileJob(sds name) {
-    bioCreateBackgroundJob(ctid,name,BIO_REMOVE_FILE);
-    ctid++;
-    if(ctid == CCACHE_NUM_BIO_THREADS) ctid = 0;
+    bioCreateBackgroundJob(bioNextThread(),0,name,BIO_REMOVE_FILE);
 }
 
 /* This function is thread-safe */
-void bioCreateBackgroundJob(int tid, sds name,int type) {
+void bioCreateBackgroundJob(int tid, int shard, sds name,int type) {
     struct bio_job *job = malloc(sizeof(*job));
 
     job->time = time(NULL);
     job->name = name;
     job->type = type;
+    job->shard = shard;
+    job->result = NULL;
+    job->fd = -1;
+    job->mtime = 0;
     pthread_mutex_lock(&bio_mutex[tid]);
     listAddNodeTail(bio_jobs[tid],job);
     bio_pending[tid]++;
@@ -112,11 +123,12 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[tid]);
+        job->start = ustime();
 
         /* NOTICE: path must be safe before used */
         if(notsafePath(job->name)) {
             job->result = NULL;
-            safeQueuePush(bio_job_results[tid],job); /* the current job will be freed by master */
+            bioPushResult(tid,job); /* the current job will be freed by master */
             ulog(CCACHE_VERBOSE,"Invalid uri: too long or contain [..]");
             goto finish;
         }
@@ -125,19 +137,20 @@ void *bioProcessBackgroundJobs(void *arg) {
                 /* This is static file job */
                 sds fn = sdsnew(job->name+strlen(SERVICE_STATIC_FILE));
                 sds path = bioPathInSrcDir(fn);
-                job->result = ufileMakeHttpReplyFromFile(path);
+                job->result = ufileOpenBody(path,bioSendfileMinSize(),&job->fd,&job->fsize,
+                                            &job->mtime);
                 sdsfree(fn);
                 sdsfree(path);
-                safeQueuePush(bio_job_results[tid],job); /* the current job will be freed by master */
+                bioPushResult(tid,job); /* the current job will be freed by master */
                 goto finish;
             }
             else if(stringstartwith(job->name,SERVICE_ZOOM)) {
-                zoomImg(bio_job_results[tid],job);
+                zoomImg(tid,job);
                 goto finish;
             }
             else {
                 job->result = NULL;
-                safeQueuePush(bio_job_results[tid],job);
+                bioPushResult(tid,job);
                 goto finish;
             }
         }
@@ -173,16 +186,22 @@ unsigned int bioPendingJobsOfThread(int tid) {
     return val;
 }
 
-int bioGetResult(int tid, sds *name, sds *result) {
-    struct bio_job *job = safeQueuePop(bio_job_results[tid]);
-    if(job)
-    {
-        *name = job->name;
-        *result = job->result;        
-        free(job);
-        return 1;
+/* Hand a finished job over to the master shard which ordered it and wake it
+ * up. When the shard is late, the bio thread waits for room in its ring.
+ * The time spent on the job is the cost of rebuilding its result. */
+void bioPushResult(int tid, struct bio_job *job) {
+    job->cost = ustime()-job->start;
+    while(ringPush(bioResultRing(job->shard,tid),job) != RING_OK) {
+        cacheMasterWakeup(job->shard);
+        usleep(1000);
     }
-    return 0;
+    cacheMasterWakeup(job->shard);
+}
+
+/* The next finished job for the shard, NULL if none. The master takes
+ * its name and result, then frees it. */
+struct bio_job *bioGetResult(int shard, int tid) {
+    return ringPop(bioResultRing(shard,tid));
 }
 
 
@@ -241,3 +260,15 @@ void bioSetDirs(char *sdn, char *tdn)
     ulog(CCACHE_WARNING, "Src Dir: %s\n",srcDir);
     ulog(CCACHE_WARNING, "Tmp Dir: %s\n",tmpDir);;
 }
+
+void bioSetSendfileMinSize(size_t size)
+{
+    sendfile_min_size = size;
+}
+
+/* Size from which a file is kept open rather than read in memory: any
+ * while the process is above its memory budget */
+size_t bioSendfileMinSize(void)
+{
+    return cacheMasterMemoryScarce() ? 0 : sendfile_min_size;
+}
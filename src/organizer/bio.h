@@ -21,22 +21,31 @@
 struct bio_job {
     time_t time; /* Time at which the job was created. */
     int type;
+    int shard; /* master shard waiting for the result */
     sds name;
     sds result;
+    int fd; /* file holding the result instead, -1 if none (see ufileOpenBody) */
+    size_t fsize;
+    time_t mtime; /* of the file of the result, 0 if unknown */
+    long long start; /* when a bio thread picked the job, in microseconds */
+    unsigned long cost; /* microseconds spent producing the result */
 };
 
 void bioSetDirs(char *sdn, char *tdn);
+void bioSetSendfileMinSize(size_t size);
+size_t bioSendfileMinSize(void);
 sds bioPathInSrcDir(sds fn);
 sds bioPathInTmpDirCharPtr(char *str);
 sds bioPathInTmpDirSds(sds fn);
 sds bioPathInTmpDir(char *base, char *str);
 
 void bioInit(void);
-void bioPushGeneralJob(sds name); /* reserved for master  */
+void bioPushGeneralJob(int shard, sds name); /* reserved for master  */
 void bioPushRemoveFileJob(sds name);
 void bioPushWriteFileJob(sds name);
-void bioCreateBackgroundJob(int tid, sds name, int type) ;
+void bioCreateBackgroundJob(int tid, int shard, sds name, int type) ;
 unsigned int bioPendingJobsOfThread(int tid);
-int bioGetResult(int tid, sds *name, sds *result);
+void bioPushResult(int tid, struct bio_job *job);
+struct bio_job *bioGetResult(int shard, int tid);
 
 #endif // BIO_H
@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "service/zoom.h"
 #include "lib/ufile.h"
 #include "lib/util.h"
@@ -44,8 +45,21 @@
 static sds zoomSrcDir;
 static sds zoomTmpDir;
 static int baseoffset; /* len of zoomTmpDir */
+
+/* Allowed sizes and qualities, any if none. Set before the server starts
+ * and only read afterwards. A width or a height of 0 is left free. */
+typedef struct zoomSize {
+    int width;
+    int height;
+} zoomSize;
+static zoomSize zoomSizes[ZOOM_MAX_SIZES];
+static int zoomNumSizes = 0;
+static int zoomQualities[ZOOM_MAX_QUALITIES];
+static int zoomNumQualities = 0;
+static int zoomSnap = ZOOM_SNAP_SERVE;
 static void saveImage(char *dstpath, uchar *buf, size_t len);
 static int img_parse_uri(const char *uri, sds *filename, int *w, int *h, int *c, int *q);
+static int _zoomParseQuery(const char *ptr, const char *end, int *w, int *h, int *c, int *q);
 
 typedef enum {
     uri_start,
@@ -84,18 +98,19 @@ static sds zoomePathInTmpDir(char *str)
     return path;
 }
 
-void zoomImg(safeQueue *sq, struct bio_job *job)
+void zoomImg(int tid, struct bio_job *job)
 {
     /* Search tmp folder */
 
     char *uri = job->name+strlen(SERVICE_ZOOM) + 1;
     sds dstpath = zoomePathInTmpDir(uri);
-    //job->result = ufileMakeHttpReplyFromFile(dstpath);
-    job->result = ufileMmapHttpReply(dstpath);
+    //job->result = ufileReadFile(dstpath);
+    job->result = ufileOpenBody(dstpath,bioSendfileMinSize(),&job->fd,&job->fsize,
+                                &job->mtime);
     printf("After Read File %.2lf \n", (double)(clock()));
-    if(job->result) {
+    if(job->result || job->fd != -1) {
         sdsfree(dstpath);
-        safeQueuePush(sq,job); /* the current job will be freed by master */
+        bioPushResult(tid,job); /* the current job will be freed by master */
         return;
     }
 
@@ -133,6 +148,15 @@ void zoomImg(safeQueue *sq, struct bio_job *job)
     int roi_src_width = src_width;
     int roi_src_height = src_height;
 
+    /* Never upscale: the asked size shrinks, keeping its ratio, to fit */
+    if(width > src_width) {
+        if(height && (height = height*src_width/width) == 0) height = 1;
+        width = src_width;
+    }
+    if(height > src_height) {
+        if(width && (width = width*src_height/height) == 0) width = 1;
+        height = src_height;
+    }
 
     if(width&&height) {
         /* Preserve origial ratio */
@@ -181,16 +205,16 @@ void zoomImg(safeQueue *sq, struct bio_job *job)
 
     buf = enImg->data.ptr;
     len = enImg->rows*enImg->cols;
-    job->result = ufilMakettpReplyFromBuffer(buf,len);
+    job->result = ufileFromBuffer(buf,len);
     job->type |= BIO_WRITE_FILE; /* Remind master of new written file  */
-    safeQueuePush(sq,job);    
+    bioPushResult(tid,job);    
     notpushed = 0;
 
   /* clean up and release resources */
 clean:
     if(notpushed) {
         job->result = NULL;
-        safeQueuePush(sq,job);
+        bioPushResult(tid,job);
     }
     if(fn) sdsfree(fn);
     if(srcpath) sdsfree(srcpath);
@@ -213,9 +237,8 @@ void saveImage(char* dstpath, uchar *buf, size_t len)
 
 int img_parse_uri(const char *uri, sds *filename, int *w, int *h, int *c, int *q)
 {
-    uri_parse_state state = uri_start;
-    int width = 0, height = 0, crop = 1;
-    int quality = 0;
+    uri_parse_state state;
+    int width, height, crop, quality;
     const char *ptr = uri;
     /* uri is of the form: fn?w=x&h=y */
     while(*ptr!='?'&&*ptr++);    
@@ -223,6 +246,33 @@ int img_parse_uri(const char *uri, sds *filename, int *w, int *h, int *c, int *q
     if(!*ptr) return parse_success_no_params; /* No '?' */
     /* *ptr now is '?' */
     ptr++;
+    state = _zoomParseQuery(ptr,ptr+strlen(ptr),&width,&height,&crop,&quality);
+    if(state == parse_error) {
+        ulog(CCACHE_VERBOSE,"parse uri error %s", uri);
+        return parse_error;
+    }
+    else if(width < 0 || width>IMG_MAX_WIDTH || height< 0 || height>IMG_MAX_HEIGHT) {
+        ulog(CCACHE_VERBOSE,"Not conform %d %d %s",width,height,*filename);
+        return parse_error;
+    }
+    /* width and height is ensure to be at least 0 */
+    *w = width;
+    *h = height;
+    *c = crop;
+    if (quality> 0 && quality < 100) *q = quality;
+    return state;
+}
+
+/* The parameters of the query of a zoom uri, from ptr (after '?') to end.
+ * Numbers stop growing once out of their bounds, so that they do not
+ * overflow: a width or a height above the maximum is still refused, a
+ * quality of 100 or more still means the default. */
+static int _zoomParseQuery(const char *ptr, const char *end, int *w, int *h, int *c, int *q)
+{
+    uri_parse_state state = uri_start;
+    int width = 0, height = 0, crop = 1;
+    int quality = 0;
+    if(ptr == end) return parse_error;
     do {
         switch(*ptr) {
         case 'w':
@@ -248,16 +298,16 @@ int img_parse_uri(const char *uri, sds *filename, int *w, int *h, int *c, int *q
         case '8':
         case '9':
             if(state == width_start) {
-                width = width*10 + (*ptr) - '0';
+                if(width <= IMG_MAX_WIDTH) width = width*10 + (*ptr) - '0';
             }
             else if(state == height_start) {
-                height = height*10 + (*ptr) - '0';
+                if(height <= IMG_MAX_HEIGHT) height = height*10 + (*ptr) - '0';
             }
             else if(state == crop_start) {
                 crop = *ptr - '0';
             }
             else if(state == quality_start) {
-                quality = quality*10 + (*ptr) - '0';
+                if(quality < 100) quality = quality*10 + (*ptr) - '0';
             }
             break;
         case '&':
@@ -267,19 +317,185 @@ int img_parse_uri(const char *uri, sds *filename, int *w, int *h, int *c, int *q
             state = parse_error;
             break;
         }
-    }while(*++ptr&&(state!=parse_error));
-    if(state == parse_error) {
-        ulog(CCACHE_VERBOSE,"parse uri error %s", uri);
-        return parse_error;
-    }
-    else if(width < 0 || width>IMG_MAX_WIDTH || height< 0 || height>IMG_MAX_HEIGHT) {
-        ulog(CCACHE_VERBOSE,"Not conform %d %d %s",width,height,*filename);
-        return parse_error;
-    }
-    /* width and height is ensure to be at least 0 */
+    }while(++ptr<end&&(state!=parse_error));
     *w = width;
     *h = height;
     *c = crop;
-    if (quality> 0 && quality < 100) *q = quality;
+    *q = quality;
     return state;
 }
+
+/* Append "?name=value", or "&name=value" after the first parameter, to
+ * the key being written. Returns 0 if it does not fit. */
+static int _zoomCatParam(char *buf, size_t size, size_t *n, size_t path, char name, int value)
+{
+    *n += snprintf(buf+*n,size-*n,"%c%c=%d",*n == path ? '?' : '&',name,value);
+    return *n < size;
+}
+
+/* Parse a list of allowed sizes, "WxH,WxH...", where a width or a height
+ * of 0 is left free: "640x480,320x0" allows 640x480 and any height at a
+ * width of 320. An empty list allows any size. */
+int zoomSetSizes(const char *list)
+{
+    char *end;
+    long width, height;
+    zoomNumSizes = 0;
+    while(*list) {
+        width = strtol(list,&end,10);
+        if(end == list || *end != 'x' || width < 0 || width > IMG_MAX_WIDTH)
+            return CCACHE_ERR;
+        list = end+1;
+        height = strtol(list,&end,10);
+        if(end == list || height < 0 || height > IMG_MAX_HEIGHT || (!width && !height))
+            return CCACHE_ERR;
+        if(*end == ',') end++;
+        else if(*end) return CCACHE_ERR;
+        if(zoomNumSizes == ZOOM_MAX_SIZES) return CCACHE_ERR;
+        zoomSizes[zoomNumSizes].width = width;
+        zoomSizes[zoomNumSizes].height = height;
+        zoomNumSizes++;
+        list = end;
+    }
+    return CCACHE_OK;
+}
+
+/* Parse a list of allowed qualities, "60,80...", each from 1 to 99.
+ * The default quality is always allowed, an empty list allows any. */
+int zoomSetQualities(const char *list)
+{
+    char *end;
+    long quality;
+    zoomNumQualities = 0;
+    while(*list) {
+        quality = strtol(list,&end,10);
+        if(end == list || quality < 1 || quality > 99) return CCACHE_ERR;
+        if(*end == ',') end++;
+        else if(*end) return CCACHE_ERR;
+        if(zoomNumQualities == ZOOM_MAX_QUALITIES) return CCACHE_ERR;
+        zoomQualities[zoomNumQualities++] = quality;
+        list = end;
+    }
+    return CCACHE_OK;
+}
+
+void zoomSetSnap(int mode)
+{
+    zoomSnap = mode;
+}
+
+/* The allowed size nearest to width x height, leaving free the same
+ * sides, ties going to the larger one. Returns 0 if there is none. */
+static int _zoomSnapSize(int *width, int *height)
+{
+    int i, d, best = -1, bestd = 0;
+    if(!zoomNumSizes || (!*width && !*height)) return 1;
+    for(i = 0;i < zoomNumSizes;i++) {
+        zoomSize *zs = zoomSizes+i;
+        if(!zs->width != !*width || !zs->height != !*height) continue;
+        d = abs(zs->width-*width)+abs(zs->height-*height);
+        if(best == -1 || d < bestd ||
+           (d == bestd && zs->width+zs->height > zoomSizes[best].width+zoomSizes[best].height)) {
+            best = i;
+            bestd = d;
+        }
+    }
+    if(best == -1) return 0;
+    *width = zoomSizes[best].width;
+    *height = zoomSizes[best].height;
+    return 1;
+}
+
+/* The allowed quality nearest to quality (1 to 99), ties going up */
+static int _zoomSnapQuality(int quality)
+{
+    int i, best = quality, bestd = -1;
+    for(i = 0;i < zoomNumQualities;i++) {
+        int d = abs(zoomQualities[i]-quality);
+        if(bestd == -1 || d < bestd || (d == bestd && zoomQualities[i] > best)) {
+            best = zoomQualities[i];
+            bestd = d;
+        }
+    }
+    return best;
+}
+
+/* Write in buf SERVICE_ZOOM then the segments of the path from ptr to end,
+ * each after a single '/', leaving out empty and "." segments: "//a/./b"
+ * is "/a/b". Returns the length written, 0 if it does not fit in size. */
+static size_t _zoomCanonicalPath(const char *ptr, const char *end, char *buf, size_t size)
+{
+    size_t n = sizeof(SERVICE_ZOOM)-1, seglen;
+    const char *seg;
+    if(n >= size) return 0;
+    memcpy(buf,SERVICE_ZOOM,n);
+    while(ptr < end) {
+        if(*ptr == '/') {
+            ptr++;
+            continue;
+        }
+        seg = ptr;
+        while(ptr < end && *ptr != '/') ptr++;
+        seglen = ptr-seg;
+        if(seglen == 1 && *seg == '.') continue;
+        if(n+1+seglen >= size) return 0;
+        buf[n++] = '/';
+        memcpy(buf+n,seg,seglen);
+        n += seglen;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* Variants of a zoom uri asking for the same image share one cache key,
+ * hence one object and one file in the tmp dir, whatever:
+ * - the spelling of their path: "/zoom//a/./fn" is "/zoom/a/fn";
+ * - the order of their parameters, their leading zeros or the defaults
+ *   they spell out: "/zoom/fn?w=400&h=300", "?h=300&w=400" and
+ *   "?w=0400&h=300&q=100" are all "/zoom/fn?w=400&h=300".
+ * Parameters are written in the order w, h, c, q, only when they change
+ * the image: c=0 only with both w and h (the whole image is resized
+ * otherwise), q only below 100.
+ * A size or a quality not allowed (see zoomSetSizes()) is snapped to the
+ * nearest allowed one, which is served, redirected to or refused as set
+ * by zoomSetSnap(); a size with no allowed one near is refused.
+ * uri is len bytes, not terminated. A key or a redirect is written in
+ * buf, terminated, and its length in keylen. A uri is its own key if it
+ * is not a zoom uri. A zoom uri naming no file, or a file the image
+ * service refuses (see notsafePath()), is refused here so that it costs
+ * no key. So is one whose key is longer than size: keeping the raw uri
+ * would let a padded path bypass snapping. */
+int zoomCanonicalUri(const char *uri, size_t len, char *buf, size_t size, size_t *keylen)
+{
+    static const char prefix[] = SERVICE_ZOOM "/";
+    const char *query;
+    int width, height, crop, quality, asked_width, asked_height, asked_quality, snapped;
+    size_t path, n;
+    if(len < sizeof(prefix) || memcmp(uri,prefix,sizeof(prefix)-1)) return ZOOM_KEY_OWN;
+    query = memchr(uri,'?',len);
+    path = _zoomCanonicalPath(uri+sizeof(SERVICE_ZOOM)-1,query ? query : uri+len,buf,size);
+    if(path <= sizeof(SERVICE_ZOOM)-1 || notsafePath(buf)) return ZOOM_KEY_REFUSED;
+    if(query == NULL) {
+        *keylen = path;
+        return ZOOM_KEY_CANONICAL;
+    }
+    if(_zoomParseQuery(query+1,uri+len,&width,&height,&crop,&quality) == parse_error ||
+       width > IMG_MAX_WIDTH || height > IMG_MAX_HEIGHT)
+        return ZOOM_KEY_REFUSED;
+    if(quality >= 100) quality = 0;
+    asked_width = width;
+    asked_height = height;
+    asked_quality = quality;
+    if(!_zoomSnapSize(&width,&height)) return ZOOM_KEY_REFUSED;
+    if(quality) quality = _zoomSnapQuality(quality);
+    snapped = width != asked_width || height != asked_height || quality != asked_quality;
+    if(snapped && zoomSnap == ZOOM_SNAP_REFUSE) return ZOOM_KEY_REFUSED;
+    n = path;
+    if((width && !_zoomCatParam(buf,size,&n,path,'w',width)) ||
+       (height && !_zoomCatParam(buf,size,&n,path,'h',height)) ||
+       (width && height && !crop && !_zoomCatParam(buf,size,&n,path,'c',0)) ||
+       (quality && !_zoomCatParam(buf,size,&n,path,'q',quality)))
+        return ZOOM_KEY_REFUSED;
+    *keylen = n;
+    return snapped && zoomSnap == ZOOM_SNAP_REDIRECT ? ZOOM_KEY_REDIRECT : ZOOM_KEY_CANONICAL;
+}
@@ -33,11 +33,26 @@
 #include <highgui.h>
 #include "lib/sds.h"
 #include "ccache_config.h"
-#include "lib/safe_queue.h"
 #include "organizer/bio.h"
 
 #define IMG_ZOOM_DIR_MODE S_IRUSR | S_IWUSR | S_IXUSR
 void zoomServiceInit(sds srcDir);
-void zoomImg(safeQueue *sq, struct bio_job *job);
+void zoomImg(int tid, struct bio_job *job);
+
+/* What zoomCanonicalUri() made of a uri */
+#define ZOOM_KEY_OWN 0       /* the uri is its own key */
+#define ZOOM_KEY_CANONICAL 1 /* the key is in buf */
+#define ZOOM_KEY_REDIRECT 2  /* the client is sent to the uri in buf */
+#define ZOOM_KEY_REFUSED 3   /* not found, without asking the image service */
+
+/* How a zoom asking for a size or a quality not allowed is answered */
+#define ZOOM_SNAP_SERVE 0    /* with the nearest allowed one */
+#define ZOOM_SNAP_REDIRECT 1 /* by a redirect to the nearest allowed one */
+#define ZOOM_SNAP_REFUSE 2   /* not found */
+
+int zoomSetSizes(const char *list);
+int zoomSetQualities(const char *list);
+void zoomSetSnap(int mode);
+int zoomCanonicalUri(const char *uri, size_t len, char *buf, size_t size, size_t *keylen);
 
 #endif // IMG_H
@@ -31,6 +31,14 @@ static struct option const longopts[] =
   {"port", required_argument, NULL, 'p'},
   {"src", required_argument, NULL, 's'},
   {"tmp", required_argument, NULL, 't'},
+  {"masters", required_argument, NULL, 'm'},
+  {"evict", required_argument, NULL, 'e'},
+  {"hugepages", no_argument, NULL, 'H'},
+  {"accept", required_argument, NULL, 'a'},
+  {"sendfile", required_argument, NULL, 'f'},
+  {"zoom-sizes", required_argument, NULL, 'z'},
+  {"zoom-qualities", required_argument, NULL, 'q'},
+  {"zoom-snap", required_argument, NULL, 'n'},
   {GETOPT_HELP_OPTION_DECL},
   {GETOPT_VERSION_OPTION_DECL},
   {NULL, 0, NULL, 0}
@@ -42,6 +50,12 @@ struct ccache_options {
     int port;
     char *srcd;
     char *tmpd;
+    int masters;
+    char *evict;
+    int hugepages;
+    int accept;
+    long sendfile;
+    int zoomsnap;
 };
 
 
@@ -55,12 +69,31 @@ void usage (int status)
       printf (("Usage: %s [PORT]... [SRC_DIR]... [TMP_DIR]\n" \
               "With no SRC_DIR, the current directory is used as input dir.\n"\
               "With no TMP_DIR, the /tmp directory is used as tmp dir.\n"\
-              "\n"),program_name);
+              "\n"\
+              "      --masters=N  number of master cache shards (default %d)\n"\
+              "      --evict=POLICY  eviction policy: gdsf, s3fifo, tinylfu or fifo (default %s)\n"\
+              "      --hugepages  back cached replies by huge pages (reserved, else transparent)\n"\
+              "      --accept=MODE  reuseport (a socket per worker) or exclusive (default %s)\n"\
+              "      --sendfile=BYTES  files from this size are sent from disk, not cached (default %d)\n"\
+              "      --zoom-sizes=WxH,...  sizes a zoom may ask for, 0 leaving a side free (default any)\n"\
+              "      --zoom-qualities=Q,...  qualities a zoom may ask for, 1 to 99 (default any)\n"\
+              "      --zoom-snap=MODE  other zooms get the nearest allowed one: serve, redirect or refuse (default %s)\n"\
+              "\n"),program_name,CCACHE_NUM_MASTER_SHARDS,CCACHE_EVICT_POLICY,CCACHE_ACCEPT_MODE,
+              CCACHE_SENDFILE_MIN_SIZE,ZOOM_SNAP_MODE);
     }
 
   exit (status);
 }
 
+/* ZOOM_SNAP_* of a --zoom-snap mode, -1 if unknown */
+static int zoomSnapMode(const char *mode)
+{
+    if(!strcmp(mode,"serve")) return ZOOM_SNAP_SERVE;
+    if(!strcmp(mode,"redirect")) return ZOOM_SNAP_REDIRECT;
+    if(!strcmp(mode,"refuse")) return ZOOM_SNAP_REFUSE;
+    return -1;
+}
+
 struct ccache_options getOptions(int argc, char *argv[])
 {
     struct ccache_options options;
@@ -68,8 +101,15 @@ struct ccache_options getOptions(int argc, char *argv[])
     options.port = 80;
     options.srcd = ".";
     options.tmpd = ".";
+    options.masters = CCACHE_NUM_MASTER_SHARDS;
+    options.evict = CCACHE_EVICT_POLICY;
+    options.hugepages = 0;
+    options.accept = strcmp(CCACHE_ACCEPT_MODE,"exclusive") ?
+                     HTTP_ACCEPT_REUSEPORT : HTTP_ACCEPT_EXCLUSIVE;
+    options.sendfile = CCACHE_SENDFILE_MIN_SIZE;
+    options.zoomsnap = zoomSnapMode(ZOOM_SNAP_MODE);
     int optc;
-    while ((optc = getopt_long (argc, argv, "ps:tZ:", longopts, NULL)) != -1)
+    while ((optc = getopt_long (argc, argv, "ps:tm:e:Ha:f:z:q:n:Z:", longopts, NULL)) != -1)
       {
         switch (optc)
           {
@@ -85,6 +125,58 @@ struct ccache_options getOptions(int argc, char *argv[])
           case 't': /* --verbose  */
             options.tmpd = optarg;
             break;
+          case 'm':
+            if((options.masters = atoi(optarg)) < 1
+                    || options.masters > CCACHE_MAX_MASTER_SHARDS) {
+                printf("ERROR: Invalid number of masters [%s].\nIt must be between 1 and %d.\n",
+                       optarg,CCACHE_MAX_MASTER_SHARDS);
+                usage(EXIT_FAILURE);
+            }
+            break;
+          case 'e':
+            if(evictPolicyGet(optarg) == NULL) {
+                printf("ERROR: Invalid eviction policy [%s].\n",optarg);
+                usage(EXIT_FAILURE);
+            }
+            options.evict = optarg;
+            break;
+          case 'H':
+            options.hugepages = 1;
+            break;
+          case 'a':
+            if(!strcmp(optarg,"reuseport")) options.accept = HTTP_ACCEPT_REUSEPORT;
+            else if(!strcmp(optarg,"exclusive")) options.accept = HTTP_ACCEPT_EXCLUSIVE;
+            else {
+                printf("ERROR: Invalid accept mode [%s].\n",optarg);
+                usage(EXIT_FAILURE);
+            }
+            break;
+          case 'f':
+            if((options.sendfile = atol(optarg)) < 0) {
+                printf("ERROR: Invalid sendfile size [%s].\n",optarg);
+                usage(EXIT_FAILURE);
+            }
+            break;
+          case 'z':
+            if(zoomSetSizes(optarg) != CCACHE_OK) {
+                printf("ERROR: Invalid zoom sizes [%s].\nAt most %d sizes WxH, up to %dx%d.\n",
+                       optarg,ZOOM_MAX_SIZES,IMG_MAX_WIDTH,IMG_MAX_HEIGHT);
+                usage(EXIT_FAILURE);
+            }
+            break;
+          case 'q':
+            if(zoomSetQualities(optarg) != CCACHE_OK) {
+                printf("ERROR: Invalid zoom qualities [%s].\nAt most %d qualities, from 1 to 99.\n",
+                       optarg,ZOOM_MAX_QUALITIES);
+                usage(EXIT_FAILURE);
+            }
+            break;
+          case 'n':
+            if((options.zoomsnap = zoomSnapMode(optarg)) == -1) {
+                printf("ERROR: Invalid zoom snap mode [%s].\n",optarg);
+                usage(EXIT_FAILURE);
+            }
+            break;
           case GETOPT_HELP_CHAR:
             usage (EXIT_SUCCESS);
             break;